@@ -0,0 +1,362 @@
+#include "arrow-writer.h"
+
+#include <algorithm>
+
+#include "logger.h"
+
+namespace {
+
+// Values from the Arrow format's Schema.fbs and Message.fbs.
+constexpr int16_t kMetadataV5 = 4;
+constexpr uint8_t kHeaderSchema = 1;
+constexpr uint8_t kHeaderRecordBatch = 3;
+constexpr uint8_t kTypeInt = 2;
+constexpr uint8_t kTypeFloatingPoint = 3;
+constexpr uint8_t kTypeUtf8 = 5;
+constexpr uint8_t kTypeList = 12;
+constexpr int16_t kPrecisionSingle = 1;
+constexpr int16_t kPrecisionDouble = 2;
+constexpr uint32_t kContinuation = 0xffffffffu;
+
+size_t Pad8(size_t size) { return (size + 7) & ~size_t(7); }
+
+// Builds a flatbuffer front to back: a table is laid out before the objects
+// it references, and their offsets are filled in once they are written, so
+// every offset points forward as the format requires.
+class FlatBuilder {
+ public:
+  FlatBuilder() : buffer(4, 0) {}  // Root offset
+
+  class Table {
+   public:
+    template <typename T>
+    void Scalar(int id, T value) {
+      Field field{id, sizeof(T), 0, 0};
+      std::memcpy(&field.bits, &value, sizeof(T));
+      fields.push_back(field);
+    }
+
+    // An offset to an object written later and linked with Link().
+    void Offset(int id) { fields.push_back({id, 4, 0, 0}); }
+
+    size_t End(FlatBuilder& builder) {
+      std::stable_sort(
+          fields.begin(), fields.end(), [](const Field& a, const Field& b) {
+            return a.size > b.size;
+          }
+      );
+
+      uint16_t size = 4;  // Offset to the vtable
+      int maxId = -1;
+      for (auto& field : fields) {
+        size = static_cast<uint16_t>((size + field.size - 1) / field.size *
+                                     field.size);
+        field.offset = size;
+        size = static_cast<uint16_t>(size + field.size);
+        maxId = std::max(maxId, field.id);
+      }
+
+      builder.Align(2);
+      const size_t vtable = builder.buffer.size();
+      std::vector<uint16_t> slots(maxId + 1, 0);
+      for (const auto& field : fields) {
+        slots[field.id] = field.offset;
+      }
+      builder.Append<uint16_t>(static_cast<uint16_t>(4 + 2 * slots.size()));
+      builder.Append<uint16_t>(size);
+      for (auto slot : slots) {
+        builder.Append<uint16_t>(slot);
+      }
+
+      builder.Align(8);
+      position = builder.buffer.size();
+      builder.buffer.resize(position + size, 0);
+      builder.Put<int32_t>(position, static_cast<int32_t>(position - vtable));
+      for (const auto& field : fields) {
+        std::memcpy(
+            &builder.buffer[position + field.offset], &field.bits, field.size
+        );
+      }
+      return position;
+    }
+
+    [[nodiscard]] size_t At(int id) const {
+      for (const auto& field : fields) {
+        if (field.id == id) {
+          return position + field.offset;
+        }
+      }
+      return 0;
+    }
+
+   private:
+    struct Field {
+      int id;
+      uint16_t size;
+      uint16_t offset;
+      uint64_t bits;
+    };
+
+    std::vector<Field> fields;
+    size_t position = 0;
+  };
+
+  std::vector<uint8_t> buffer;
+
+  void Align(size_t alignment) {
+    buffer.resize((buffer.size() + alignment - 1) / alignment * alignment, 0);
+  }
+
+  template <typename T>
+  void Append(T value) {
+    const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+  }
+
+  template <typename T>
+  void Put(size_t at, T value) {
+    std::memcpy(&buffer[at], &value, sizeof(T));
+  }
+
+  void Link(size_t at, size_t target) {
+    Put<uint32_t>(at, static_cast<uint32_t>(target - at));
+  }
+
+  size_t String(std::string_view text) {
+    Align(4);
+    const size_t position = buffer.size();
+    Append<uint32_t>(static_cast<uint32_t>(text.size()));
+    buffer.insert(buffer.end(), text.begin(), text.end());
+    buffer.push_back(0);
+    return position;
+  }
+
+  // Returns the vector's position; its slots start 4 bytes later.
+  size_t OffsetVector(size_t count) {
+    Align(4);
+    const size_t position = buffer.size();
+    Append<uint32_t>(static_cast<uint32_t>(count));
+    buffer.resize(buffer.size() + 4 * count, 0);
+    return position;
+  }
+
+  // Vector of structs of two 64-bit integers (FieldNode and Buffer).
+  size_t PairVector(const std::vector<std::pair<int64_t, int64_t>>& pairs) {
+    Align(4);
+    if (buffer.size() % 8 == 0) {
+      Append<uint32_t>(0);
+    }
+    const size_t position = buffer.size();
+    Append<uint32_t>(static_cast<uint32_t>(pairs.size()));
+    for (const auto& [first, second] : pairs) {
+      Append<int64_t>(first);
+      Append<int64_t>(second);
+    }
+    return position;
+  }
+};
+
+// Flatbuffer type of a column, or of the items of a list column.
+struct TypeInfo {
+  uint8_t id;
+  int16_t precision;  // FloatingPoint only
+};
+
+bool IsList(ArrowType type) {
+  return type == ArrowType::Int32List || type == ArrowType::Float32List;
+}
+
+TypeInfo ValueType(ArrowType type) {
+  switch (type) {
+    case ArrowType::Utf8:
+      return {kTypeUtf8, 0};
+    case ArrowType::Int32:
+    case ArrowType::Int32List:
+      return {kTypeInt, 0};
+    case ArrowType::Float64:
+      return {kTypeFloatingPoint, kPrecisionDouble};
+    case ArrowType::Float32List:
+      return {kTypeFloatingPoint, kPrecisionSingle};
+  }
+  return {kTypeUtf8, 0};
+}
+
+size_t WriteField(
+    FlatBuilder& builder,
+    const std::string& name,
+    TypeInfo type,
+    const TypeInfo* item
+) {
+  FlatBuilder::Table field;
+  field.Offset(0);  // name
+  field.Scalar<uint8_t>(1, 1);  // nullable
+  field.Scalar<uint8_t>(2, item ? kTypeList : type.id);  // type_type
+  field.Offset(3);  // type
+  field.Offset(5);  // children
+  const size_t position = field.End(builder);
+
+  builder.Link(field.At(0), builder.String(name));
+
+  FlatBuilder::Table typeTable;
+  if (!item && type.id == kTypeInt) {
+    typeTable.Scalar<int32_t>(0, 32);  // bitWidth
+    typeTable.Scalar<uint8_t>(1, 1);   // is_signed
+  } else if (!item && type.id == kTypeFloatingPoint) {
+    typeTable.Scalar<int16_t>(0, type.precision);
+  }
+  builder.Link(field.At(3), typeTable.End(builder));
+
+  const size_t children = builder.OffsetVector(item ? 1 : 0);
+  builder.Link(field.At(5), children);
+  if (item) {
+    builder.Link(children + 4, WriteField(builder, "item", *item, nullptr));
+  }
+  return position;
+}
+
+// The Message table wrapping a Schema or RecordBatch header. Returns the
+// position of the header offset, to be linked to the header table.
+size_t BeginMessage(
+    FlatBuilder& builder, uint8_t headerType, int64_t bodyLength
+) {
+  FlatBuilder::Table message;
+  message.Scalar<int16_t>(0, kMetadataV5);
+  message.Scalar<uint8_t>(1, headerType);
+  message.Offset(2);
+  message.Scalar<int64_t>(3, bodyLength);
+  builder.Link(0, message.End(builder));
+  return message.At(2);
+}
+
+}  // namespace
+
+bool ArrowStreamWriter::Open(
+    const std::string& path, const std::vector<ArrowField>& streamFields
+) {
+  file.open(path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    LogError("Failed to open Arrow output", {{"path", path}});
+    return false;
+  }
+
+  fields = streamFields;
+  columns.clear();
+  for (const auto& field : fields) {
+    ArrowColumn column;
+    column.type = field.type;
+    columns.push_back(std::move(column));
+  }
+  rows = 0;
+
+  FlatBuilder builder;
+  const size_t header = BeginMessage(builder, kHeaderSchema, 0);
+
+  FlatBuilder::Table schema;
+  schema.Scalar<int16_t>(0, 0);  // Little endian
+  schema.Offset(1);
+  builder.Link(header, schema.End(builder));
+
+  const size_t vector = builder.OffsetVector(fields.size());
+  builder.Link(schema.At(1), vector);
+  for (size_t i = 0; i < fields.size(); ++i) {
+    const TypeInfo type = ValueType(fields[i].type);
+    const TypeInfo* item = IsList(fields[i].type) ? &type : nullptr;
+    builder.Link(
+        vector + 4 + 4 * i, WriteField(builder, fields[i].name, type, item)
+    );
+  }
+
+  return WriteMessage(builder.buffer, {});
+}
+
+bool ArrowStreamWriter::Flush() {
+  if (rows == 0) {
+    return true;
+  }
+
+  std::vector<std::pair<int64_t, int64_t>> nodes;
+  std::vector<std::pair<int64_t, int64_t>> buffers;
+  std::vector<uint8_t> body;
+
+  auto addBuffer = [&](const uint8_t* data, size_t size) {
+    buffers.emplace_back(body.size(), size);
+    body.insert(body.end(), data, data + size);
+    body.resize(Pad8(body.size()), 0);
+  };
+  auto addOffsets = [&](const ArrowColumn& column) {
+    addBuffer(
+        reinterpret_cast<const uint8_t*>(column.offsets.data()),
+        column.offsets.size() * sizeof(int32_t)
+    );
+  };
+
+  for (const auto& column : columns) {
+    nodes.emplace_back(rows, 0);
+    addBuffer(nullptr, 0);  // No validity bitmap: nothing is null
+
+    if (column.type == ArrowType::Utf8) {
+      addOffsets(column);
+    } else if (IsList(column.type)) {
+      addOffsets(column);
+      nodes.emplace_back(column.offsets.back(), 0);
+      addBuffer(nullptr, 0);
+    }
+    addBuffer(column.values.data(), column.values.size());
+  }
+
+  FlatBuilder builder;
+  const size_t header = BeginMessage(
+      builder, kHeaderRecordBatch, static_cast<int64_t>(body.size())
+  );
+
+  FlatBuilder::Table batch;
+  batch.Scalar<int64_t>(0, static_cast<int64_t>(rows));
+  batch.Offset(1);
+  batch.Offset(2);
+  builder.Link(header, batch.End(builder));
+  builder.Link(batch.At(1), builder.PairVector(nodes));
+  builder.Link(batch.At(2), builder.PairVector(buffers));
+
+  for (auto& column : columns) {
+    column.offsets.assign(1, 0);
+    column.values.clear();
+  }
+  rows = 0;
+  ++recordBatches;
+
+  return WriteMessage(builder.buffer, body);
+}
+
+bool ArrowStreamWriter::Close() {
+  if (!file.is_open()) {
+    return true;
+  }
+
+  const bool flushed = Flush();
+  const uint32_t end[2] = {kContinuation, 0};
+  file.write(reinterpret_cast<const char*>(end), sizeof(end));
+  bytesWritten += sizeof(end);
+  file.close();
+
+  return flushed && !file.fail();
+}
+
+bool ArrowStreamWriter::WriteMessage(
+    const std::vector<uint8_t>& metadata, const std::vector<uint8_t>& body
+) {
+  const auto metadataSize = static_cast<int32_t>(Pad8(metadata.size()));
+  const char padding[8] = {};
+
+  file.write(reinterpret_cast<const char*>(&kContinuation), 4);
+  file.write(reinterpret_cast<const char*>(&metadataSize), 4);
+  file.write(reinterpret_cast<const char*>(metadata.data()), metadata.size());
+  file.write(padding, metadataSize - metadata.size());
+  file.write(reinterpret_cast<const char*>(body.data()), body.size());
+  bytesWritten += 8 + metadataSize + body.size();
+
+  if (!file) {
+    LogError("Failed to write Arrow output");
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class ArrowType {
+  Utf8,
+  Int32,
+  Float64,
+  Int32List,
+  Float32List,
+};
+
+struct ArrowField {
+  std::string name;
+  ArrowType type;
+};
+
+// Buffers of one column of the record batch being built. Strings and lists
+// keep 32-bit offsets into `values`; no column holds nulls.
+struct ArrowColumn {
+  ArrowType type;
+  std::vector<int32_t> offsets{0};
+  std::vector<uint8_t> values;
+
+  void AppendString(std::string_view text) {
+    values.insert(values.end(), text.begin(), text.end());
+    offsets.push_back(static_cast<int32_t>(values.size()));
+  }
+
+  template <typename T>
+  void AppendValue(T value) {
+    const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+    values.insert(values.end(), bytes, bytes + sizeof(T));
+  }
+
+  template <typename T>
+  void AppendList(const std::vector<T>& list) {
+    const auto* bytes = reinterpret_cast<const uint8_t*>(list.data());
+    values.insert(values.end(), bytes, bytes + list.size() * sizeof(T));
+    offsets.push_back(static_cast<int32_t>(values.size() / sizeof(T)));
+  }
+};
+
+// Writes rows as an Arrow IPC stream (schema message, record batches, end
+// of stream marker) without depending on the Arrow library. Rows are
+// buffered column by column and written as one record batch per Flush(),
+// so memory is bounded by the rows of a single batch.
+class ArrowStreamWriter {
+ public:
+  bool Open(const std::string& path, const std::vector<ArrowField>& fields);
+
+  [[nodiscard]] ArrowColumn& Column(size_t index) { return columns[index]; }
+  void FinishRow() { ++rows; }
+  [[nodiscard]] size_t BufferedRows() const { return rows; }
+
+  // Writes the buffered rows as a record batch.
+  bool Flush();
+  // Flushes and ends the stream.
+  bool Close();
+
+  [[nodiscard]] size_t RecordBatches() const { return recordBatches; }
+  [[nodiscard]] size_t BytesWritten() const { return bytesWritten; }
+
+ private:
+  std::ofstream file;
+  std::vector<ArrowField> fields;
+  std::vector<ArrowColumn> columns;
+  size_t rows = 0;
+  size_t recordBatches = 0;
+  size_t bytesWritten = 0;
+
+  bool WriteMessage(
+      const std::vector<uint8_t>& metadata, const std::vector<uint8_t>& body
+  );
+};
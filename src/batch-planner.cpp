@@ -0,0 +1,36 @@
+#include "batch-planner.h"
+
+void BatchPlanner::Add(
+    size_t request, size_t promptTokens, size_t expectedTokens, size_t cells
+) {
+  buckets[{Bucket(expectedTokens), Bucket(promptTokens)}].push_back(
+      {request, cells}
+  );
+  ++size;
+}
+
+std::optional<size_t> BatchPlanner::Next(size_t freeCells) {
+  for (auto it = buckets.begin(); it != buckets.end(); ++it) {
+    const Entry entry = it->second.front();
+    if (entry.cells > freeCells) {
+      continue;
+    }
+
+    it->second.pop_front();
+    if (it->second.empty()) {
+      buckets.erase(it);
+    }
+    --size;
+    return entry.request;
+  }
+  return std::nullopt;
+}
+
+int BatchPlanner::Bucket(size_t tokens) {
+  int bucket = 0;
+  while (tokens > 1) {
+    tokens >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <optional>
+#include <utility>
+
+// Requests waiting for a generation slot, bucketed by the power of two of
+// their expected output and prompt lengths. Buckets with longer outputs are
+// served first, so the longest requests start early and short ones fill the
+// slots that free up towards the end of a run instead of one long request
+// running alone. Within a bucket requests keep their submission order.
+class BatchPlanner {
+ public:
+  // `cells` is what the request reserves in the KV cache while it runs.
+  void Add(
+      size_t request, size_t promptTokens, size_t expectedTokens, size_t cells
+  );
+
+  // Removes and returns the first request, in bucket order, that needs at
+  // most `freeCells`. Only the head of each bucket is considered, so a
+  // request larger than the free space does not hold up smaller buckets.
+  std::optional<size_t> Next(size_t freeCells);
+
+  [[nodiscard]] bool Empty() const { return buckets.empty(); }
+  [[nodiscard]] size_t Size() const { return size; }
+
+ private:
+  struct Entry {
+    size_t request;
+    size_t cells;
+  };
+
+  using Key = std::pair<int, int>;  // Output bucket, prompt bucket
+
+  std::map<Key, std::deque<Entry>, std::greater<Key>> buckets;
+  size_t size = 0;
+
+  static int Bucket(size_t tokens);
+};
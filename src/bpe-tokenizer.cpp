@@ -0,0 +1,598 @@
+#include "bpe-tokenizer.h"
+
+#include <algorithm>
+#include "llama.h"
+#include "logger.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+enum CharClass : uint8_t {
+  kOther = 0,
+  kLetter,
+  kDigit,
+  kSpace,
+  kNewline,
+};
+
+struct CharClassTable {
+  CharClass classes[128] = {};
+
+  CharClassTable() {
+    for (int c = 'a'; c <= 'z'; ++c) classes[c] = kLetter;
+    for (int c = 'A'; c <= 'Z'; ++c) classes[c] = kLetter;
+    for (int c = '0'; c <= '9'; ++c) classes[c] = kDigit;
+    classes[static_cast<int>(' ')] = kSpace;
+    classes[static_cast<int>('\t')] = kSpace;
+    classes[static_cast<int>('\v')] = kSpace;
+    classes[static_cast<int>('\f')] = kSpace;
+    classes[static_cast<int>('\r')] = kNewline;
+    classes[static_cast<int>('\n')] = kNewline;
+  }
+};
+
+const CharClassTable kCharClasses;
+
+inline CharClass ClassOf(char c) {
+  return kCharClasses.classes[static_cast<unsigned char>(c) & 0x7f];
+}
+
+inline bool IsWhitespace(CharClass c) { return c == kSpace || c == kNewline; }
+
+bool IsAscii(const char* data, size_t size) {
+  size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+  for (; i + 16 <= size; i += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)
+    );
+    if (_mm_movemask_epi8(chunk) != 0) return false;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; i + 16 <= size; i += 16) {
+    uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(data + i));
+    if (vmaxvq_u8(chunk) >= 0x80) return false;
+  }
+#endif
+  for (; i < size; ++i) {
+    if (static_cast<unsigned char>(data[i]) >= 0x80) return false;
+  }
+  return true;
+}
+
+// Returns the end of the run of ' ' characters starting at `i`. Indentation
+// and padding make long space runs common enough to scan 16 bytes at a time.
+size_t SkipSpaces(const char* data, size_t size, size_t i) {
+#if defined(__SSE2__)
+  const __m128i spaces = _mm_set1_epi8(' ');
+  for (; i + 16 <= size; i += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)
+    );
+    auto mask = static_cast<unsigned>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, spaces))
+    );
+    if (mask != 0xffff) return i + __builtin_ctz(~mask);
+  }
+#endif
+  while (i < size && data[i] == ' ') ++i;
+  return i;
+}
+
+// Returns the end of the pre-token starting at `i`. This is the Llama 3 split
+// expression restricted to ASCII input:
+//   (?i:'s|'t|'re|'ve|'m|'ll|'d) | [^\r\n\p{L}\p{N}]?\p{L}+ | \p{N}{1,3} |
+//    ?[^\s\p{L}\p{N}]+[\r\n]* | \s*[\r\n]+ | \s+(?!\S) | \s+
+size_t NextPreToken(const char* data, size_t size, size_t i) {
+  const CharClass c = ClassOf(data[i]);
+
+  if (data[i] == '\'' && i + 1 < size) {
+    const char n1 = static_cast<char>(data[i + 1] | 0x20);
+    if (n1 == 's' || n1 == 't' || n1 == 'm' || n1 == 'd') return i + 2;
+    if (i + 2 < size) {
+      const char n2 = static_cast<char>(data[i + 2] | 0x20);
+      if ((n1 == 'r' && n2 == 'e') || (n1 == 'v' && n2 == 'e') ||
+          (n1 == 'l' && n2 == 'l')) {
+        return i + 3;
+      }
+    }
+  }
+
+  size_t j = i;
+  if (c != kLetter && c != kDigit && c != kNewline && i + 1 < size &&
+      ClassOf(data[i + 1]) == kLetter) {
+    j = i + 1;
+  }
+  if (ClassOf(data[j]) == kLetter) {
+    while (j < size && ClassOf(data[j]) == kLetter) ++j;
+    return j;
+  }
+
+  if (c == kDigit) {
+    j = i + 1;
+    while (j < size && j < i + 3 && ClassOf(data[j]) == kDigit) ++j;
+    return j;
+  }
+
+  j = i;
+  if (data[j] == ' ' && j + 1 < size && ClassOf(data[j + 1]) == kOther) ++j;
+  if (ClassOf(data[j]) == kOther) {
+    while (j < size && ClassOf(data[j]) == kOther) ++j;
+    while (j < size && ClassOf(data[j]) == kNewline) ++j;
+    return j;
+  }
+
+  size_t end = i;
+  size_t lastNewline = size;
+  while (end < size) {
+    end = SkipSpaces(data, size, end);
+    if (end >= size || !IsWhitespace(ClassOf(data[end]))) break;
+    if (ClassOf(data[end]) == kNewline) lastNewline = end;
+    ++end;
+  }
+  if (lastNewline != size) return lastNewline + 1;
+  if (end == size || end - i < 2) return end;
+  return end - 1;
+}
+
+// GPT-2 byte-to-unicode mapping used by byte-level BPE vocabularies.
+std::string ByteToUnicode(unsigned char byte) {
+  uint32_t codepoint = byte;
+  if (!((byte >= 33 && byte <= 126) || (byte >= 161 && byte <= 172) ||
+        byte >= 174)) {
+    uint32_t shifted = 0;
+    for (uint32_t b = 0; b < byte; ++b) {
+      if (!((b >= 33 && b <= 126) || (b >= 161 && b <= 172) || b >= 174)) {
+        ++shifted;
+      }
+    }
+    codepoint = 256 + shifted;
+  }
+
+  std::string utf8;
+  if (codepoint < 0x80) {
+    utf8 += static_cast<char>(codepoint);
+  } else {
+    utf8 += static_cast<char>(0xc0 | (codepoint >> 6));
+    utf8 += static_cast<char>(0x80 | (codepoint & 0x3f));
+  }
+  return utf8;
+}
+
+inline uint64_t MergeKey(llama_token left, llama_token right) {
+  return (static_cast<uint64_t>(static_cast<uint32_t>(left)) << 32) |
+         static_cast<uint32_t>(right);
+}
+
+constexpr uint64_t kEmptyMergeKey = ~0ull;
+
+struct Symbol {
+  llama_token id;
+  int prev;
+  int next;
+};
+
+struct Bigram {
+  int32_t rank;
+  int left;
+  llama_token leftId;
+  llama_token rightId;
+  llama_token merged;
+
+  // Heap order: lowest rank first, leftmost first among equal ranks.
+  bool operator<(const Bigram& other) const {
+    return rank > other.rank || (rank == other.rank && left > other.left);
+  }
+};
+
+}  // namespace
+
+bool BpeTokenizer::Initialize(
+    const llama_model* llamaModel,
+    const std::string& modelPath,
+    size_t cacheCapacity
+) {
+  model = llamaModel;
+  cache.reset();
+
+  if (llama_vocab_type(model) != LLAMA_VOCAB_TYPE_BPE) {
+    return false;
+  }
+
+  char preTokenizer[64] = {};
+  if (llama_model_meta_val_str(
+          model, "tokenizer.ggml.pre", preTokenizer, sizeof(preTokenizer)
+      ) < 0 ||
+      std::string(preTokenizer) != "llama-bpe") {
+    return false;
+  }
+
+  const int nVocabulary = llama_n_vocab(model);
+  tokenTexts.clear();
+  tokenTexts.reserve(nVocabulary);
+  tokenIds.clear();
+  tokenIds.reserve(nVocabulary);
+  specialTokens.clear();
+  std::fill(std::begin(specialFirstByte), std::end(specialFirstByte), false);
+  hasUserDefinedTokens = false;
+
+  for (llama_token id = 0; id < nVocabulary; ++id) {
+    tokenTexts.emplace_back(llama_token_get_text(model, id));
+  }
+  for (llama_token id = 0; id < nVocabulary; ++id) {
+    const std::string& text = tokenTexts[id];
+    tokenIds.emplace(text, id);
+
+    const auto attr = llama_token_get_attr(model, id);
+    if (!text.empty() &&
+        (attr & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_USER_DEFINED |
+                 LLAMA_TOKEN_ATTR_UNKNOWN))) {
+      const bool userDefined = (attr & LLAMA_TOKEN_ATTR_USER_DEFINED) != 0;
+      specialTokens.push_back({text, id, userDefined});
+      specialFirstByte[static_cast<unsigned char>(text[0])] = true;
+      hasUserDefinedTokens |= userDefined;
+    }
+  }
+  std::stable_sort(
+      specialTokens.begin(),
+      specialTokens.end(),
+      [](const SpecialToken& a, const SpecialToken& b) {
+        return a.text.size() > b.text.size();
+      }
+  );
+
+  for (int byte = 0; byte < 256; ++byte) {
+    auto it = tokenIds.find(ByteToUnicode(static_cast<unsigned char>(byte)));
+    if (it == tokenIds.end()) {
+      return false;
+    }
+    byteTokens[byte] = it->second;
+  }
+
+  if (!LoadMerges(modelPath)) {
+    LogWarning("Failed to load BPE merges", {{"path", modelPath}});
+    return false;
+  }
+
+  addBosToken = llama_add_bos_token(model) > 0;
+  bosToken = llama_token_bos(model);
+
+  if (!MatchesReference()) {
+    LogWarning(
+        "Native tokenizer disagrees with llama_tokenize, falling back to "
+        "llama_tokenize"
+    );
+    return false;
+  }
+
+  // Created after the reference check so the probe words are not counted.
+  if (cacheCapacity > 0) {
+    cache = std::make_unique<WordCache>(cacheCapacity);
+  }
+
+  return true;
+}
+
+TokenizerCacheStats BpeTokenizer::GetCacheStats() const {
+  return cache ? cache->GetStats() : TokenizerCacheStats{};
+}
+
+bool BpeTokenizer::LoadMerges(const std::string& modelPath) {
+  gguf_init_params params = {true, nullptr};
+  gguf_context* gguf = gguf_init_from_file(modelPath.c_str(), params);
+  if (!gguf) {
+    return false;
+  }
+
+  const int key = gguf_find_key(gguf, "tokenizer.ggml.merges");
+  if (key < 0) {
+    gguf_free(gguf);
+    return false;
+  }
+
+  const int nMerges = gguf_get_arr_n(gguf, key);
+  size_t capacity = 16;
+  mergeShift = 60;
+  while (capacity < static_cast<size_t>(nMerges) * 2) {
+    capacity <<= 1;
+    --mergeShift;
+  }
+  merges.assign(capacity, {kEmptyMergeKey, 0, 0});
+
+  std::string mergedText;
+  for (int rank = 0; rank < nMerges; ++rank) {
+    std::string_view merge = gguf_get_arr_str(gguf, key, rank);
+    const size_t separator = merge.find(' ', 1);
+    if (separator == std::string_view::npos) {
+      continue;
+    }
+
+    const std::string_view leftText = merge.substr(0, separator);
+    const std::string_view rightText = merge.substr(separator + 1);
+    mergedText.assign(leftText);
+    mergedText.append(rightText);
+
+    auto left = tokenIds.find(leftText);
+    auto right = tokenIds.find(rightText);
+    auto merged = tokenIds.find(mergedText);
+    if (left == tokenIds.end() || right == tokenIds.end() ||
+        merged == tokenIds.end()) {
+      continue;
+    }
+
+    InsertMerge(left->second, right->second, rank, merged->second);
+  }
+
+  gguf_free(gguf);
+  return true;
+}
+
+void BpeTokenizer::InsertMerge(
+    llama_token left, llama_token right, int32_t rank, llama_token merged
+) {
+  const uint64_t key = MergeKey(left, right);
+  const size_t mask = merges.size() - 1;
+  size_t slot = (key * 0x9e3779b97f4a7c15ull) >> mergeShift;
+  while (merges[slot].key != kEmptyMergeKey) {
+    if (merges[slot].key == key) {
+      return;  // Keep the first (lowest) rank, like llama.cpp does
+    }
+    slot = (slot + 1) & mask;
+  }
+  merges[slot] = {key, rank, merged};
+}
+
+const BpeTokenizer::MergeEntry* BpeTokenizer::FindMerge(
+    llama_token left, llama_token right
+) const {
+  const uint64_t key = MergeKey(left, right);
+  const size_t mask = merges.size() - 1;
+  size_t slot = (key * 0x9e3779b97f4a7c15ull) >> mergeShift;
+  while (merges[slot].key != kEmptyMergeKey) {
+    if (merges[slot].key == key) {
+      return &merges[slot];
+    }
+    slot = (slot + 1) & mask;
+  }
+  return nullptr;
+}
+
+bool BpeTokenizer::MatchesReference() const {
+  static const char* const kProbes[] = {
+      "Hello world! It's a TEST: 1234567 numbers, don't STOP'LL 'VE'd.",
+      "  leading\tand trailing   \n\n  indented line\r\n\r\n   ",
+      "x = foo(bar[0], {'key': \"value\"});;\n}\n\n\n// done!!!\n",
+      "<|begin_of_text|><|start_header_id|>user<|end_header_id|>"
+      "\n\nWhat's up?<|eot_id|>",
+      "na\xc3\xafve caf\xc3\xa9 \xe2\x80\x94 mixed text, then ASCII again.",
+  };
+
+  std::vector<llama_token> native;
+  std::vector<llama_token> reference;
+  for (const char* probe : kProbes) {
+    const std::string_view text(probe);
+    for (int flags = 0; flags < 4; ++flags) {
+      const bool addBos = (flags & 1) != 0;
+      const bool parseSpecial = (flags & 2) != 0;
+
+      native.clear();
+      Encode(text, addBos, parseSpecial, native);
+
+      reference.resize(text.size() + 1);
+      const int nTokens = llama_tokenize(
+          model,
+          text.data(),
+          static_cast<int>(text.size()),
+          reference.data(),
+          static_cast<int>(reference.size()),
+          addBos,
+          parseSpecial
+      );
+      if (nTokens < 0) {
+        return false;
+      }
+      reference.resize(nTokens);
+
+      if (native != reference) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+void BpeTokenizer::Encode(
+    std::string_view text,
+    bool addBos,
+    bool parseSpecial,
+    std::vector<llama_token>& tokens
+) const {
+  if (addBos && addBosToken) {
+    tokens.push_back(bosToken);
+  }
+
+  if (!parseSpecial && !hasUserDefinedTokens) {
+    EncodeSegment(text, tokens);
+    return;
+  }
+
+  size_t segmentStart = 0;
+  size_t i = 0;
+  while (i < text.size()) {
+    if (specialFirstByte[static_cast<unsigned char>(text[i])]) {
+      const SpecialToken* match = nullptr;
+      for (const auto& special : specialTokens) {
+        if ((parseSpecial || special.userDefined) &&
+            text.compare(i, special.text.size(), special.text) == 0) {
+          match = &special;
+          break;
+        }
+      }
+
+      if (match) {
+        EncodeSegment(text.substr(segmentStart, i - segmentStart), tokens);
+        tokens.push_back(match->id);
+        i += match->text.size();
+        segmentStart = i;
+        continue;
+      }
+    }
+    ++i;
+  }
+
+  EncodeSegment(text.substr(segmentStart), tokens);
+}
+
+void BpeTokenizer::EncodeSegment(
+    std::string_view segment, std::vector<llama_token>& tokens
+) const {
+  if (segment.empty()) {
+    return;
+  }
+
+  if (!IsAscii(segment.data(), segment.size())) {
+    EncodeWithLlama(segment, tokens);
+    return;
+  }
+
+  size_t start = 0;
+  while (start < segment.size()) {
+    const size_t end = NextPreToken(segment.data(), segment.size(), start);
+    EncodeWord(segment.substr(start, end - start), tokens);
+    start = end;
+  }
+}
+
+void BpeTokenizer::EncodeWord(
+    std::string_view word, std::vector<llama_token>& tokens
+) const {
+  if (word.size() == 1) {
+    tokens.push_back(byteTokens[static_cast<unsigned char>(word[0])]);
+    return;
+  }
+
+  // Llama 3 vocabularies skip the merges for words that are whole tokens.
+  thread_local std::string mapped;
+  mapped.clear();
+  for (char c : word) {
+    if (c == ' ') {
+      mapped += "\xc4\xa0";
+    } else if (c == '\n') {
+      mapped += "\xc4\x8a";
+    } else if (c > ' ' && c < 127) {
+      mapped += c;
+    } else {
+      mapped += ByteToUnicode(static_cast<unsigned char>(c));
+    }
+  }
+  auto whole = tokenIds.find(mapped);
+  if (whole != tokenIds.end()) {
+    tokens.push_back(whole->second);
+    return;
+  }
+
+  const bool cacheable = cache && word.size() <= WordCache::kMaxWordLength;
+  if (cacheable && cache->Lookup(word, tokens)) {
+    return;
+  }
+
+  thread_local std::vector<Symbol> symbols;
+  thread_local std::vector<Bigram> queue;
+  symbols.clear();
+  queue.clear();
+
+  const int nSymbols = static_cast<int>(word.size());
+  for (int i = 0; i < nSymbols; ++i) {
+    symbols.push_back(
+        {byteTokens[static_cast<unsigned char>(word[i])],
+         i - 1,
+         i + 1 < nSymbols ? i + 1 : -1}
+    );
+  }
+
+  auto addBigram = [this](int left) {
+    if (left < 0 || symbols[left].next < 0) {
+      return;
+    }
+    const llama_token leftId = symbols[left].id;
+    const llama_token rightId = symbols[symbols[left].next].id;
+    const MergeEntry* merge = FindMerge(leftId, rightId);
+    if (merge) {
+      queue.push_back({merge->rank, left, leftId, rightId, merge->merged});
+      std::push_heap(queue.begin(), queue.end());
+    }
+  };
+
+  for (int i = 0; i + 1 < nSymbols; ++i) {
+    addBigram(i);
+  }
+
+  while (!queue.empty()) {
+    std::pop_heap(queue.begin(), queue.end());
+    const Bigram bigram = queue.back();
+    queue.pop_back();
+
+    Symbol& left = symbols[bigram.left];
+    if (left.id != bigram.leftId || left.next < 0) {
+      continue;
+    }
+    Symbol& right = symbols[left.next];
+    if (right.id != bigram.rightId) {
+      continue;
+    }
+
+    left.id = bigram.merged;
+    left.next = right.next;
+    if (right.next >= 0) {
+      symbols[right.next].prev = bigram.left;
+    }
+    right.id = -1;
+
+    addBigram(left.prev);
+    addBigram(bigram.left);
+  }
+
+  const size_t offset = tokens.size();
+  for (int i = 0; i >= 0; i = symbols[i].next) {
+    tokens.push_back(symbols[i].id);
+  }
+
+  if (cacheable) {
+    cache->Insert(word, tokens.data() + offset, tokens.size() - offset);
+  }
+}
+
+void BpeTokenizer::EncodeWithLlama(
+    std::string_view segment, std::vector<llama_token>& tokens
+) const {
+  const size_t offset = tokens.size();
+  tokens.resize(offset + segment.size() + 1);
+
+  int nTokens = llama_tokenize(
+      model,
+      segment.data(),
+      static_cast<int>(segment.size()),
+      tokens.data() + offset,
+      static_cast<int>(segment.size() + 1),
+      false,
+      false
+  );
+  if (nTokens < 0) {
+    tokens.resize(offset + -nTokens);
+    nTokens = llama_tokenize(
+        model,
+        segment.data(),
+        static_cast<int>(segment.size()),
+        tokens.data() + offset,
+        -nTokens,
+        false,
+        false
+    );
+  }
+
+  tokens.resize(offset + std::max(nTokens, 0));
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "llama-chat.h"
+#include "word-cache.h"
+
+struct llama_model;
+
+// Byte-level BPE tokenizer built from the GGUF vocabulary and merges. It
+// reproduces llama_tokenize for Llama 3 style vocabularies ("llama-bpe" pre
+// tokenizer); pure ASCII segments are pre-tokenized and merged natively, any
+// other segment is handed to llama_tokenize so the output stays identical.
+class BpeTokenizer {
+ public:
+  BpeTokenizer() = default;
+
+  // tokenIds holds views into tokenTexts, so the tables must stay in place.
+  BpeTokenizer(const BpeTokenizer&) = delete;
+  BpeTokenizer& operator=(const BpeTokenizer&) = delete;
+
+  // Returns false when the vocabulary is not supported or the native output
+  // does not match llama_tokenize; the tokenizer must not be used then.
+  // Words that need merges are memoized in a cache of `cacheCapacity` words.
+  bool Initialize(
+      const llama_model* model,
+      const std::string& modelPath,
+      size_t cacheCapacity
+  );
+
+  void Encode(
+      std::string_view text,
+      bool addBos,
+      bool parseSpecial,
+      std::vector<llama_token>& tokens
+  ) const;
+
+  [[nodiscard]] TokenizerCacheStats GetCacheStats() const;
+
+ private:
+  struct MergeEntry {
+    uint64_t key;
+    int32_t rank;
+    llama_token merged;
+  };
+
+  struct SpecialToken {
+    std::string text;
+    llama_token id;
+    bool userDefined;
+  };
+
+  const llama_model* model = nullptr;
+  bool addBosToken = false;
+  llama_token bosToken = 0;
+
+  std::vector<std::string> tokenTexts;
+  std::unordered_map<std::string_view, llama_token> tokenIds;
+  llama_token byteTokens[256] = {};
+
+  // Open-addressing table keyed by the (left, right) token id pair.
+  std::vector<MergeEntry> merges;
+  int mergeShift = 64;
+
+  // Sorted by descending length so the longest match wins.
+  std::vector<SpecialToken> specialTokens;
+  bool specialFirstByte[256] = {};
+  bool hasUserDefinedTokens = false;
+
+  std::unique_ptr<WordCache> cache;
+
+  bool LoadMerges(const std::string& modelPath);
+  void InsertMerge(
+      llama_token left, llama_token right, int32_t rank, llama_token merged
+  );
+  [[nodiscard]] const MergeEntry* FindMerge(
+      llama_token left, llama_token right
+  ) const;
+
+  [[nodiscard]] bool MatchesReference() const;
+
+  void EncodeSegment(
+      std::string_view segment, std::vector<llama_token>& tokens
+  ) const;
+  void EncodeWord(std::string_view word, std::vector<llama_token>& tokens)
+      const;
+  void EncodeWithLlama(
+      std::string_view segment, std::vector<llama_token>& tokens
+  ) const;
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+
+// Pieces of the Llama 3 chat template, to be tokenized with special tokens
+// parsed.
+inline constexpr char kBeginOfText[] = "<|begin_of_text|>";
+inline constexpr char kEndOfTurn[] = "<|eot_id|>";
+
+inline std::string TurnHeader(const std::string& role) {
+  return "<|start_header_id|>" + role + "<|end_header_id|>";
+}
+
+inline std::string FormatTurn(
+    const std::string& role, const std::string& content
+) {
+  return TurnHeader(role) + content + kEndOfTurn;
+}
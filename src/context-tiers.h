@@ -0,0 +1,68 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llama-context-pool.h"
+#include "llama.h"
+#include "vocabulary.h"
+
+class ContextTiers;
+
+// Frees an owned context or hands a leased one back to its pool.
+struct ContextReleaser {
+  std::shared_ptr<ContextTiers> tiers;
+
+  void operator()(llama_context* ctx) const;
+};
+
+using PooledContext = std::unique_ptr<llama_context, ContextReleaser>;
+
+class ContextTiers : public std::enable_shared_from_this<ContextTiers> {
+ public:
+  ~ContextTiers();
+
+  bool Initialize(
+      const std::string& modelPath,
+      const ModelParams& modelParams,
+      const ContextPoolParams& params
+  );
+
+  // Leases a context from the smallest tier with at least `nPositions`
+  // cells and a free slot, or returns null.
+  PooledContext Acquire(size_t nPositions, bool promotion);
+  void Release(llama_context* ctx);
+
+  [[nodiscard]] size_t MaxContext() const;
+  // Size of the smallest tier with at least `nPositions` cells.
+  [[nodiscard]] size_t TierFor(size_t nPositions) const;
+  [[nodiscard]] std::vector<ContextTierStats> GetStats() const;
+
+  [[nodiscard]] const std::shared_ptr<llama_model>& GetModel() const {
+    return model;
+  }
+  [[nodiscard]] const std::shared_ptr<Vocabulary>& GetVocabulary() const {
+    return vocabulary;
+  }
+
+ private:
+  struct Tier {
+    ContextTierStats stats;
+    std::vector<llama_context*> idle;
+    double utilizationSum = 0.0;
+    size_t releases = 0;
+  };
+
+  std::shared_ptr<llama_model> model;
+  std::shared_ptr<Vocabulary> vocabulary;
+  ContextPoolParams params;
+
+  mutable std::mutex mutex;
+  std::vector<Tier> tiers;  // Ascending by size
+  std::unordered_map<llama_context*, size_t> owners;
+
+  llama_context* Create(size_t nContext) const;
+};
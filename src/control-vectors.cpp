@@ -0,0 +1,50 @@
+#include "control-vectors.h"
+
+#include <algorithm>
+
+#include "common.h"
+#include "logger.h"
+
+bool ControlVectors::Load(
+    const std::string& name, const std::string& path, int nEmbd
+) {
+  llama_control_vector_data loaded = llama_control_vector_load({{1.0f, path}});
+  if (loaded.n_embd == -1) {
+    LogError("Failed to load control vector", {{"path", path}});
+    return false;
+  }
+  if (loaded.n_embd != nEmbd) {
+    LogError(
+        "Control vector does not match the model",
+        {{"path", path},
+         {"nEmbd", std::to_string(loaded.n_embd)},
+         {"modelEmbd", std::to_string(nEmbd)}}
+    );
+    return false;
+  }
+
+  vectors[name] = std::move(loaded.data);
+  return true;
+}
+
+bool ControlVectors::Combine(
+    const std::vector<SteeringVector>& steering, std::vector<float>& data
+) const {
+  data.clear();
+  for (const auto& vector : steering) {
+    auto it = vectors.find(vector.name);
+    if (it == vectors.end()) {
+      LogError("Unknown control vector", {{"name", vector.name}});
+      return false;
+    }
+
+    const std::vector<float>& values = it->second;
+    if (data.size() < values.size()) {
+      data.resize(values.size(), 0.0f);
+    }
+    for (size_t i = 0; i < values.size(); ++i) {
+      data[i] += vector.scale * values[i];
+    }
+  }
+  return true;
+}
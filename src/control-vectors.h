@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llama-chat.h"
+
+// Control vectors loaded from GGUF files, kept in memory by name so that
+// any weighted combination can be applied without touching the files again.
+class ControlVectors {
+ public:
+  bool Load(const std::string& name, const std::string& path, int nEmbd);
+
+  [[nodiscard]] bool Contains(const std::string& name) const {
+    return vectors.count(name) != 0;
+  }
+
+  // Sums the scaled vectors into `data`, one n_embd row per layer starting
+  // at layer 1. Returns false if a vector is not loaded.
+  bool Combine(
+      const std::vector<SteeringVector>& steering, std::vector<float>& data
+  ) const;
+
+ private:
+  std::unordered_map<std::string, std::vector<float>> vectors;
+};
@@ -0,0 +1,140 @@
+#include "dry-sampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "vocabulary.h"
+
+namespace {
+
+constexpr uint64_t kHashBase = 0x100000001b3ULL;
+
+uint64_t Mix(llama_token token) {
+  uint64_t x = static_cast<uint32_t>(token) + 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+}  // namespace
+
+DrySampler::DrySampler(
+    const SamplingParams& params, const Vocabulary& vocabulary
+)
+    : multiplier(params.dryMultiplier),
+      base(params.dryBase),
+      allowedLength(std::max<size_t>(1, params.dryAllowedLength)),
+      maxLength(params.dryMaxLength),
+      breakers(params.drySequenceBreakers),
+      vocabulary(vocabulary) {
+  for (size_t i = 0; i < allowedLength; ++i) {
+    windowHashPower *= kHashBase;
+  }
+}
+
+void DrySampler::Apply(llama_token_data_array& candidates) const {
+  if (!Enabled() || matches.empty()) {
+    return;
+  }
+
+  std::unordered_map<llama_token, uint32_t> longest;
+  for (const auto& [position, length] : matches) {
+    uint32_t& current = longest[tokens[position]];
+    current = std::max(current, length);
+  }
+
+  for (const auto& [token, length] : longest) {
+    if (token < 0 || static_cast<size_t>(token) >= candidates.size) {
+      continue;
+    }
+    const float penalty =
+        multiplier *
+        std::pow(base, static_cast<float>(length - allowedLength));
+    candidates.data[token].logit -= penalty;
+  }
+}
+
+void DrySampler::Accept(llama_token token) {
+  if (!Enabled()) {
+    return;
+  }
+
+  tokens.push_back(token);
+  const size_t end = tokens.size();
+
+  // The previous window now has a continuation; index it.
+  if (runLength >= allowedLength) {
+    occurrences[windowHash].push_back(static_cast<uint32_t>(end - 1));
+  }
+
+  if (IsBreaker(token)) {
+    runLength = 0;
+    windowHash = 0;
+    matches.clear();
+    return;
+  }
+
+  ++runLength;
+  windowHash = windowHash * kHashBase + Mix(token);
+  if (runLength > allowedLength) {
+    windowHash -= windowHashPower * Mix(tokens[end - 1 - allowedLength]);
+  }
+
+  // Repeats that the accepted token continued keep growing, whatever their
+  // age; only the search for new ones is bounded.
+  std::unordered_map<uint32_t, uint32_t> extended;
+  for (const auto& [position, length] : matches) {
+    if (tokens[position] == token) {
+      uint32_t grown = length + 1;
+      if (maxLength > 0) {
+        grown = std::min<uint32_t>(grown, maxLength);
+      }
+      extended.emplace(position + 1, grown);
+    }
+  }
+
+  if (runLength >= allowedLength) {
+    auto it = occurrences.find(windowHash);
+    if (it != occurrences.end()) {
+      const auto& positions = it->second;
+      const size_t first = positions.size() > kMaxOccurrences
+                               ? positions.size() - kMaxOccurrences
+                               : 0;
+      for (size_t i = positions.size(); i-- > first;) {
+        const uint32_t position = positions[i];
+        if (extended.count(position) == 0 && WindowMatches(position)) {
+          extended.emplace(position, allowedLength);
+        }
+      }
+    }
+  }
+  matches = std::move(extended);
+}
+
+bool DrySampler::IsBreaker(llama_token token) const {
+  if (breakers.empty()) {
+    return false;
+  }
+
+  auto it = breakerTokens.find(token);
+  if (it != breakerTokens.end()) {
+    return it->second;
+  }
+
+  const std::string piece = vocabulary.Decode({LlamaToken(token)});
+  const bool isBreaker =
+      std::any_of(breakers.begin(), breakers.end(), [&](const auto& breaker) {
+        return !breaker.empty() && piece.find(breaker) != std::string::npos;
+      });
+  breakerTokens.emplace(token, isBreaker);
+  return isBreaker;
+}
+
+// Guards against hash collisions for a newly found repeat.
+bool DrySampler::WindowMatches(size_t position) const {
+  return std::equal(
+      tokens.end() - allowedLength,
+      tokens.end(),
+      tokens.begin() + (position - allowedLength)
+  );
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llama-chat.h"
+#include "llama.h"
+
+class Vocabulary;
+
+// "Don't Repeat Yourself" sampler. Penalizes tokens that would extend a
+// sequence already generated earlier in the response, growing exponentially
+// with the length of the repeat.
+//
+// Every window of `dryAllowedLength` tokens is indexed by a rolling hash, so
+// finding where the current suffix occurred before is a single lookup, and
+// each match grows by one token per step instead of being re-scanned from
+// scratch.
+class DrySampler {
+ public:
+  DrySampler(const SamplingParams& params, const Vocabulary& vocabulary);
+
+  [[nodiscard]] bool Enabled() const { return multiplier > 0.0f; }
+
+  // Lowers the logits of tokens that continue a repeat. `candidates` must
+  // still be indexed by token id.
+  void Apply(llama_token_data_array& candidates) const;
+
+  // Records a generated token.
+  void Accept(llama_token token);
+
+ private:
+  // Earlier occurrences of the current window that can start a new match,
+  // newest first.
+  static constexpr size_t kMaxOccurrences = 64;
+
+  float multiplier;
+  float base;
+  size_t allowedLength;
+  size_t maxLength;
+  std::vector<std::string> breakers;
+  const Vocabulary& vocabulary;
+
+  std::vector<llama_token> tokens;
+  uint64_t windowHash = 0;
+  uint64_t windowHashPower = 1;  // Hash base raised to allowedLength
+  size_t runLength = 0;          // Tokens since the last sequence breaker
+
+  // Window hash -> positions of the token that followed each occurrence.
+  std::unordered_map<uint64_t, std::vector<uint32_t>> occurrences;
+  // Position of a continuation token -> length of the repeat before it.
+  std::unordered_map<uint32_t, uint32_t> matches;
+
+  mutable std::unordered_map<llama_token, bool> breakerTokens;
+
+  [[nodiscard]] bool IsBreaker(llama_token token) const;
+  [[nodiscard]] bool WindowMatches(size_t position) const;
+};
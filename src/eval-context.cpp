@@ -0,0 +1,70 @@
+#include "eval-context.h"
+
+#include <stdexcept>
+
+#include "logger.h"
+
+EvalContext::EvalContext() {
+  InstallLlamaLogCallback();
+  llama_backend_init();
+}
+
+EvalContext::~EvalContext() {
+  if (batch.token) {
+    llama_batch_free(batch);
+  }
+  if (ctx) {
+    llama_free(ctx);
+  }
+  if (model) {
+    llama_free_model(model);
+  }
+  llama_backend_free();
+}
+
+bool EvalContext::Initialize(
+    const std::string& modelPath,
+    const ModelParams& modelParams,
+    size_t nContext,
+    int nBatch,
+    int nThreads,
+    int nSequences
+) {
+  llama_model_params llamaModelParams = llama_model_default_params();
+  llamaModelParams.n_gpu_layers = modelParams.nGpuLayers;
+  llamaModelParams.use_mmap = modelParams.useMemoryMapping;
+  llamaModelParams.use_mlock = modelParams.useModelLock;
+
+  model = llama_load_model_from_file(modelPath.c_str(), llamaModelParams);
+  if (!model) {
+    LogError("Failed to load model", {{"path", modelPath}});
+    return false;
+  }
+  vocabulary.Initialize(model, modelPath, modelParams);
+
+  llama_context_params ctxParams = llama_context_default_params();
+  ctxParams.n_ctx = nContext;
+  ctxParams.n_batch = nBatch;
+  ctxParams.n_threads = nThreads;
+  ctxParams.n_threads_batch = nThreads;
+  ctxParams.n_seq_max = nSequences;
+  ctxParams.embeddings = false;
+
+  ctx = llama_new_context_with_model(model, ctxParams);
+  if (!ctx) {
+    LogError(
+        "Failed to create the evaluation context",
+        {{"nContext", std::to_string(nContext)}}
+    );
+    return false;
+  }
+
+  batch = llama_batch_init(nBatch, 0, 1);
+  return true;
+}
+
+void EvalContext::Decode() {
+  if (llama_decode(ctx, batch) != 0) {
+    throw std::runtime_error("llama_decode() failed while evaluating");
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+
+#include "llama-chat.h"
+#include "llama.h"
+#include "vocabulary.h"
+
+// Model, context and batch of an evaluator or a multi-sequence generator.
+// The context has one sequence per text processed in parallel.
+class EvalContext {
+ public:
+  EvalContext();
+  ~EvalContext();
+
+  EvalContext(const EvalContext&) = delete;
+  EvalContext& operator=(const EvalContext&) = delete;
+
+  bool Initialize(
+      const std::string& modelPath,
+      const ModelParams& modelParams,
+      size_t nContext,
+      int nBatch,
+      int nThreads,
+      int nSequences
+  );
+
+  // Decodes `batch`; throws on failure.
+  void Decode();
+
+  llama_model* model = nullptr;
+  llama_context* ctx = nullptr;
+  llama_batch batch{};
+  Vocabulary vocabulary;
+};
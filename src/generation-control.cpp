@@ -0,0 +1,165 @@
+#include "generation-control.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "dry-sampler.h"
+
+float LogProbability(const float* logits, int nVocabulary, llama_token token) {
+  const float maxLogit = *std::max_element(logits, logits + nVocabulary);
+  double sum = 0.0;
+  for (int i = 0; i < nVocabulary; ++i) {
+    sum += std::exp(static_cast<double>(logits[i] - maxLogit));
+  }
+  return logits[token] - maxLogit - static_cast<float>(std::log(sum));
+}
+
+llama_token SampleToken(
+    llama_context* ctx,
+    const float* logits,
+    const SamplingParams& params,
+    const DrySampler& dry,
+    llama_token endOfText,
+    std::vector<llama_token_data>& candidates,
+    TokenDistribution& distribution
+) {
+  const int nVocabulary = llama_n_vocab(llama_get_model(ctx));
+
+  candidates.clear();
+  candidates.reserve(nVocabulary);
+  for (llama_token tokenId = 0; tokenId < nVocabulary; tokenId++) {
+    candidates.emplace_back(llama_token_data{tokenId, logits[tokenId], 0.0f});
+  }
+
+  llama_token_data_array candidatesP = {
+      candidates.data(),
+      candidates.size(),
+      false
+  };
+
+  if (!params.repeatPenaltyTokens.empty()) {
+    std::vector<llama_token> penaltyTokens;
+    for (const auto& token : params.repeatPenaltyTokens) {
+      penaltyTokens.push_back(token.tokenId);
+    }
+
+    llama_sample_repetition_penalties(
+        ctx,
+        &candidatesP,
+        penaltyTokens.data(),
+        penaltyTokens.size(),
+        params.repeatPenalty,
+        params.frequencyPenalty,
+        params.presencePenalty
+    );
+  }
+
+  dry.Apply(candidatesP);
+
+  llama_sample_top_k(ctx, &candidatesP, params.topK, 1);
+  distribution = MeasureDistribution(candidatesP, endOfText);
+  llama_sample_top_p(ctx, &candidatesP, params.topP, 1);
+  // Dividing the logits by a zero temperature would make them inf/NaN; it
+  // means the most likely token.
+  const float temperature = DynamicTemperature(params, distribution);
+  if (temperature <= 0.0f) {
+    return llama_sample_token_greedy(ctx, &candidatesP);
+  }
+  llama_sample_temp(ctx, &candidatesP, temperature);
+
+  return llama_sample_token(ctx, &candidatesP);
+}
+
+TokenDistribution MeasureDistribution(
+    const llama_token_data_array& candidates, llama_token endOfText
+) {
+  TokenDistribution distribution;
+  if (candidates.size == 0) {
+    return distribution;
+  }
+
+  const float maxLogit = candidates.data[0].logit;
+  double sum = 0.0;
+  for (size_t i = 0; i < candidates.size; ++i) {
+    sum += std::exp(candidates.data[i].logit - maxLogit);
+  }
+
+  double entropy = 0.0;
+  for (size_t i = 0; i < candidates.size; ++i) {
+    const double p = std::exp(candidates.data[i].logit - maxLogit) / sum;
+    if (p > 0.0) {
+      entropy -= p * std::log(p);
+    }
+    if (candidates.data[i].id == endOfText) {
+      distribution.endOfTextProbability = static_cast<float>(p);
+    }
+  }
+
+  distribution.topProbability = static_cast<float>(1.0 / sum);
+  if (candidates.size > 1) {
+    distribution.entropy = static_cast<float>(
+        entropy / std::log(static_cast<double>(candidates.size))
+    );
+  }
+  return distribution;
+}
+
+float DynamicTemperature(
+    const SamplingParams& params, const TokenDistribution& distribution
+) {
+  if (params.dynamicTemperatureRange <= 0.0f) {
+    return params.temperature;
+  }
+
+  const float minTemperature =
+      std::max(0.0f, params.temperature - params.dynamicTemperatureRange);
+  const float maxTemperature =
+      params.temperature + params.dynamicTemperatureRange;
+  return minTemperature +
+         (maxTemperature - minTemperature) *
+             std::pow(distribution.entropy, params.dynamicTemperatureExponent);
+}
+
+EarlyStopping::EarlyStopping(const SamplingParams& params)
+    : params(params), window(std::max<size_t>(1, params.stopEntropyWindow)) {}
+
+bool EarlyStopping::IsClosed(const TokenDistribution& distribution) const {
+  return params.stopEndOfTextProbability > 0.0f &&
+         nTokens >= params.stopMinTokens &&
+         distribution.endOfTextProbability >= params.stopEndOfTextProbability;
+}
+
+bool EarlyStopping::LostConfidence(
+    const TokenDistribution& distribution, const std::string& piece
+) {
+  float& slot = window[nTokens % window.size()];
+  windowSum += distribution.entropy - slot;
+  slot = distribution.entropy;
+  entropySum += distribution.entropy;
+  ++nTokens;
+
+  if (params.stopEntropyThreshold <= 0.0f ||
+      nTokens < std::max(params.stopMinTokens, window.size()) ||
+      !EndsSentence(piece)) {
+    return false;
+  }
+  return windowSum / static_cast<double>(window.size()) >
+         params.stopEntropyThreshold;
+}
+
+float EarlyStopping::MeanEntropy() const {
+  return nTokens == 0 ? 0.0f : static_cast<float>(entropySum / nTokens);
+}
+
+bool EarlyStopping::EndsSentence(const std::string& piece) {
+  if (piece.find('\n') != std::string::npos) {
+    return true;
+  }
+
+  auto last = piece.find_last_not_of(" \t");
+  if (last == std::string::npos) {
+    return false;
+  }
+  const char c = piece[last];
+  return c == '.' || c == '!' || c == '?';
+}
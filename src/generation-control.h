@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "llama-chat.h"
+#include "llama.h"
+
+class DrySampler;
+
+// Shape of the next-token distribution over the candidates left after top-k.
+struct TokenDistribution {
+  float entropy = 0.0f;            // Normalized to [0, 1]
+  float topProbability = 0.0f;
+  float endOfTextProbability = 0.0f;
+};
+
+// Expects `candidates` sorted by logit, as llama_sample_top_k leaves them.
+TokenDistribution MeasureDistribution(
+    const llama_token_data_array& candidates, llama_token endOfText
+);
+
+// Log-softmax of `token` over the raw logits of one position.
+float LogProbability(const float* logits, int nVocabulary, llama_token token);
+
+// Samples the next token from one position's logits: repetition penalties,
+// DRY, top-k, top-p, then the (dynamic) temperature. `candidates` is scratch
+// space kept by the caller; `distribution` receives the shape after top-k.
+llama_token SampleToken(
+    llama_context* ctx,
+    const float* logits,
+    const SamplingParams& params,
+    const DrySampler& dry,
+    llama_token endOfText,
+    std::vector<llama_token_data>& candidates,
+    TokenDistribution& distribution
+);
+
+// Temperature scaled within temperature +/- dynamicTemperatureRange by the
+// entropy: confident steps sample colder, uncertain steps hotter. Never
+// below 0; SampleToken() picks the most likely token at 0.
+float DynamicTemperature(
+    const SamplingParams& params, const TokenDistribution& distribution
+);
+
+// Decides when to end a response before the model samples end-of-text.
+class EarlyStopping {
+ public:
+  explicit EarlyStopping(const SamplingParams& params);
+
+  // Checked before the sampled token is emitted: the model already rates
+  // ending the response as likely enough.
+  [[nodiscard]] bool IsClosed(const TokenDistribution& distribution) const;
+
+  // Checked after `piece` is emitted: a sentence just ended and the recent
+  // steps were too uncertain for the response to be worth continuing.
+  bool LostConfidence(
+      const TokenDistribution& distribution, const std::string& piece
+  );
+
+  [[nodiscard]] float MeanEntropy() const;
+
+ private:
+  const SamplingParams& params;
+  size_t nTokens = 0;
+  double entropySum = 0.0;
+  std::vector<float> window;  // Ring buffer of recent entropies
+  double windowSum = 0.0;
+
+  static bool EndsSentence(const std::string& piece);
+};
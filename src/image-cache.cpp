@@ -0,0 +1,79 @@
+#include "image-cache.h"
+
+#include <cstring>
+
+uint64_t HashImage(const std::vector<uint8_t>& bytes) {
+  auto mix = [](uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+  };
+
+  uint64_t hash = 0xcbf29ce484222325ull ^ (bytes.size() * 0x9e3779b97f4a7c15ull);
+  size_t i = 0;
+  for (; i + 8 <= bytes.size(); i += 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes.data() + i, sizeof(word));
+    hash = mix(hash ^ word) + 0x9e3779b97f4a7c15ull;
+  }
+
+  uint64_t tail = 0;
+  for (size_t shift = 0; i < bytes.size(); ++i, shift += 8) {
+    tail |= static_cast<uint64_t>(bytes[i]) << shift;
+  }
+  return mix(hash ^ tail);
+}
+
+ImageEmbeddingCache::ImageEmbeddingCache(size_t budgetBytes)
+    : budgetBytes(budgetBytes) {}
+
+std::shared_ptr<const ImageEmbedding> ImageEmbeddingCache::Find(uint64_t hash
+) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = index.find(hash);
+  if (it == index.end()) {
+    ++misses;
+    return nullptr;
+  }
+
+  entries.splice(entries.begin(), entries, it->second);
+  ++hits;
+  return it->second->embedding;
+}
+
+void ImageEmbeddingCache::Insert(
+    uint64_t hash, std::shared_ptr<const ImageEmbedding> embedding
+) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (index.count(hash) != 0 || embedding->Bytes() > budgetBytes) {
+    return;
+  }
+
+  usedBytes += embedding->Bytes();
+  entries.push_front({hash, std::move(embedding)});
+  index.emplace(hash, entries.begin());
+
+  while (usedBytes > budgetBytes) {
+    usedBytes -= entries.back().embedding->Bytes();
+    index.erase(entries.back().hash);
+    entries.pop_back();
+    ++evictions;
+  }
+}
+
+ImageCacheStats ImageEmbeddingCache::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  ImageCacheStats stats;
+  stats.hits = hits;
+  stats.misses = misses;
+  stats.evictions = evictions;
+  stats.entries = entries.size();
+  stats.bytes = usedBytes;
+  return stats;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "llama-chat.h"
+
+struct ImageEmbedding {
+  std::vector<float> data;  // nPositions rows of the model's embedding size
+  int nPositions = 0;
+
+  [[nodiscard]] size_t Bytes() const { return data.size() * sizeof(float); }
+};
+
+// Content hash used to recognize an image that is sent again.
+uint64_t HashImage(const std::vector<uint8_t>& bytes);
+
+// LRU cache of image embeddings bounded by their total size in bytes. Entries
+// are shared, so an embedding that is evicted while in use stays valid for
+// its current user.
+class ImageEmbeddingCache {
+ public:
+  explicit ImageEmbeddingCache(size_t budgetBytes);
+
+  [[nodiscard]] std::shared_ptr<const ImageEmbedding> Find(uint64_t hash);
+  void Insert(uint64_t hash, std::shared_ptr<const ImageEmbedding> embedding);
+
+  [[nodiscard]] ImageCacheStats GetStats() const;
+
+ private:
+  struct Entry {
+    uint64_t hash;
+    std::shared_ptr<const ImageEmbedding> embedding;
+  };
+
+  size_t budgetBytes;
+  size_t usedBytes = 0;
+
+  mutable std::mutex mutex;
+  std::list<Entry> entries;  // Most recently used first
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "llama-journal.h"
+
+struct JournalMessage {
+  std::string role;
+  std::string content;
+};
+
+struct RecoveredConversation {
+  std::vector<JournalMessage> messages;
+  // Text of a response that was still being generated.
+  std::string partialResponse;
+};
+
+class JournalFile {
+ public:
+  enum class RecordType : uint8_t {
+    Reset = 1,
+    Message = 2,
+    Piece = 3,
+  };
+
+  ~JournalFile();
+
+  bool Open(const std::string& path, const JournalParams& params);
+
+  void AppendReset(std::string_view session);
+  void AppendMessage(
+      std::string_view session, std::string_view role, std::string_view content
+  );
+  void AppendPiece(std::string_view session, std::string_view piece);
+
+  // Removes and returns the recovered conversation of `session`.
+  bool TakeRecovered(const std::string& session, RecoveredConversation& out);
+  [[nodiscard]] std::vector<std::string> GetSessionIds() const;
+
+  bool Flush();
+  [[nodiscard]] JournalStats GetStats() const;
+
+ private:
+  JournalParams params;
+  int fd = -1;
+  uint8_t* base = nullptr;
+  size_t mappedBytes = 0;
+
+  mutable std::mutex mutex;  // Guards the mapping, tail and recovered data
+  size_t tail = 0;
+  // Mappings replaced by Map(), unmapped by the committer once it has
+  // synced them, so it never holds `mutex` while writing back.
+  std::vector<std::pair<uint8_t*, size_t>> replacedMappings;
+  std::unordered_map<std::string, RecoveredConversation> recovered;
+  JournalStats stats;
+
+  std::mutex commitMutex;
+  std::condition_variable commitWakeup;
+  std::condition_variable committed;
+  size_t durable = 0;
+  bool syncFailed = false;  // Sticky, so Flush() cannot wait forever
+  bool stopping = false;
+  std::thread committer;
+
+  void Append(
+      RecordType type,
+      std::string_view session,
+      std::string_view first,
+      std::string_view second
+  );
+  bool Reserve(size_t bytes);
+  bool Map(size_t bytes);
+  void Recover();
+  bool Sync(size_t from, size_t to);
+  void RunCommitter();
+};
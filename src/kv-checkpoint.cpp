@@ -0,0 +1,305 @@
+#include "kv-checkpoint.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+#include "checksum.h"
+#include "logger.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+constexpr char kMagic[8] = {'L', 'C', 'K', 'V', 'C', 'P', '0', '1'};
+constexpr size_t kRecordHeader = 13;  // Type, item count, state size
+constexpr size_t kItemBytes = 13;
+
+enum class RecordType : uint8_t {
+  Base = 1,
+  Delta = 2,
+};
+
+template <typename T>
+void Put(std::vector<uint8_t>& buffer, T value) {
+  const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+  buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+T Get(const uint8_t* source) {
+  T value;
+  std::memcpy(&value, source, sizeof(T));
+  return value;
+}
+
+std::vector<uint8_t> EncodeRecord(
+    RecordType type,
+    const std::vector<KvItem>& items,
+    size_t first,
+    const std::vector<uint8_t>& state
+) {
+  std::vector<uint8_t> record;
+  record.reserve(
+      kRecordHeader + (items.size() - first) * kItemBytes + state.size() + 4
+  );
+
+  Put(record, static_cast<uint8_t>(type));
+  Put(record, static_cast<uint32_t>(items.size() - first));
+  Put(record, static_cast<uint64_t>(state.size()));
+  for (size_t i = first; i < items.size(); ++i) {
+    Put(record, static_cast<uint8_t>(items[i].isImage));
+    Put(record, items[i].value);
+    Put(record, static_cast<int32_t>(items[i].nPositions));
+  }
+  record.insert(record.end(), state.begin(), state.end());
+  Put(record, Crc32(record.data(), record.size()));
+  return record;
+}
+
+#ifndef _WIN32
+bool Sync(int fd) {
+#ifdef __APPLE__
+  return fcntl(fd, F_FULLFSYNC) == 0;
+#else
+  return fsync(fd) == 0;
+#endif
+}
+#endif
+
+// Writes `bytes` and waits until they are on disk.
+bool WriteFile(
+    const std::string& path, const std::vector<uint8_t>& bytes, bool append
+) {
+#ifdef _WIN32
+  std::ofstream file(
+      path, std::ios::binary | (append ? std::ios::app : std::ios::trunc)
+  );
+  file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+  file.flush();
+  return file.good();
+#else
+  const int fd = open(
+      path.c_str(), O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644
+  );
+  if (fd < 0) {
+    return false;
+  }
+
+  size_t written = 0;
+  while (written < bytes.size()) {
+    const ssize_t n =
+        write(fd, bytes.data() + written, bytes.size() - written);
+    if (n < 0 && errno != EINTR) {
+      break;
+    }
+    written += n > 0 ? static_cast<size_t>(n) : 0;
+  }
+  const bool synced = written == bytes.size() && Sync(fd);
+  return close(fd) == 0 && synced;
+#endif
+}
+
+// Makes a rename into the directory of `path` durable.
+bool SyncDirectory(const std::string& path) {
+#ifdef _WIN32
+  return true;
+#else
+  const auto directory = std::filesystem::path(path).parent_path();
+  const int fd =
+      open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  const bool synced = Sync(fd);
+  close(fd);
+  return synced;
+#endif
+}
+
+}  // namespace
+
+size_t KvCheckpoint::Covered(
+    const std::string& checkpointPath,
+    const std::vector<KvItem>& currentItems,
+    uint64_t currentGeneration
+) const {
+  if (!appendable || checkpointPath != path ||
+      currentGeneration != generation ||
+      items.size() > currentItems.size() ||
+      !std::equal(items.begin(), items.end(), currentItems.begin())) {
+    return 0;
+  }
+  return items.size();
+}
+
+bool KvCheckpoint::ShouldCompact(
+    size_t nextDeltaBytes, const CheckpointParams& params
+) const {
+  return static_cast<double>(deltaBytes + nextDeltaBytes) >
+         static_cast<double>(baseBytes) * params.compactionRatio;
+}
+
+bool KvCheckpoint::WriteBase(
+    const std::string& checkpointPath,
+    const std::vector<KvItem>& currentItems,
+    const std::vector<uint8_t>& state,
+    uint64_t currentGeneration
+) {
+  appendable = false;
+
+  std::vector<uint8_t> bytes(std::begin(kMagic), std::end(kMagic));
+  const auto record = EncodeRecord(RecordType::Base, currentItems, 0, state);
+  bytes.insert(bytes.end(), record.begin(), record.end());
+
+  // Written aside, synced and renamed, so a crash leaves the previous
+  // checkpoint. The rename is durable once the directory is synced.
+  const std::string temporary = checkpointPath + ".tmp";
+  if (!WriteFile(temporary, bytes, false)) {
+    LogError("Failed to write checkpoint", {{"path", temporary}});
+    return false;
+  }
+  std::error_code error;
+  std::filesystem::rename(temporary, checkpointPath, error);
+  if (error) {
+    LogError(
+        "Failed to replace checkpoint",
+        {{"path", checkpointPath}, {"error", error.message()}}
+    );
+    return false;
+  }
+  if (!SyncDirectory(checkpointPath)) {
+    LogWarning(
+        "Failed to sync checkpoint directory", {{"path", checkpointPath}}
+    );
+  }
+
+  path = checkpointPath;
+  items = currentItems;
+  generation = currentGeneration;
+  appendable = true;
+  baseBytes = bytes.size();
+  deltaBytes = 0;
+
+  ++stats.checkpoints;
+  ++stats.compactions;
+  stats.bytesWritten += bytes.size();
+  stats.lastBytesWritten = bytes.size();
+  stats.fileBytes = bytes.size();
+  return true;
+}
+
+bool KvCheckpoint::AppendDelta(
+    const std::vector<KvItem>& currentItems,
+    size_t first,
+    const std::vector<uint8_t>& state
+) {
+  const auto record =
+      EncodeRecord(RecordType::Delta, currentItems, first, state);
+  if (!WriteFile(path, record, true)) {
+    // The file may now end in a partial record; the next save rewrites it.
+    appendable = false;
+    LogError("Failed to append to checkpoint", {{"path", path}});
+    return false;
+  }
+
+  items.insert(items.end(), currentItems.begin() + first, currentItems.end());
+  deltaBytes += record.size();
+
+  ++stats.checkpoints;
+  stats.bytesWritten += record.size();
+  stats.lastBytesWritten = record.size();
+  stats.fileBytes = baseBytes + deltaBytes;
+  return true;
+}
+
+bool KvCheckpoint::Read(
+    const std::string& checkpointPath,
+    std::vector<KvItem>& loadedItems,
+    std::vector<std::vector<uint8_t>>& states,
+    uint64_t currentGeneration
+) {
+  appendable = false;
+  loadedItems.clear();
+  states.clear();
+
+  std::ifstream file(checkpointPath, std::ios::binary);
+  if (!file) {
+    LogError("Failed to open checkpoint", {{"path", checkpointPath}});
+    return false;
+  }
+  const std::vector<uint8_t> bytes(
+      (std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>()
+  );
+
+  if (bytes.size() < sizeof(kMagic) ||
+      std::memcmp(bytes.data(), kMagic, sizeof(kMagic)) != 0) {
+    LogError("Not a KV checkpoint", {{"path", checkpointPath}});
+    return false;
+  }
+
+  size_t offset = sizeof(kMagic);
+  size_t validEnd = offset;
+  size_t firstRecordEnd = 0;
+  while (offset + kRecordHeader <= bytes.size()) {
+    const uint8_t* record = bytes.data() + offset;
+    const auto type = static_cast<RecordType>(record[0]);
+    const auto nItems = Get<uint32_t>(record + 1);
+    const auto stateBytes = Get<uint64_t>(record + 5);
+
+    const size_t remaining = bytes.size() - offset - kRecordHeader;
+    const size_t itemBytes = static_cast<size_t>(nItems) * kItemBytes;
+    if (itemBytes > remaining || stateBytes > remaining - itemBytes ||
+        remaining - itemBytes - stateBytes < 4) {
+      break;
+    }
+
+    const size_t length = kRecordHeader + itemBytes + stateBytes;
+    if (Get<uint32_t>(record + length) != Crc32(record, length) ||
+        (type == RecordType::Base) != states.empty()) {
+      break;
+    }
+
+    const uint8_t* item = record + kRecordHeader;
+    for (uint32_t i = 0; i < nItems; ++i, item += kItemBytes) {
+      loadedItems.push_back(
+          {item[0] != 0, Get<uint64_t>(item + 1), Get<int32_t>(item + 9)}
+      );
+    }
+    states.emplace_back(item, item + stateBytes);
+
+    offset += length + 4;
+    validEnd = offset;
+    if (firstRecordEnd == 0) {
+      firstRecordEnd = offset;
+    }
+  }
+
+  if (states.empty()) {
+    LogError("KV checkpoint holds no state", {{"path", checkpointPath}});
+    return false;
+  }
+  if (validEnd < bytes.size()) {
+    LogWarning(
+        "Ignoring a torn checkpoint tail",
+        {{"path", checkpointPath},
+         {"bytes", std::to_string(bytes.size() - validEnd)}}
+    );
+  }
+
+  path = checkpointPath;
+  items = loadedItems;
+  generation = currentGeneration;
+  // Appending after a torn tail would leave the new records unreachable.
+  appendable = validEnd == bytes.size();
+  baseBytes = firstRecordEnd;
+  deltaBytes = validEnd - firstRecordEnd;
+  stats.fileBytes = bytes.size();
+  return true;
+}
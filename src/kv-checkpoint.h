@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llama-chat.h"
+
+// One entry per token or image decoded into sequence 0, so the next prompt
+// only evaluates what differs from the previous one.
+struct KvItem {
+  bool isImage;
+  uint64_t value;  // Token id or image hash
+  int nPositions;
+
+  bool operator==(const KvItem& other) const {
+    return isImage == other.isImage && value == other.value &&
+           nPositions == other.nPositions;
+  }
+};
+
+// A sequence state saved as a full base record followed by delta records,
+// each holding only the cells appended since the record before it. Tracks
+// which items the file at `path` covers so the next save can append.
+class KvCheckpoint {
+ public:
+  // Number of leading `items` already in the checkpoint at `path`; 0 unless
+  // the checkpoint was written from this KV generation and its items are a
+  // prefix of `items`.
+  [[nodiscard]] size_t Covered(
+      const std::string& path,
+      const std::vector<KvItem>& items,
+      uint64_t generation
+  ) const;
+
+  // Whether appending `deltaBytes` more would exceed the compaction ratio.
+  [[nodiscard]] bool ShouldCompact(
+      size_t deltaBytes, const CheckpointParams& params
+  ) const;
+
+  // Replaces the file with a single base record, atomically.
+  bool WriteBase(
+      const std::string& path,
+      const std::vector<KvItem>& items,
+      const std::vector<uint8_t>& state,
+      uint64_t generation
+  );
+  // Appends items[first..] and the state of their cells.
+  bool AppendDelta(
+      const std::vector<KvItem>& items,
+      size_t first,
+      const std::vector<uint8_t>& state
+  );
+
+  // Reads the base and delta states in order, stopping at a torn record.
+  // Later saves to `path` under `generation` append to what was read.
+  bool Read(
+      const std::string& path,
+      std::vector<KvItem>& items,
+      std::vector<std::vector<uint8_t>>& states,
+      uint64_t generation
+  );
+
+  void RecordSave(double seconds) { stats.saveSeconds += seconds; }
+  [[nodiscard]] CheckpointStats GetStats() const { return stats; }
+
+ private:
+  std::string path;
+  std::vector<KvItem> items;
+  uint64_t generation = 0;
+  bool appendable = false;
+  size_t baseBytes = 0;
+  size_t deltaBytes = 0;
+  CheckpointStats stats;
+};
@@ -0,0 +1,268 @@
+#include "llama-batch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <optional>
+
+#include "arrow-writer.h"
+#include "logger.h"
+
+namespace {
+
+enum Column : size_t {
+  kId,
+  kText,
+  kTokens,
+  kLogprobs,
+  kPromptTokens,
+  kGeneratedTokens,
+  kPromptSeconds,
+  kGenerationSeconds,
+  kStopReason,
+  kRequestIndex,
+};
+
+const char* StopReasonName(StopReason reason) {
+  switch (reason) {
+    case StopReason::EndOfText:
+      return "end_of_text";
+    case StopReason::MaxTokens:
+      return "max_tokens";
+    case StopReason::ContextFull:
+      return "context_full";
+    case StopReason::Closure:
+      return "closure";
+    case StopReason::LowConfidence:
+      return "low_confidence";
+  }
+  return "unknown";
+}
+
+}  // namespace
+
+class BatchGenerator::Impl {
+ public:
+  explicit Impl(LlamaChat& chat) : chat(chat) {}
+
+  ~Impl() { Close(); }
+
+  bool Open(const BatchParams& batchParams) {
+    params = batchParams;
+    params.rowsPerRecordBatch = std::max<size_t>(params.rowsPerRecordBatch, 1);
+    stats = BatchStats();
+
+    writer.reset();
+    if (params.arrowPath.empty()) {
+      return true;
+    }
+
+    writer.emplace();
+    return writer->Open(
+        params.arrowPath,
+        {{"id", ArrowType::Utf8},
+         {"text", ArrowType::Utf8},
+         {"tokens", ArrowType::Int32List},
+         {"logprobs", ArrowType::Float32List},
+         {"prompt_tokens", ArrowType::Int32},
+         {"generated_tokens", ArrowType::Int32},
+         {"prompt_seconds", ArrowType::Float64},
+         {"generation_seconds", ArrowType::Float64},
+         {"stop_reason", ArrowType::Utf8},
+         {"request_index", ArrowType::Int32}}
+    );
+  }
+
+  bool Generate(const BatchRequest& request, BatchResult& result) {
+    auto start = std::chrono::steady_clock::now();
+
+    const size_t index = stats.requests;
+    const bool generated = Run(request, result);
+    const bool written = generated && (!writer || Write(index, result));
+
+    auto end = std::chrono::steady_clock::now();
+    stats.seconds += std::chrono::duration<double>(end - start).count();
+    return written;
+  }
+
+  bool GenerateAll(
+      const std::vector<BatchRequest>& requests,
+      const BatchGenerator::ResultCallback& callback
+  ) {
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<size_t> order(requests.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return PrefixLess(requests[a], requests[b]);
+    });
+
+    // Each row is written as soon as its request finishes; request_index
+    // gives its place in the input.
+    bool succeeded = true;
+    BatchResult result;
+    for (size_t i : order) {
+      const bool generated = Run(requests[i], result);
+      succeeded = generated && (!writer || Write(i, result)) && succeeded;
+      if (callback) {
+        callback(i, result);
+      }
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    stats.seconds += std::chrono::duration<double>(end - start).count();
+    return succeeded;
+  }
+
+  bool Close() {
+    if (!writer) {
+      return true;
+    }
+
+    const bool closed = writer->Close();
+    stats.recordBatches = writer->RecordBatches();
+    stats.bytesWritten = writer->BytesWritten();
+    writer.reset();
+    return closed;
+  }
+
+  [[nodiscard]] BatchStats GetStats() const {
+    BatchStats current = stats;
+    if (writer) {
+      current.recordBatches = writer->RecordBatches();
+      current.bytesWritten = writer->BytesWritten();
+    }
+    return current;
+  }
+
+ private:
+  LlamaChat& chat;
+  BatchParams params;
+  BatchStats stats;
+  std::optional<ArrowStreamWriter> writer;
+
+  // Requests that share a prompt prefix sort next to each other: by tokens
+  // when given, otherwise by text, whose byte order groups shared prefixes
+  // the same way. Sorted order visits the prefix tree depth first, so each
+  // shared prefix is evaluated once and kept in the KV cache while the
+  // requests below it run.
+  static bool PrefixLess(const BatchRequest& a, const BatchRequest& b) {
+    const bool aTokens = !a.promptTokens.empty();
+    const bool bTokens = !b.promptTokens.empty();
+    if (aTokens != bTokens) {
+      return aTokens;
+    }
+    if (aTokens) {
+      return std::lexicographical_compare(
+          a.promptTokens.begin(),
+          a.promptTokens.end(),
+          b.promptTokens.begin(),
+          b.promptTokens.end()
+      );
+    }
+    return a.prompt < b.prompt;
+  }
+
+  // Answers `request` in a fresh conversation. The KV cache is kept, so the
+  // prompt only evaluates what it does not share with the previous one.
+  bool Run(const BatchRequest& request, BatchResult& result) {
+    result = BatchResult();
+    result.id = request.id;
+    ++stats.requests;
+
+    if (params.systemPrompt.empty()) {
+      chat.ClearHistory();
+    } else {
+      chat.SetSystemPrompt(params.systemPrompt);
+    }
+
+    auto collect = [&result](const GeneratedToken& token) {
+      result.text += token.piece;
+      result.tokens.push_back(token.token.tokenId);
+      result.logprobs.push_back(token.logprob);
+    };
+    try {
+      if (request.promptTokens.empty()) {
+        chat.PromptTokens(request.prompt, collect);
+      } else {
+        chat.PromptTokens(request.promptTokens, collect);
+      }
+    } catch (const std::exception& e) {
+      LogError(
+          "Batch request failed", {{"id", request.id}, {"what", e.what()}}
+      );
+      ++stats.failed;
+      return false;
+    }
+    result.stats = chat.GetLastGenerationStats();
+    stats.generatedTokens += result.tokens.size();
+    stats.promptTokens += result.stats.promptTokens;
+    stats.reusedPromptTokens += result.stats.reusedPromptTokens;
+    return true;
+  }
+
+  bool Write(size_t index, const BatchResult& result) {
+    writer->Column(kId).AppendString(result.id);
+    writer->Column(kText).AppendString(result.text);
+    writer->Column(kTokens).AppendList(result.tokens);
+    writer->Column(kLogprobs).AppendList(result.logprobs);
+    writer->Column(kPromptTokens)
+        .AppendValue(static_cast<int32_t>(result.stats.promptTokens));
+    writer->Column(kGeneratedTokens)
+        .AppendValue(static_cast<int32_t>(result.tokens.size()));
+    writer->Column(kPromptSeconds).AppendValue(result.stats.promptSeconds);
+    writer->Column(kGenerationSeconds)
+        .AppendValue(result.stats.generationSeconds);
+    writer->Column(kStopReason)
+        .AppendString(StopReasonName(result.stats.stopReason));
+    writer->Column(kRequestIndex).AppendValue(static_cast<int32_t>(index));
+    writer->FinishRow();
+
+    if (writer->BufferedRows() < params.rowsPerRecordBatch) {
+      return true;
+    }
+    return writer->Flush();
+  }
+};
+
+BatchGenerator::BatchGenerator(LlamaChat& chat)
+    : pimpl(std::make_unique<Impl>(chat)) {}
+BatchGenerator::~BatchGenerator() = default;
+
+bool BatchGenerator::Open(const BatchParams& params) {
+  try {
+    return pimpl->Open(params);
+  } catch (const std::exception& e) {
+    LogError("Open exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+bool BatchGenerator::Generate(
+    const BatchRequest& request, BatchResult& result
+) {
+  return pimpl->Generate(request, result);
+}
+
+bool BatchGenerator::GenerateAll(
+    const std::vector<BatchRequest>& requests, const ResultCallback& callback
+) {
+  return pimpl->GenerateAll(requests, callback);
+}
+
+bool BatchGenerator::GenerateAll(
+    const std::vector<BatchRequest>& requests,
+    std::vector<BatchResult>& results
+) {
+  results.assign(requests.size(), BatchResult());
+  return pimpl->GenerateAll(
+      requests,
+      [&results](size_t index, const BatchResult& result) {
+        results[index] = result;
+      }
+  );
+}
+
+bool BatchGenerator::Close() { return pimpl->Close(); }
+
+BatchStats BatchGenerator::GetStats() const { return pimpl->GetStats(); }
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llama-chat.h"
+
+struct BatchRequest {
+  std::string id;
+  std::string prompt;
+  // When set, used instead of `prompt`, e.g. a record of a TokenCorpus.
+  TokenSpan promptTokens = {};
+  // Likely response length, used by ParallelGenerator to group requests;
+  // 0 when unknown, which plans for maxTokens.
+  size_t expectedTokens = 0;
+};
+
+struct BatchResult {
+  std::string id;
+  std::string text;
+  std::vector<llama_token> tokens;
+  std::vector<float> logprobs;  // One per token
+  GenerationStats stats;
+};
+
+struct BatchParams {
+  // Conversation every request starts from; empty for none.
+  std::string systemPrompt;
+  // When set, results are also written to this file as an Arrow IPC stream.
+  std::string arrowPath;
+  // Results buffered before they are written as one Arrow record batch;
+  // together with the result being generated, all a batch keeps in memory.
+  size_t rowsPerRecordBatch = 1024;
+};
+
+struct BatchStats {
+  size_t requests = 0;
+  size_t failed = 0;
+  size_t generatedTokens = 0;
+  size_t promptTokens = 0;
+  size_t reusedPromptTokens = 0;  // Prompt tokens kept in the KV cache
+  size_t recordBatches = 0;
+  size_t bytesWritten = 0;
+  double seconds = 0.0;
+
+  [[nodiscard]] double PromptReuse() const {
+    return promptTokens > 0 ? static_cast<double>(reusedPromptTokens) /
+                                  static_cast<double>(promptTokens)
+                            : 0.0;
+  }
+};
+
+// Runs independent prompts through one LlamaChat, each in a fresh
+// conversation that keeps the KV cache of the prompt prefix it shares with
+// the previous request, e.g. the system prompt. Results can be streamed to
+// an Arrow IPC file with one row per request: id, text, tokens, logprobs,
+// prompt_tokens, generated_tokens, prompt_seconds, generation_seconds,
+// stop_reason and request_index. Rows are in the order the requests ran;
+// request_index is the position of the request in the GenerateAll input, or
+// the number of requests before it since Open.
+class BatchGenerator {
+ public:
+  // Receives each result with the index of its request, as it finishes.
+  using ResultCallback =
+      std::function<void(size_t index, const BatchResult& result)>;
+
+  explicit BatchGenerator(LlamaChat& chat);
+  ~BatchGenerator();
+
+  BatchGenerator(const BatchGenerator&) = delete;
+  BatchGenerator& operator=(const BatchGenerator&) = delete;
+
+  bool Open(const BatchParams& params = {});
+  bool Generate(const BatchRequest& request, BatchResult& result);
+  // Runs the requests sorted by prompt, so requests sharing a prefix run
+  // back to back and the prefix is evaluated once for all of them. Arrow
+  // rows are written and `callback` is called as each request finishes.
+  bool GenerateAll(
+      const std::vector<BatchRequest>& requests, const ResultCallback& callback
+  );
+  // Collects every result in input order, so all of them stay in memory.
+  bool GenerateAll(
+      const std::vector<BatchRequest>& requests,
+      std::vector<BatchResult>& results
+  );
+  // Writes the remaining rows and ends the Arrow stream.
+  bool Close();
+
+  [[nodiscard]] BatchStats GetStats() const;
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> pimpl;
+};
@@ -1,16 +1,32 @@
 #include "llama-chat.h"
 
-#include <iostream>
-#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <optional>
 #include <stdexcept>
 #include <vector>
 
+#include "chat-format.h"
 #include "common.h"
+#include "context-tiers.h"
+#include "control-vectors.h"
+#include "dry-sampler.h"
+#include "generation-control.h"
+#include "image-cache.h"
+#include "journal-file.h"
+#include "kv-checkpoint.h"
 #include "llama.h"
+#include "logger.h"
+#include "prompt-compressor.h"
+#include "vision-encoder.h"
+#include "vocabulary.h"
 
 class LlamaChat::Impl {
  public:
-  Impl() { llama_backend_init(); }
+  Impl() {
+    InstallLlamaLogCallback();
+    llama_backend_init();
+  }
 
   ~Impl() { llama_backend_free(); }
 
@@ -23,32 +39,63 @@ class LlamaChat::Impl {
     modelParams.use_mmap = params.useMemoryMapping;
     modelParams.use_mlock = params.useModelLock;
 
-    model.reset(llama_load_model_from_file(model_path.c_str(), modelParams));
+    model.reset(
+        llama_load_model_from_file(model_path.c_str(), modelParams),
+        llama_free_model
+    );
     if (!model) {
-      std::cerr << "Failed to load model from " << model_path << std::endl;
+      LogError("Failed to load model", {{"path", model_path}});
       return false;
     }
 
+    vocabulary = std::make_shared<Vocabulary>();
+    vocabulary->Initialize(model.get(), model_path, params);
+
     return true;
   }
 
   bool InitializeContext(const ContextParams& params) {
-    llama_context_params ctxParams = llama_context_default_params();
-    ctxParams.n_ctx = params.nContext;
-    ctxParams.n_threads = params.nThreads;
-    ctxParams.n_batch = params.nBatch;
-    ctxParams.logits_all = false;
-    ctxParams.embeddings = false;
+    pool.reset();
+    contextParams = params;
+    return StartContext();
+  }
+
+  bool InitializeContext(
+      const std::shared_ptr<ContextTiers>& tiers, size_t predictedTokens
+  ) {
+    if (!tiers) {
+      LogError("ContextPool is not initialized");
+      return false;
+    }
+
+    ctx.reset();
+    pool = tiers;
+    model = tiers->GetModel();
+    vocabulary = tiers->GetVocabulary();
+    contextParams.nContext = tiers->MaxContext();
+    contextParams.nContextInitial = tiers->TierFor(predictedTokens);
+    return StartContext();
+  }
+
+  bool StartContext() {
+    contextStats = ContextStats();
 
-    ctx.reset(llama_new_context_with_model(model.get(), ctxParams));
+    ctx = NewContext(InitialContextSize());
+    kvItems.clear();
+    kvPosition = 0;
+    ++kvGeneration;
+    steeringChanged = !steering.vectors.empty();
     if (!ctx) {
-      std::cerr << "Failed to create the llama_context" << std::endl;
+      LogError(
+          "Failed to create the llama_context",
+          {{"nContext", std::to_string(InitialContextSize())}}
+      );
       return false;
     }
 
-    auto eot_tokens = Encode("<|eot_id|>", false, true);
+    auto eot_tokens = Encode(kEndOfTurn, false, true);
     if (eot_tokens.size() != 1) {
-      std::cerr << "Failed to retrieve <|eot_id|> token ID." << std::endl;
+      LogError("Failed to retrieve <|eot_id|> token ID.");
       return false;
     }
     eotToken = eot_tokens[0].tokenId;
@@ -56,209 +103,1071 @@ class LlamaChat::Impl {
     return true;
   }
 
+  bool InitializeVision(
+      const std::string& projectorPath, const VisionParams& params
+  ) {
+    if (!model) {
+      LogError("InitializeVision requires a loaded model");
+      return false;
+    }
+
+    auto encoder = std::make_unique<VisionEncoder>();
+    if (!encoder->Initialize(projectorPath, model.get())) {
+      return false;
+    }
+
+    vision = std::move(encoder);
+    imageCache = std::make_unique<ImageEmbeddingCache>(params.imageCacheBytes);
+    visionThreads = params.nThreads;
+
+    return true;
+  }
+
+  bool LoadControlVector(const std::string& name, const std::string& path) {
+    if (!model) {
+      LogError("LoadControlVector requires a loaded model");
+      return false;
+    }
+
+    if (!controlVectors.Load(name, path, llama_n_embd(model.get()))) {
+      return false;
+    }
+
+    // Only a reloaded vector of the active combination changes the cache.
+    if (std::any_of(
+            steering.vectors.begin(),
+            steering.vectors.end(),
+            [&name](const auto& vector) { return vector.name == name; }
+        )) {
+      steeringChanged = true;
+    }
+    return true;
+  }
+
+  bool SetSteering(const SteeringParams& params) {
+    for (const auto& vector : params.vectors) {
+      if (!controlVectors.Contains(vector.name)) {
+        LogError("Unknown control vector", {{"name", vector.name}});
+        return false;
+      }
+    }
+
+    steering = params;
+    steeringChanged = true;
+    return true;
+  }
+
+  bool InitializeCompression(
+      const std::string& modelPath, const CompressionParams& params
+  ) {
+    auto candidate = std::make_unique<PromptCompressor>();
+    if (!candidate->Initialize(modelPath, params)) {
+      return false;
+    }
+
+    compressor = std::move(candidate);
+    return true;
+  }
+
+  [[nodiscard]] CompressionStats GetLastCompressionStats() const {
+    return lastCompressionStats;
+  }
+
+  [[nodiscard]] ContextStats GetContextStats() const { return contextStats; }
+
+  [[nodiscard]] GenerationStats GetLastGenerationStats() const {
+    return lastGenerationStats;
+  }
+
+  [[nodiscard]] ImageCacheStats GetImageCacheStats() const {
+    return imageCache ? imageCache->GetStats() : ImageCacheStats{};
+  }
+
   [[nodiscard]] std::vector<LlamaToken> Encode(
       const std::string& text, bool addBos, bool parseSpecial = false
   ) const {
-    int maxTokens = text.length() + (addBos ? 1 : 0);
-    std::vector<llama_token> llamaTokens(maxTokens);
-
-    int nTokens = llama_tokenize(
-        model.get(),
-        text.c_str(),
-        text.length(),
-        llamaTokens.data(),
-        maxTokens,
-        addBos,
-        parseSpecial
+    return vocabulary->Encode(text, addBos, parseSpecial);
+  }
+
+  [[nodiscard]] TokenEstimate EstimateTokens(const std::string& text) const {
+    return vocabulary->EstimateTokens(text);
+  }
+
+  [[nodiscard]] TokenizerCacheStats GetTokenizerCacheStats() const {
+    return vocabulary->GetCacheStats();
+  }
+
+  void Prompt(
+      const std::string& userMessage,
+      const std::vector<ImageInput>& images,
+      const std::function<void(const std::string&)>& callback
+  ) {
+    PromptTokens(
+        userMessage,
+        images,
+        [&callback](const GeneratedToken& token) { callback(token.piece); },
+        false
     );
+  }
 
-    if (nTokens < 0) {
-      std::cerr << "Tokenization failed with error code: " << nTokens
-                << std::endl;
-      return {};
+  void PromptTokens(
+      const std::string& userMessage,
+      const std::vector<ImageInput>& images,
+      const std::function<void(const GeneratedToken&)>& callback,
+      bool withLogprobs
+  ) {
+    if (!images.empty() && !vision) {
+      throw std::runtime_error("Image input requires InitializeVision()");
     }
 
-    llamaTokens.resize(nTokens);
+    if (!Resume()) {
+      throw std::runtime_error("Failed to resume the suspended session");
+    }
+
+    ApplySteering();
+    AddUserMessage(userMessage, images);
+    StreamResponse(callback, withLogprobs);
+  }
 
-    std::vector<LlamaToken> tokens;
-    tokens.reserve(nTokens);
-    for (auto token : llamaTokens) {
-      tokens.emplace_back(token);
+  void PromptTokens(
+      TokenSpan userTokens,
+      const std::function<void(const GeneratedToken&)>& callback
+  ) {
+    if (!Resume()) {
+      throw std::runtime_error("Failed to resume the suspended session");
     }
 
-    return tokens;
+    ApplySteering();
+    AddUserTokens(userTokens);
+    StreamResponse(callback, true);
   }
 
-  void Prompt(
+  void PromptWithContext(
       const std::string& userMessage,
+      const std::vector<std::string>& contextBlocks,
       const std::function<void(const std::string&)>& callback
   ) {
-    AddUserMessage(userMessage);
-    RunQueryStream([this, &callback](const std::string& piece) {
-      callback(piece);
-    });
+    CompressionStats stats;
+    auto start = std::chrono::steady_clock::now();
+
+    // Counted in this model's vocabulary, whatever the compressor uses, so
+    // the counts match the prefill rate they are multiplied by.
+    std::string message;
+    for (const auto& block : contextBlocks) {
+      const size_t nTokens = vocabulary->CountTokens(block, false, false);
+      stats.originalTokens += nTokens;
+      if (compressor) {
+        CompressionStats compressorStats;
+        const std::string compressed =
+            compressor->Compress(block, compressorStats);
+        stats.compressedTokens +=
+            vocabulary->CountTokens(compressed, false, false);
+        message += compressed;
+      } else {
+        stats.compressedTokens += nTokens;
+        message += block;
+      }
+      message += "\n\n";
+    }
+    message += userMessage;
+
+    auto end = std::chrono::steady_clock::now();
+    stats.compressionSeconds =
+        std::chrono::duration<double>(end - start).count();
+    stats.prefillSecondsSaved =
+        static_cast<double>(stats.originalTokens - stats.compressedTokens) *
+        prefillSecondsPerToken;
+    lastCompressionStats = stats;
+
+    Prompt(message, {}, callback);
+  }
+
+  bool Suspend() {
+    if (suspended) {
+      return true;
+    }
+    if (!ctx) {
+      return false;
+    }
+
+    suspendedState.resize(llama_state_seq_get_size(ctx.get(), 0));
+    suspendedState.resize(
+        llama_state_seq_get_data(ctx.get(), suspendedState.data(), 0)
+    );
+    ctx.reset();
+    suspended = true;
+    return true;
+  }
+
+  bool Resume() {
+    if (!suspended) {
+      return true;
+    }
+
+    auto restored = NewContext(
+        std::max(InitialContextSize(), static_cast<size_t>(kvPosition) + 1)
+    );
+    if (!restored) {
+      return false;
+    }
+    if (!steering.vectors.empty()) {
+      ApplyControlVector(restored.get());
+    }
+
+    ctx = std::move(restored);
+    if (!suspendedState.empty() &&
+        llama_state_seq_set_data(ctx.get(), suspendedState.data(), 0) == 0) {
+      // The history is still there; the next prompt re-evaluates it.
+      LogWarning("Failed to restore the suspended sequence state");
+      kvItems.clear();
+      kvPosition = 0;
+    }
+
+    suspendedState.clear();
+    suspendedState.shrink_to_fit();
+    suspended = false;
+    return true;
+  }
+
+  [[nodiscard]] bool IsSuspended() const { return suspended; }
+
+  [[nodiscard]] ModelInfo GetModelInfo() const {
+    ModelInfo info;
+    if (!model) {
+      return info;
+    }
+
+    char description[128];
+    llama_model_desc(model.get(), description, sizeof(description));
+    info.description = description;
+    info.sizeBytes = llama_model_size(model.get());
+    info.parameters = llama_model_n_params(model.get());
+    info.vocabularyFingerprint = vocabulary->Fingerprint();
+    return info;
+  }
+
+  [[nodiscard]] MemoryUsage GetMemoryUsage() const {
+    MemoryUsage usage;
+    if (ctx && kvPosition > 0) {
+      usage.kvBytes = llama_state_seq_get_size(ctx.get(), 0);
+    }
+
+    usage.hostBytes = suspendedState.size();
+    for (const auto& message : conversationHistory) {
+      usage.hostBytes += message.role.size() + message.content.size() +
+                         message.tokens.size() * sizeof(llama_token);
+      for (const auto& image : message.images) {
+        usage.hostBytes += image.data->size();
+      }
+    }
+    return usage;
+  }
+
+  bool AttachJournal(
+      const std::shared_ptr<JournalFile>& file, const std::string& sessionId
+  ) {
+    if (!file) {
+      LogError("AttachJournal requires an open journal");
+      return false;
+    }
+
+    journal = file;
+    journalSession = sessionId;
+
+    RecoveredConversation recovered;
+    if (!journal->TakeRecovered(sessionId, recovered)) {
+      // Nothing to restore: the journal starts from the current history,
+      // e.g. a system prompt set before attaching.
+      if (!conversationHistory.empty()) {
+        journal->AppendReset(journalSession);
+        for (const auto& message : conversationHistory) {
+          journal->AppendMessage(
+              journalSession, message.role, message.content
+          );
+        }
+      }
+      return true;
+    }
+
+    // Only the history is journaled; the next prompt evaluates it again,
+    // reusing whatever prefix the KV cache still holds.
+    conversationHistory.clear();
+    for (auto& message : recovered.messages) {
+      conversationHistory.push_back(
+          {std::move(message.role), std::move(message.content)}
+      );
+    }
+    if (!recovered.partialResponse.empty()) {
+      conversationHistory.push_back(
+          {"assistant", std::move(recovered.partialResponse)}
+      );
+    }
+    if (conversationHistory.size() > kMaxHistorySize) {
+      conversationHistory.erase(
+          conversationHistory.begin(),
+          conversationHistory.end() - kMaxHistorySize
+      );
+    }
+    return true;
+  }
+
+  bool SaveCheckpoint(const std::string& path, const CheckpointParams& params) {
+    if (!ctx && !suspended) {
+      LogError("SaveCheckpoint requires a context");
+      return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    const size_t covered = checkpoint.Covered(path, kvItems, kvGeneration);
+    if (covered > 0 && covered == kvItems.size()) {
+      return true;
+    }
+
+    bool saved;
+    if (covered > 0 && !suspended) {
+      int position = 0;
+      for (size_t i = 0; i < covered; ++i) {
+        position += kvItems[i].nPositions;
+      }
+
+      // The scratch sequence shares the cells of sequence 0, so copying the
+      // tail into it costs no KV memory and serializes only the new cells.
+      llama_kv_cache_seq_cp(ctx.get(), 0, kScratchSequence, position, -1);
+      std::vector<uint8_t> delta(
+          llama_state_seq_get_size(ctx.get(), kScratchSequence)
+      );
+      delta.resize(llama_state_seq_get_data(
+          ctx.get(), delta.data(), kScratchSequence
+      ));
+      llama_kv_cache_seq_rm(ctx.get(), kScratchSequence, -1, -1);
+
+      saved = checkpoint.ShouldCompact(delta.size(), params)
+                  ? WriteCheckpointBase(path)
+                  : checkpoint.AppendDelta(kvItems, covered, delta);
+    } else {
+      saved = WriteCheckpointBase(path);
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    checkpoint.RecordSave(std::chrono::duration<double>(end - start).count());
+    return saved;
+  }
+
+  bool LoadCheckpoint(const std::string& path) {
+    if (!Resume()) {
+      return false;
+    }
+    if (!ctx) {
+      LogError("LoadCheckpoint requires a context");
+      return false;
+    }
+
+    ResetKvCache();
+
+    std::vector<KvItem> items;
+    std::vector<std::vector<uint8_t>> states;
+    if (!checkpoint.Read(path, items, states, kvGeneration)) {
+      return false;
+    }
+
+    int positions = 0;
+    for (const auto& item : items) {
+      positions += item.nPositions;
+    }
+    if (!EnsureContext(static_cast<size_t>(positions) + 1)) {
+      LogError(
+          "Checkpoint does not fit the context",
+          {{"positions", std::to_string(positions)}}
+      );
+      return false;
+    }
+
+    bool restored =
+        llama_state_seq_set_data(ctx.get(), states[0].data(), 0) != 0;
+    for (size_t i = 1; restored && i < states.size(); ++i) {
+      restored = llama_state_seq_set_data(
+                     ctx.get(), states[i].data(), kScratchSequence
+                 ) != 0;
+      llama_kv_cache_seq_cp(ctx.get(), kScratchSequence, 0, -1, -1);
+      llama_kv_cache_seq_rm(ctx.get(), kScratchSequence, -1, -1);
+    }
+    if (!restored) {
+      LogError("Failed to restore the checkpoint", {{"path", path}});
+      ResetKvCache();
+      return false;
+    }
+
+    kvItems = std::move(items);
+    kvPosition = positions;
+    return true;
+  }
+
+  [[nodiscard]] CheckpointStats GetCheckpointStats() const {
+    return checkpoint.GetStats();
+  }
+
+  void SetSamplingParams(const SamplingParams& params) {
+    samplingParams = params;
   }
 
   void SetSystemPrompt(const std::string& systemPrompt) {
     conversationHistory.clear();
     conversationHistory.push_back({"system", systemPrompt});
+
+    if (journal) {
+      journal->AppendReset(journalSession);
+      journal->AppendMessage(journalSession, "system", systemPrompt);
+    }
   }
 
-  void ResetConversation() {
+  void ClearHistory() {
     conversationHistory.clear();
+    if (journal) {
+      journal->AppendReset(journalSession);
+    }
+  }
+
+  void ResetConversation() {
+    ClearHistory();
+
+    kvItems.clear();
+    kvPosition = 0;
+
+    if (suspended) {
+      suspendedState.clear();
+      suspendedState.shrink_to_fit();
+      return;
+    }
 
     llama_kv_cache_clear(ctx.get());
+
+    if (llama_n_ctx(ctx.get()) > InitialContextSize()) {
+      if (auto smaller = NewContext(InitialContextSize())) {
+        if (!steering.vectors.empty()) {
+          ApplyControlVector(smaller.get());
+        }
+        ctx = std::move(smaller);
+        ++contextStats.shrinks;
+      }
+    }
   }
 
  private:
-  struct LlamaModelDeleter {
-    void operator()(llama_model* model) const { llama_free_model(model); }
+  struct LlamaBatch {
+    llama_batch batch;
+
+    explicit LlamaBatch(int32_t nTokens)
+        : batch(llama_batch_init(nTokens, 0, 1)) {}
+    ~LlamaBatch() { llama_batch_free(batch); }
+
+    LlamaBatch(const LlamaBatch&) = delete;
+    LlamaBatch& operator=(const LlamaBatch&) = delete;
   };
 
-  struct LlamaContextDeleter {
-    void operator()(llama_context* ctx) const { llama_free(ctx); }
+  struct MessageImage {
+    uint64_t hash;
+    std::shared_ptr<const std::vector<uint8_t>> data;
   };
 
   struct Message {
     std::string role;
     std::string content;
+    std::vector<MessageImage> images = {};
+    std::optional<size_t> tokenCount = std::nullopt;
+    // Content given as tokens; `content` then only holds it for the journal.
+    std::vector<llama_token> tokens = {};
   };
 
+  // A run of prompt text, an image or pre-tokenized content, in prompt order.
+  struct PromptSegment {
+    std::string text;
+    const MessageImage* image = nullptr;
+    const std::vector<llama_token>* tokens = nullptr;
+  };
+
+  struct PromptItem {
+    llama_token token;
+    const MessageImage* image;
+  };
+
+  // TODO: make configurable
+  static constexpr size_t kMaxHistorySize = 10;
+
   std::vector<Message> conversationHistory;
-  std::unique_ptr<llama_model, LlamaModelDeleter> model = nullptr;
-  std::unique_ptr<llama_context, LlamaContextDeleter> ctx = nullptr;
+  std::shared_ptr<llama_model> model = nullptr;
+  std::shared_ptr<ContextTiers> pool;  // Set when contexts are leased
+
+  PooledContext ctx = nullptr;
+  ContextParams contextParams;
+  ContextStats contextStats;
   llama_token eotToken;
+  std::shared_ptr<Vocabulary> vocabulary = std::make_shared<Vocabulary>();
+  SamplingParams samplingParams;
+  GenerationStats lastGenerationStats;
+
+  ControlVectors controlVectors;
+  SteeringParams steering;
+  bool steeringChanged = false;
 
-  void BuildPrompt(std::string& prompt) const {
-    std::ostringstream oss;
-    oss << "<|begin_of_text|>";
+  std::unique_ptr<PromptCompressor> compressor;
+  CompressionStats lastCompressionStats;
+  double prefillSecondsPerToken = 0.0;  // Moving average
+
+  std::shared_ptr<JournalFile> journal;
+  std::string journalSession;
+
+  // Holds copies of sequence 0 cells while checkpoints are saved or loaded.
+  static constexpr llama_seq_id kScratchSequence = 1;
+  KvCheckpoint checkpoint;
+
+  std::vector<KvItem> kvItems;
+  int kvPosition = 0;
+  // Bumped whenever cells may change without the items changing, e.g. when
+  // steering does, so checkpoints know they can no longer append.
+  uint64_t kvGeneration = 0;
+
+  // Sequence state kept in host memory while the context is released.
+  bool suspended = false;
+  std::vector<uint8_t> suspendedState;
+
+  std::unique_ptr<VisionEncoder> vision;
+  std::unique_ptr<ImageEmbeddingCache> imageCache;
+  int visionThreads = 4;
+
+  static std::string FormatMessage(const Message& message) {
+    return FormatTurn(message.role, message.content);
+  }
+
+  static void AppendText(
+      std::vector<PromptSegment>& segments, const std::string& text
+  ) {
+    if (segments.empty() || segments.back().image || segments.back().tokens) {
+      segments.push_back({text});
+    } else {
+      segments.back().text += text;
+    }
+  }
+
+  static void AppendMessage(
+      std::vector<PromptSegment>& segments, const Message& message
+  ) {
+    if (!message.tokens.empty()) {
+      AppendText(segments, TurnHeader(message.role));
+      segments.push_back({"", nullptr, &message.tokens});
+      AppendText(segments, kEndOfTurn);
+      return;
+    }
+    if (message.images.empty()) {
+      AppendText(segments, FormatMessage(message));
+      return;
+    }
+
+    AppendText(segments, TurnHeader(message.role));
+    for (const auto& image : message.images) {
+      segments.push_back({"", &image});
+    }
+    AppendText(segments, message.content + kEndOfTurn);
+  }
+
+  [[nodiscard]] size_t ImagePositions(const Message& message) const {
+    return vision ? message.images.size() * vision->PositionsPerImage() : 0;
+  }
+
+  size_t CountMessageTokens(Message& message) const {
+    if (!message.tokenCount) {
+      message.tokenCount =
+          vocabulary->CountTokens(FormatMessage(message), false, true) +
+          ImagePositions(message);
+    }
+    return *message.tokenCount;
+  }
+
+  void BuildPrompt(std::vector<PromptSegment>& segments) {
+    segments.clear();
+    AppendText(segments, kBeginOfText);
 
     // Add system prompt first
     for (const auto& msg : conversationHistory) {
       if (msg.role == "system") {
-        oss << "<|start_header_id|>" << msg.role << "<|end_header_id|>"
-            << msg.content << "<|eot_id|>";
+        AppendMessage(segments, msg);
         break;  // Assume there's only one system message
       }
     }
 
-    size_t totalTokens = 0;
+    // Keep the most recent messages that fit. Upper bounds admit messages
+    // that surely fit and estimates reject those that clearly do not; exact
+    // counts are only taken near the budget edge and memoized per message.
     const size_t maxTokens =
         1024;  // Adjust this based on your model's context size
-    for (auto it = conversationHistory.begin(); it != conversationHistory.end();
+    size_t boundTokens = 0;
+    size_t estimatedTokens = 0;
+    std::vector<Message*> admitted;
+    for (auto it = conversationHistory.rbegin();
+         it != conversationHistory.rend();
          ++it) {
-      if (it->role != "system") {
-        std::string messageContent = "<|start_header_id|>" + it->role +
-                                     "<|end_header_id|>" + it->content +
-                                     "<|eot_id|>";
-        auto tokens = Encode(messageContent, false);
-        if (totalTokens + tokens.size() > maxTokens) {
+      if (it->role == "system") {
+        continue;
+      }
+
+      TokenEstimate estimate;
+      if (it->tokenCount) {
+        estimate.estimate = estimate.upperBound = *it->tokenCount;
+      } else {
+        estimate = vocabulary->EstimateTokens(FormatMessage(*it));
+        estimate.estimate += ImagePositions(*it);
+        estimate.upperBound += ImagePositions(*it);
+      }
+
+      if (boundTokens + estimate.upperBound > maxTokens) {
+        if (estimatedTokens + estimate.estimate > maxTokens + maxTokens / 4) {
+          break;
+        }
+
+        boundTokens = 0;
+        for (Message* message : admitted) {
+          boundTokens += CountMessageTokens(*message);
+        }
+        estimatedTokens = boundTokens;
+        estimate.estimate = estimate.upperBound = CountMessageTokens(*it);
+        if (boundTokens + estimate.upperBound > maxTokens) {
           break;
         }
-        oss << messageContent;
-        totalTokens += tokens.size();
       }
+
+      boundTokens += estimate.upperBound;
+      estimatedTokens += estimate.estimate;
+      admitted.push_back(&*it);
     }
 
-    oss << "<|start_header_id|>assistant<|end_header_id|>";
+    for (auto it = admitted.rbegin(); it != admitted.rend(); ++it) {
+      AppendMessage(segments, **it);
+    }
 
-    prompt = oss.str();
+    AppendText(segments, TurnHeader("assistant"));
   }
 
-  [[nodiscard]] LlamaToken SampleToken(const SamplingParams& params) const {
-    const float* logits = llama_get_logits(ctx.get());
-    const int nVocabulary = llama_n_vocab(model.get());
-
+  [[nodiscard]] LlamaToken SampleToken(
+      const SamplingParams& params,
+      const DrySampler& dry,
+      TokenDistribution& distribution
+  ) const {
     std::vector<llama_token_data> candidates;
-    candidates.reserve(nVocabulary);
+    return LlamaToken(::SampleToken(
+        ctx.get(),
+        llama_get_logits(ctx.get()),
+        params,
+        dry,
+        eotToken,
+        candidates,
+        distribution
+    ));
+  }
 
-    for (llama_token tokenId = 0; tokenId < nVocabulary; tokenId++) {
-      candidates.emplace_back(llama_token_data{tokenId, logits[tokenId], 0.0f});
+  void AddUserMessage(
+      const std::string& message, const std::vector<ImageInput>& images
+  ) {
+    if (conversationHistory.size() >= kMaxHistorySize) {
+      conversationHistory.erase(conversationHistory.begin());
     }
 
-    llama_token_data_array candidatesP = {
-        candidates.data(),
-        candidates.size(),
-        false
-    };
+    Message userMessage{"user", message};
+    for (const auto& image : images) {
+      userMessage.images.push_back(
+          {HashImage(image.data),
+           std::make_shared<const std::vector<uint8_t>>(image.data)}
+      );
+    }
+    conversationHistory.push_back(std::move(userMessage));
+
+    if (journal) {
+      journal->AppendMessage(journalSession, "user", message);
+    }
+  }
+
+  void AddUserTokens(TokenSpan tokens) {
+    if (conversationHistory.size() >= kMaxHistorySize) {
+      conversationHistory.erase(conversationHistory.begin());
+    }
+
+    Message userMessage{"user", ""};
+    userMessage.tokens.assign(tokens.begin(), tokens.end());
+    userMessage.tokenCount =
+        vocabulary->CountTokens(FormatMessage(userMessage), false, true) +
+        tokens.size;
+
+    if (journal) {
+      userMessage.content = vocabulary->Decode(
+          std::vector<LlamaToken>(tokens.begin(), tokens.end())
+      );
+      journal->AppendMessage(journalSession, "user", userMessage.content);
+    }
+    conversationHistory.push_back(std::move(userMessage));
+  }
+
+  void StreamResponse(
+      const std::function<void(const GeneratedToken&)>& callback,
+      bool withLogprobs
+  ) {
+    RunQueryStream(
+        [this, &callback](const GeneratedToken& token) {
+          if (journal) {
+            journal->AppendPiece(journalSession, token.piece);
+          }
+          callback(token);
+        },
+        withLogprobs
+    );
+  }
 
-    if (!params.repeatPenaltyTokens.empty()) {
-      std::vector<llama_token> penaltyTokens;
-      for (const auto& token : params.repeatPenaltyTokens) {
-        penaltyTokens.push_back(token.tokenId);
+  [[nodiscard]] size_t InitialContextSize() const {
+    return contextParams.nContextInitial > 0
+               ? std::min(contextParams.nContextInitial, contextParams.nContext)
+               : contextParams.nContext;
+  }
+
+  PooledContext NewContext(size_t nContext, bool promotion = false) {
+    if (pool) {
+      PooledContext leased = pool->Acquire(nContext, promotion);
+      if (leased) {
+        contextStats.nContext = llama_n_ctx(leased.get());
+        contextStats.peakContext =
+            std::max(contextStats.peakContext, contextStats.nContext);
       }
+      return leased;
+    }
+
+    llama_context_params ctxParams = llama_context_default_params();
+    ctxParams.n_ctx = nContext;
+    ctxParams.n_threads = contextParams.nThreads;
+    ctxParams.n_batch = contextParams.nBatch;
+    ctxParams.logits_all = false;
+    ctxParams.embeddings = false;
+
+    PooledContext created(
+        llama_new_context_with_model(model.get(), ctxParams), ContextReleaser()
+    );
+    if (created) {
+      contextStats.nContext = llama_n_ctx(created.get());
+      contextStats.peakContext =
+          std::max(contextStats.peakContext, contextStats.nContext);
+    }
+    return created;
+  }
+
+  // Makes room for `required` positions by moving sequence 0 into a context
+  // of twice the size (or more, up to nContext). Returns false if the
+  // context cannot grow that far.
+  bool EnsureContext(size_t required) {
+    const size_t current = llama_n_ctx(ctx.get());
+    if (required <= current) {
+      return true;
+    }
+    if (current >= contextParams.nContext) {
+      return false;
+    }
+
+    size_t size = current;
+    while (size < required) {
+      size *= 2;
+    }
+    size = std::min(size, contextParams.nContext);
 
-      llama_sample_repetition_penalties(
-          ctx.get(),
-          &candidatesP,
-          penaltyTokens.data(),
-          penaltyTokens.size(),
-          params.repeatPenalty,
-          params.frequencyPenalty,
-          params.presencePenalty
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<uint8_t> state(llama_state_seq_get_size(ctx.get(), 0));
+    state.resize(llama_state_seq_get_data(ctx.get(), state.data(), 0));
+
+    auto larger = NewContext(size, true);
+    if (!larger) {
+      LogWarning(
+          "Failed to grow the llama_context",
+          {{"nContext", std::to_string(size)}}
       );
+      return false;
+    }
+    if (!steering.vectors.empty()) {
+      ApplyControlVector(larger.get());
     }
 
-    llama_sample_top_k(ctx.get(), &candidatesP, params.topK, 1);
-    llama_sample_top_p(ctx.get(), &candidatesP, params.topP, 1);
-    llama_sample_temp(ctx.get(), &candidatesP, params.temperature);
+    ctx = std::move(larger);
+    ++contextStats.grows;
+    if (llama_state_seq_set_data(ctx.get(), state.data(), 0) == 0) {
+      kvItems.clear();
+      kvPosition = 0;
+      throw std::runtime_error("Failed to migrate the sequence state");
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    contextStats.migratedBytes += state.size();
+    contextStats.migrationSeconds +=
+        std::chrono::duration<double>(end - start).count();
 
-    return LlamaToken(llama_sample_token(ctx.get(), &candidatesP));
+    return llama_n_ctx(ctx.get()) >= required;
   }
 
-  void AddUserMessage(const std::string& message) {
-    // TODO: make configurable
-    const size_t maxHistorySize = 10;
+  void ApplyControlVector(llama_context* target) const {
+    const int nEmbd = llama_n_embd(model.get());
+    const int layerEnd =
+        steering.layerEnd < 0 ? llama_n_layer(model.get()) : steering.layerEnd;
 
-    if (conversationHistory.size() >= maxHistorySize) {
-      conversationHistory.erase(conversationHistory.begin());
+    std::vector<float> data;
+    if (!controlVectors.Combine(steering.vectors, data)) {
+      throw std::runtime_error("Failed to combine control vectors");
     }
 
-    conversationHistory.push_back({"user", message});
+    const int32_t result =
+        data.empty()
+            ? llama_control_vector_apply(target, nullptr, 0, nEmbd, -1, -1)
+            : llama_control_vector_apply(
+                  target,
+                  data.data(),
+                  data.size(),
+                  nEmbd,
+                  steering.layerStart,
+                  layerEnd
+              );
+    if (result != 0) {
+      throw std::runtime_error("Failed to apply control vectors");
+    }
   }
 
-  void RunQueryStream(const std::function<void(const std::string&)>& callback) {
-    std::string prompt;
-    BuildPrompt(prompt);
+  // Steering alters every layer's output, so KV entries computed under the
+  // previous combination cannot be reused.
+  void ApplySteering() {
+    if (!steeringChanged) {
+      return;
+    }
 
-    SamplingParams params;
-    auto tokens = Encode(prompt, false, true);
+    ApplyControlVector(ctx.get());
+    ResetKvCache();
+    steeringChanged = false;
+  }
 
-    llama_batch batch = llama_batch_init(params.maxTokens, 0, 1);
-    for (size_t i = 0; i < tokens.size(); ++i) {
-      llama_batch_add(batch, tokens[i].tokenId, i, {0}, false);
+  void ResetKvCache() {
+    llama_kv_cache_seq_rm(ctx.get(), 0, -1, -1);
+    kvItems.clear();
+    kvPosition = 0;
+    ++kvGeneration;
+  }
+
+  bool WriteCheckpointBase(const std::string& path) {
+    if (suspended) {
+      return checkpoint.WriteBase(path, kvItems, suspendedState, kvGeneration);
     }
 
-    if (llama_decode(ctx.get(), batch) != 0) {
+    std::vector<uint8_t> state(llama_state_seq_get_size(ctx.get(), 0));
+    state.resize(llama_state_seq_get_data(ctx.get(), state.data(), 0));
+    return checkpoint.WriteBase(path, kvItems, state, kvGeneration);
+  }
+
+  void Decode(LlamaBatch& batch) {
+    if (batch.batch.n_tokens == 0) {
+      return;
+    }
+    if (llama_decode(ctx.get(), batch.batch) != 0) {
+      ResetKvCache();
       throw std::runtime_error("llama_decode() failed");
     }
+    llama_batch_clear(batch.batch);
+  }
+
+  [[nodiscard]] std::shared_ptr<const ImageEmbedding> GetImageEmbedding(
+      const MessageImage& image
+  ) {
+    auto embedding = imageCache->Find(image.hash);
+    if (!embedding) {
+      embedding = vision->Encode(*image.data, visionThreads);
+      if (!embedding) {
+        throw std::runtime_error("Failed to encode image");
+      }
+      imageCache->Insert(image.hash, embedding);
+    }
+    return embedding;
+  }
+
+  // Keeps the longest prefix of sequence 0 that matches `items` and returns
+  // its length. The last item is always re-evaluated to get fresh logits.
+  size_t ReuseKvPrefix(const std::vector<PromptItem>& items) {
+    size_t nReused = 0;
+    int position = 0;
+    while (nReused < kvItems.size() && nReused + 1 < items.size()) {
+      const KvItem& cached = kvItems[nReused];
+      const PromptItem& item = items[nReused];
+      const bool matches =
+          item.image ? cached.isImage && cached.value == item.image->hash
+                     : !cached.isImage &&
+                           cached.value == static_cast<uint64_t>(item.token);
+      if (!matches) {
+        break;
+      }
+      position += cached.nPositions;
+      ++nReused;
+    }
+
+    llama_kv_cache_seq_rm(ctx.get(), 0, position, -1);
+    kvItems.resize(nReused);
+    kvPosition = position;
+    return nReused;
+  }
+
+  void EvaluatePrompt(const std::vector<PromptItem>& items, size_t first) {
+    const auto nBatch = static_cast<int32_t>(llama_n_batch(ctx.get()));
+    LlamaBatch batch(nBatch);
+
+    for (size_t i = first; i < items.size(); ++i) {
+      const PromptItem& item = items[i];
+      if (item.image) {
+        Decode(batch);
+
+        auto embedding = GetImageEmbedding(*item.image);
+        int nPast = kvPosition;
+        if (!VisionEncoder::Evaluate(ctx.get(), *embedding, nBatch, nPast)) {
+          ResetKvCache();
+          throw std::runtime_error("Failed to evaluate image embedding");
+        }
+        kvItems.push_back({true, item.image->hash, embedding->nPositions});
+        kvPosition = nPast;
+        continue;
+      }
+
+      llama_batch_add(
+          batch.batch, item.token, kvPosition, {0}, i + 1 == items.size()
+      );
+      kvItems.push_back({false, static_cast<uint64_t>(item.token), 1});
+      kvPosition += 1;
+
+      if (batch.batch.n_tokens == nBatch) {
+        Decode(batch);
+      }
+    }
+
+    Decode(batch);
+  }
+
+  void RunQueryStream(
+      const std::function<void(const GeneratedToken&)>& callback,
+      bool withLogprobs
+  ) {
+    std::vector<PromptSegment> segments;
+    BuildPrompt(segments);
+
+    const SamplingParams& params = samplingParams;
+
+    std::vector<PromptItem> items;
+    std::vector<llama_token> tokens;
+    for (const auto& segment : segments) {
+      if (segment.image) {
+        items.push_back({0, segment.image});
+        continue;
+      }
+      if (segment.tokens) {
+        for (auto token : *segment.tokens) {
+          items.push_back({token, nullptr});
+        }
+        continue;
+      }
+
+      tokens.clear();
+      vocabulary->Tokenize(segment.text, false, true, tokens);
+      for (auto token : tokens) {
+        items.push_back({token, nullptr});
+      }
+    }
+
+    GenerationStats stats;
+    auto start = std::chrono::steady_clock::now();
+
+    size_t promptPositions = 0;
+    for (const auto& item : items) {
+      promptPositions += item.image ? vision->PositionsPerImage() : 1;
+    }
+    EnsureContext(promptPositions + 1);
+
+    const size_t nReused = ReuseKvPrefix(items);
+    stats.reusedPromptTokens = kvPosition;
+    EvaluatePrompt(items, nReused);
+    stats.promptTokens = kvPosition;
+
+    auto promptEnd = std::chrono::steady_clock::now();
+    stats.promptSeconds =
+        std::chrono::duration<double>(promptEnd - start).count();
+    if (stats.promptTokens > stats.reusedPromptTokens) {
+      const double secondsPerToken =
+          stats.promptSeconds /
+          static_cast<double>(stats.promptTokens - stats.reusedPromptTokens);
+      prefillSecondsPerToken =
+          prefillSecondsPerToken == 0.0
+              ? secondsPerToken
+              : 0.8 * prefillSecondsPerToken + 0.2 * secondsPerToken;
+    }
 
-    size_t nCur = batch.n_tokens;
+    LlamaBatch batch(1);
+    DrySampler dry(params, *vocabulary);
+    EarlyStopping stopping(params);
+    TokenDistribution distribution;
     std::string assistantResponse;
 
-    std::string currentPiece;
-    while (nCur < params.maxTokens) {
-      auto new_token = SampleToken(params);
+    stats.stopReason = StopReason::MaxTokens;
+    while (stats.generatedTokens < params.maxTokens) {
+      auto newToken = SampleToken(params, dry, distribution);
 
-      if (new_token.tokenId == eotToken) break;
+      if (newToken.tokenId == eotToken) {
+        stats.stopReason = StopReason::EndOfText;
+        break;
+      }
+      if (stopping.IsClosed(distribution)) {
+        stats.stopReason = StopReason::Closure;
+        break;
+      }
+      dry.Accept(newToken.tokenId);
 
-      std::string piece = llama_token_to_piece(ctx.get(), new_token.tokenId);
-      currentPiece += piece;
+      GeneratedToken generated;
+      generated.token = newToken;
+      generated.piece = llama_token_to_piece(ctx.get(), newToken.tokenId);
+      if (withLogprobs) {
+        // Before penalties and truncation.
+        generated.logprob = LogProbability(
+            llama_get_logits(ctx.get()),
+            llama_n_vocab(model.get()),
+            newToken.tokenId
+        );
+      }
+      callback(generated);
 
-      callback(currentPiece);
-      assistantResponse += currentPiece;
-      currentPiece.clear();
+      const std::string& piece = generated.piece;
+      assistantResponse += piece;
+      ++stats.generatedTokens;
 
-      llama_batch_clear(batch);
-      llama_batch_add(batch, new_token.tokenId, nCur, {0}, true);
-      nCur += 1;
+      // Grown only after sampling: a new context has the sequence state but
+      // no logits until the next decode.
+      if (!EnsureContext(static_cast<size_t>(kvPosition) + 1)) {
+        stats.stopReason = StopReason::ContextFull;
+        break;
+      }
+      llama_batch_add(batch.batch, newToken.tokenId, kvPosition, {0}, true);
+      kvItems.push_back({false, static_cast<uint64_t>(newToken.tokenId), 1});
+      kvPosition += 1;
+      Decode(batch);
 
-      if (llama_decode(ctx.get(), batch) != 0) {
-        throw std::runtime_error("Failed to evaluate");
+      if (stopping.LostConfidence(distribution, piece)) {
+        stats.stopReason = StopReason::LowConfidence;
+        break;
       }
     }
 
-    llama_batch_free(batch);
+    if (stats.stopReason == StopReason::Closure ||
+        stats.stopReason == StopReason::LowConfidence) {
+      stats.tokensSaved = params.maxTokens - stats.generatedTokens;
+    }
+    stats.meanEntropy = stopping.MeanEntropy();
+    auto generationEnd = std::chrono::steady_clock::now();
+    stats.generationSeconds =
+        std::chrono::duration<double>(generationEnd - promptEnd).count();
+    lastGenerationStats = stats;
+
+    if (journal) {
+      journal->AppendMessage(journalSession, "assistant", assistantResponse);
+    }
     conversationHistory.push_back({"assistant", assistantResponse});
   }
 };
@@ -272,7 +1181,7 @@ bool LlamaChat::InitializeModel(
   try {
     return pimpl->InitializeModel(modelPath, params);
   } catch (const std::exception& e) {
-    std::cerr << "InitializeModel exception: " << e.what() << std::endl;
+    LogError("InitializeModel exception", {{"what", e.what()}});
     return false;
   }
 }
@@ -281,7 +1190,7 @@ bool LlamaChat::InitializeContext(const ContextParams& params) {
   try {
     return pimpl->InitializeContext(params);
   } catch (const std::exception& e) {
-    std::cerr << "InitializeContext exception: " << e.what() << std::endl;
+    LogError("InitializeContext exception", {{"what", e.what()}});
     return false;
   }
 }
@@ -290,16 +1199,183 @@ void LlamaChat::SetSystemPrompt(const std::string& systemPrompt) {
   pimpl->SetSystemPrompt(systemPrompt);
 }
 
+void LlamaChat::SetSamplingParams(const SamplingParams& params) {
+  pimpl->SetSamplingParams(params);
+}
+
 void LlamaChat::ResetConversation() { pimpl->ResetConversation(); }
 
+void LlamaChat::ClearHistory() { pimpl->ClearHistory(); }
+
 void LlamaChat::Prompt(
     const std::string& userMessage,
     const std::function<void(const std::string&)>& callback
 ) {
-  return pimpl->Prompt(userMessage, callback);
+  return pimpl->Prompt(userMessage, {}, callback);
+}
+
+void LlamaChat::Prompt(
+    const std::string& userMessage,
+    const std::vector<ImageInput>& images,
+    const std::function<void(const std::string&)>& callback
+) {
+  return pimpl->Prompt(userMessage, images, callback);
+}
+
+void LlamaChat::PromptTokens(
+    const std::string& userMessage,
+    const std::function<void(const GeneratedToken&)>& callback
+) {
+  pimpl->PromptTokens(userMessage, {}, callback, true);
+}
+
+void LlamaChat::PromptTokens(
+    TokenSpan userTokens,
+    const std::function<void(const GeneratedToken&)>& callback
+) {
+  pimpl->PromptTokens(userTokens, callback);
+}
+
+bool LlamaChat::InitializeVision(
+    const std::string& projectorPath, const VisionParams& params
+) {
+  try {
+    return pimpl->InitializeVision(projectorPath, params);
+  } catch (const std::exception& e) {
+    LogError("InitializeVision exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+ImageCacheStats LlamaChat::GetImageCacheStats() const {
+  return pimpl->GetImageCacheStats();
+}
+
+bool LlamaChat::LoadControlVector(
+    const std::string& name, const std::string& path
+) {
+  try {
+    return pimpl->LoadControlVector(name, path);
+  } catch (const std::exception& e) {
+    LogError("LoadControlVector exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+bool LlamaChat::InitializeContext(ContextPool& pool, size_t predictedTokens) {
+  try {
+    return pimpl->InitializeContext(pool.tiers, predictedTokens);
+  } catch (const std::exception& e) {
+    LogError("InitializeContext exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+bool LlamaChat::AttachJournal(
+    ConversationJournal& journal, const std::string& sessionId
+) {
+  try {
+    return pimpl->AttachJournal(journal.file, sessionId);
+  } catch (const std::exception& e) {
+    LogError("AttachJournal exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+bool LlamaChat::SetSteering(const SteeringParams& params) {
+  return pimpl->SetSteering(params);
+}
+
+bool LlamaChat::InitializeCompression(
+    const std::string& modelPath, const CompressionParams& params
+) {
+  try {
+    return pimpl->InitializeCompression(modelPath, params);
+  } catch (const std::exception& e) {
+    LogError("InitializeCompression exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+void LlamaChat::PromptWithContext(
+    const std::string& userMessage,
+    const std::vector<std::string>& contextBlocks,
+    const std::function<void(const std::string&)>& callback
+) {
+  pimpl->PromptWithContext(userMessage, contextBlocks, callback);
+}
+
+CompressionStats LlamaChat::GetLastCompressionStats() const {
+  return pimpl->GetLastCompressionStats();
+}
+
+bool LlamaChat::Suspend() {
+  try {
+    return pimpl->Suspend();
+  } catch (const std::exception& e) {
+    LogError("Suspend exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+bool LlamaChat::Resume() {
+  try {
+    return pimpl->Resume();
+  } catch (const std::exception& e) {
+    LogError("Resume exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+bool LlamaChat::IsSuspended() const { return pimpl->IsSuspended(); }
+
+bool LlamaChat::SaveCheckpoint(
+    const std::string& path, const CheckpointParams& params
+) {
+  try {
+    return pimpl->SaveCheckpoint(path, params);
+  } catch (const std::exception& e) {
+    LogError("SaveCheckpoint exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+bool LlamaChat::LoadCheckpoint(const std::string& path) {
+  try {
+    return pimpl->LoadCheckpoint(path);
+  } catch (const std::exception& e) {
+    LogError("LoadCheckpoint exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+CheckpointStats LlamaChat::GetCheckpointStats() const {
+  return pimpl->GetCheckpointStats();
+}
+
+MemoryUsage LlamaChat::GetMemoryUsage() const {
+  return pimpl->GetMemoryUsage();
+}
+
+ModelInfo LlamaChat::GetModelInfo() const { return pimpl->GetModelInfo(); }
+
+ContextStats LlamaChat::GetContextStats() const {
+  return pimpl->GetContextStats();
+}
+
+GenerationStats LlamaChat::GetLastGenerationStats() const {
+  return pimpl->GetLastGenerationStats();
 }
 
 std::vector<LlamaToken> LlamaChat::Encode(const std::string& text, bool addBos)
     const {
   return pimpl->Encode(text, addBos);
 }
+
+TokenEstimate LlamaChat::EstimateTokens(const std::string& text) const {
+  return pimpl->EstimateTokens(text);
+}
+
+TokenizerCacheStats LlamaChat::GetTokenizerCacheStats() const {
+  return pimpl->GetTokenizerCacheStats();
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <string>
@@ -7,22 +8,149 @@
 
 typedef int llama_token;
 
+class ContextPool;
+class ConversationJournal;
+
 struct LlamaToken {
   llama_token tokenId;
   explicit LlamaToken(llama_token id = 0) : tokenId(id) {}
 };
 
+// Tokens owned elsewhere, e.g. a record of a TokenCorpus.
+struct TokenSpan {
+  const llama_token* data = nullptr;
+  size_t size = 0;
+
+  [[nodiscard]] const llama_token* begin() const { return data; }
+  [[nodiscard]] const llama_token* end() const { return data + size; }
+  [[nodiscard]] bool empty() const { return size == 0; }
+};
+
 struct ModelParams {
   int nGpuLayers = 0;
   bool vocabularyOnly = false;
   bool useMemoryMapping = true;
   bool useModelLock = false;
+  bool useNativeTokenizer = true;
+  size_t tokenizerCacheSize = 65536;
+};
+
+struct TokenizerCacheStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+  size_t entries = 0;
+
+  [[nodiscard]] double HitRate() const {
+    const size_t lookups = hits + misses;
+    return lookups ? static_cast<double>(hits) / lookups : 0.0;
+  }
+};
+
+struct TokenEstimate {
+  size_t estimate = 0;
+  size_t upperBound = 0;
+};
+
+// An encoded image file (JPEG, PNG, BMP, ...) attached to a user message.
+struct ImageInput {
+  std::vector<uint8_t> data;
+};
+
+struct VisionParams {
+  size_t imageCacheBytes = 256 * 1024 * 1024;
+  int nThreads = 4;
+};
+
+struct ImageCacheStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+  size_t entries = 0;
+  size_t bytes = 0;
+};
+
+struct CompressionParams {
+  // Share of context block tokens to keep.
+  float targetRatio = 0.5f;
+  // Blocks shorter than this are passed through unchanged.
+  size_t minBlockTokens = 64;
+  int nGpuLayers = 0;
+  size_t nContext = 2048;
+  int nBatch = 512;
+  int nThreads = 4;
+};
+
+struct CompressionStats {
+  size_t originalTokens = 0;
+  size_t compressedTokens = 0;
+  double compressionSeconds = 0.0;
+  // Estimated from the prefill rate measured on previous prompts.
+  double prefillSecondsSaved = 0.0;
+
+  [[nodiscard]] double Ratio() const {
+    return originalTokens == 0 ? 1.0
+                               : static_cast<double>(compressedTokens) /
+                                     static_cast<double>(originalTokens);
+  }
+};
+
+struct SteeringVector {
+  std::string name;  // As passed to LoadControlVector
+  float scale = 1.0f;
+};
+
+struct SteeringParams {
+  std::vector<SteeringVector> vectors;
+  // Layers the combined vector is added to; -1 means the last layer.
+  int layerStart = 1;
+  int layerEnd = -1;
 };
 
 struct ContextParams {
   size_t nContext = 4096;
   int nThreads = 6;
   int nBatch = 512;
+  // When nonzero, the context starts at this size, doubles up to nContext as
+  // the conversation grows and returns to it on ResetConversation().
+  size_t nContextInitial = 0;
+};
+
+struct ModelInfo {
+  std::string description;  // Architecture, size and quantization
+  size_t sizeBytes = 0;     // Weights
+  uint64_t parameters = 0;
+  // Identifies the vocabulary, e.g. to check a TokenCorpus against it.
+  uint64_t vocabularyFingerprint = 0;
+};
+
+struct MemoryUsage {
+  size_t kvBytes = 0;    // KV cache cells holding the conversation
+  size_t hostBytes = 0;  // History, images and suspended state
+};
+
+struct ContextStats {
+  size_t nContext = 0;
+  size_t peakContext = 0;
+  size_t grows = 0;
+  size_t shrinks = 0;
+  size_t migratedBytes = 0;
+  double migrationSeconds = 0.0;
+};
+
+struct CheckpointParams {
+  // The file is rewritten as a single full state once the incremental
+  // records appended since the last rewrite outgrow it by this factor.
+  float compactionRatio = 1.0f;
+};
+
+struct CheckpointStats {
+  size_t checkpoints = 0;  // Saves that wrote anything
+  size_t compactions = 0;  // Saves that rewrote the full state
+  size_t bytesWritten = 0;
+  size_t lastBytesWritten = 0;
+  size_t fileBytes = 0;
+  double saveSeconds = 0.0;
 };
 
 struct SamplingParams {
@@ -34,6 +162,48 @@ struct SamplingParams {
   float frequencyPenalty = 1.0f;
   float presencePenalty = 0.0f;
   std::vector<LlamaToken> repeatPenaltyTokens;
+
+  // Sequence repetition ("DRY") penalty; disabled while dryMultiplier is 0.
+  float dryMultiplier = 0.0f;
+  float dryBase = 1.75f;
+  size_t dryAllowedLength = 2;
+  size_t dryMaxLength = 0;
+  std::vector<std::string> drySequenceBreakers = {"\n", ":", "\"", "*"};
+
+  // Entropy-scaled temperature; disabled while dynamicTemperatureRange is 0.
+  float dynamicTemperatureRange = 0.0f;
+  float dynamicTemperatureExponent = 1.0f;
+
+  // Early stopping; each criterion is disabled while its threshold is 0.
+  size_t stopMinTokens = 16;
+  float stopEndOfTextProbability = 0.0f;
+  float stopEntropyThreshold = 0.0f;
+  size_t stopEntropyWindow = 32;
+};
+
+enum class StopReason {
+  EndOfText,
+  MaxTokens,
+  ContextFull,
+  Closure,        // stopEndOfTextProbability was reached
+  LowConfidence,  // stopEntropyThreshold was exceeded
+};
+
+struct GenerationStats {
+  size_t promptTokens = 0;
+  size_t reusedPromptTokens = 0;  // Prompt positions kept in the KV cache
+  size_t generatedTokens = 0;
+  size_t tokensSaved = 0;  // Token budget left unused by an early stop
+  StopReason stopReason = StopReason::EndOfText;
+  float meanEntropy = 0.0f;
+  double promptSeconds = 0.0;
+  double generationSeconds = 0.0;
+};
+
+struct GeneratedToken {
+  LlamaToken token;
+  std::string piece;
+  float logprob = 0.0f;  // Under the model's distribution before sampling
 };
 
 class LlamaChat {
@@ -49,18 +219,93 @@ class LlamaChat {
 
   bool InitializeModel(const std::string& modelPath, const ModelParams& params);
   bool InitializeContext(const ContextParams& params);
+  // Leases the context from a pool and uses the pool's model instead of
+  // InitializeModel(). `predictedTokens` selects the starting tier.
+  bool InitializeContext(ContextPool& pool, size_t predictedTokens = 0);
+  bool InitializeVision(
+      const std::string& projectorPath, const VisionParams& params
+  );
+  bool InitializeCompression(
+      const std::string& modelPath, const CompressionParams& params
+  );
+  bool LoadControlVector(const std::string& name, const std::string& path);
+  bool SetSteering(const SteeringParams& params);
   void SetSystemPrompt(const std::string& systemPrompt);
+  void SetSamplingParams(const SamplingParams& params);
   void ResetConversation();
+  // Starts a new conversation but keeps the KV cache, so the next prompt
+  // reuses the part of it that matches, e.g. a shared document.
+  void ClearHistory();
+
+  // Records every change to the conversation in the journal under
+  // `sessionId`. A conversation recovered for that session replaces the
+  // current history, including a response a crash cut short; otherwise
+  // the current history is journaled. Set the system prompt before
+  // attaching: SetSystemPrompt() afterwards starts a new conversation.
+  bool AttachJournal(
+      ConversationJournal& journal, const std::string& sessionId
+  );
+
+  // Moves the KV state to host memory and releases the context. The next
+  // Prompt() resumes automatically.
+  bool Suspend();
+  bool Resume();
+  [[nodiscard]] bool IsSuspended() const;
+  [[nodiscard]] MemoryUsage GetMemoryUsage() const;
+  [[nodiscard]] ModelInfo GetModelInfo() const;
+
+  // Persists the conversation's KV state to `path`. Repeated saves to the
+  // same path append only the cells added since the previous save. The
+  // checkpoint must be loaded with the same model and steering.
+  bool SaveCheckpoint(
+      const std::string& path, const CheckpointParams& params = {}
+  );
+  // Restores the KV state saved at `path`, so a prompt over the same history
+  // (e.g. one restored by AttachJournal) skips re-evaluating it.
+  bool LoadCheckpoint(const std::string& path);
 
   void Prompt(
       const std::string& userMessage,
       const std::function<void(const std::string&)>& callback
   );
+  void Prompt(
+      const std::string& userMessage,
+      const std::vector<ImageInput>& images,
+      const std::function<void(const std::string&)>& callback
+  );
+  // Like Prompt(), but reports each generated token with its
+  // log-probability.
+  void PromptTokens(
+      const std::string& userMessage,
+      const std::function<void(const GeneratedToken&)>& callback
+  );
+  // Like PromptTokens(), but the user message is already tokenized with this
+  // model's vocabulary, so it is evaluated without tokenizing it.
+  void PromptTokens(
+      TokenSpan userTokens,
+      const std::function<void(const GeneratedToken&)>& callback
+  );
+  // Prepends retrieved context blocks to the user message, compressed when
+  // InitializeCompression() was called.
+  void PromptWithContext(
+      const std::string& userMessage,
+      const std::vector<std::string>& contextBlocks,
+      const std::function<void(const std::string&)>& callback
+  );
 
   [[nodiscard]] std::vector<LlamaToken> Encode(
       const std::string& text, bool addBos = true
   ) const;
 
+  [[nodiscard]] TokenEstimate EstimateTokens(const std::string& text) const;
+
+  [[nodiscard]] TokenizerCacheStats GetTokenizerCacheStats() const;
+  [[nodiscard]] ImageCacheStats GetImageCacheStats() const;
+  [[nodiscard]] GenerationStats GetLastGenerationStats() const;
+  [[nodiscard]] CompressionStats GetLastCompressionStats() const;
+  [[nodiscard]] ContextStats GetContextStats() const;
+  [[nodiscard]] CheckpointStats GetCheckpointStats() const;
+
  private:
   class Impl;
   std::unique_ptr<Impl> pimpl;
@@ -0,0 +1,196 @@
+#include "llama-context-pool.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "context-tiers.h"
+#include "logger.h"
+
+void ContextReleaser::operator()(llama_context* ctx) const {
+  if (tiers) {
+    tiers->Release(ctx);
+  } else {
+    llama_free(ctx);
+  }
+}
+
+ContextTiers::~ContextTiers() {
+  for (const auto& [ctx, tier] : owners) {
+    llama_free(ctx);
+  }
+}
+
+bool ContextTiers::Initialize(
+    const std::string& modelPath,
+    const ModelParams& modelParams,
+    const ContextPoolParams& poolParams
+) {
+  params = poolParams;
+  std::sort(
+      params.tiers.begin(),
+      params.tiers.end(),
+      [](const auto& a, const auto& b) { return a.nContext < b.nContext; }
+  );
+  if (params.tiers.empty()) {
+    LogError("ContextPool needs at least one tier");
+    return false;
+  }
+
+  llama_model_params llamaParams = llama_model_default_params();
+  llamaParams.n_gpu_layers = modelParams.nGpuLayers;
+  llamaParams.use_mmap = modelParams.useMemoryMapping;
+  llamaParams.use_mlock = modelParams.useModelLock;
+
+  model.reset(
+      llama_load_model_from_file(modelPath.c_str(), llamaParams),
+      llama_free_model
+  );
+  if (!model) {
+    LogError("Failed to load model", {{"path", modelPath}});
+    return false;
+  }
+
+  vocabulary = std::make_shared<Vocabulary>();
+  vocabulary->Initialize(model.get(), modelPath, modelParams);
+
+  tiers.resize(params.tiers.size());
+  for (size_t i = 0; i < tiers.size(); ++i) {
+    tiers[i].stats.nContext = params.tiers[i].nContext;
+    tiers[i].stats.capacity = params.tiers[i].maxContexts;
+  }
+
+  return true;
+}
+
+llama_context* ContextTiers::Create(size_t nContext) const {
+  llama_context_params ctxParams = llama_context_default_params();
+  ctxParams.n_ctx = nContext;
+  ctxParams.n_threads = params.nThreads;
+  ctxParams.n_batch = params.nBatch;
+  ctxParams.logits_all = false;
+  ctxParams.embeddings = false;
+
+  return llama_new_context_with_model(model.get(), ctxParams);
+}
+
+PooledContext ContextTiers::Acquire(size_t nPositions, bool promotion) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  Tier* fitting = nullptr;
+  for (size_t i = 0; i < tiers.size(); ++i) {
+    Tier& tier = tiers[i];
+    if (tier.stats.nContext < nPositions) {
+      continue;
+    }
+    if (!fitting) {
+      fitting = &tier;
+    }
+
+    llama_context* ctx = nullptr;
+    if (!tier.idle.empty()) {
+      ctx = tier.idle.back();
+      tier.idle.pop_back();
+    } else if (tier.stats.created < tier.stats.capacity) {
+      ctx = Create(tier.stats.nContext);
+      if (!ctx) {
+        LogWarning(
+            "Failed to create a pooled llama_context",
+            {{"nContext", std::to_string(tier.stats.nContext)}}
+        );
+        continue;
+      }
+      owners.emplace(ctx, i);
+      ++tier.stats.created;
+    } else {
+      continue;
+    }
+
+    if (fitting != &tier) {
+      ++fitting->stats.overflows;
+    }
+    if (promotion) {
+      ++tier.stats.promotions;
+    }
+    ++tier.stats.leases;
+    ++tier.stats.inUse;
+    tier.stats.peakInUse = std::max(tier.stats.peakInUse, tier.stats.inUse);
+    return PooledContext(ctx, ContextReleaser{shared_from_this()});
+  }
+
+  if (fitting) {
+    ++fitting->stats.rejections;
+  }
+  return PooledContext(nullptr, ContextReleaser{shared_from_this()});
+}
+
+void ContextTiers::Release(llama_context* ctx) {
+  const double used = llama_get_kv_cache_used_cells(ctx);
+
+  // The next session must not see this one's cache or steering.
+  llama_kv_cache_clear(ctx);
+  llama_control_vector_apply(ctx, nullptr, 0, llama_n_embd(model.get()), -1, -1);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  Tier& tier = tiers[owners.at(ctx)];
+  tier.utilizationSum += used / static_cast<double>(tier.stats.nContext);
+  ++tier.releases;
+  --tier.stats.inUse;
+  tier.idle.push_back(ctx);
+}
+
+size_t ContextTiers::MaxContext() const { return tiers.back().stats.nContext; }
+
+size_t ContextTiers::TierFor(size_t nPositions) const {
+  for (const auto& tier : tiers) {
+    if (tier.stats.nContext >= nPositions) {
+      return tier.stats.nContext;
+    }
+  }
+  return MaxContext();
+}
+
+std::vector<ContextTierStats> ContextTiers::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  std::vector<ContextTierStats> stats;
+  for (const auto& tier : tiers) {
+    stats.push_back(tier.stats);
+    if (tier.releases > 0) {
+      stats.back().meanUtilization =
+          tier.utilizationSum / static_cast<double>(tier.releases);
+    }
+  }
+  return stats;
+}
+
+ContextPool::ContextPool() {
+  InstallLlamaLogCallback();
+  llama_backend_init();
+}
+
+ContextPool::~ContextPool() {
+  tiers.reset();
+  llama_backend_free();
+}
+
+bool ContextPool::Initialize(
+    const std::string& modelPath,
+    const ModelParams& modelParams,
+    const ContextPoolParams& params
+) {
+  try {
+    auto candidate = std::make_shared<ContextTiers>();
+    if (!candidate->Initialize(modelPath, modelParams, params)) {
+      return false;
+    }
+    tiers = std::move(candidate);
+    return true;
+  } catch (const std::exception& e) {
+    LogError("ContextPool::Initialize exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+std::vector<ContextTierStats> ContextPool::GetStats() const {
+  return tiers ? tiers->GetStats() : std::vector<ContextTierStats>();
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llama-chat.h"
+
+class ContextTiers;
+
+struct ContextTier {
+  size_t nContext = 0;
+  size_t maxContexts = 0;
+};
+
+struct ContextPoolParams {
+  std::vector<ContextTier> tiers = {{1024, 16}, {8192, 4}, {32768, 1}};
+  int nThreads = 6;
+  int nBatch = 512;
+};
+
+struct ContextTierStats {
+  size_t nContext = 0;
+  size_t capacity = 0;
+  size_t created = 0;
+  size_t inUse = 0;
+  size_t peakInUse = 0;
+  size_t leases = 0;
+  size_t promotions = 0;  // Sessions moved here from a smaller tier
+  size_t overflows = 0;   // Sessions sent to a larger tier because it was full
+  size_t rejections = 0;  // Requests no tier could serve
+  // Mean share of a leased context's cells in use when it was returned.
+  double meanUtilization = 0.0;
+};
+
+// Contexts of a few fixed sizes sharing one loaded model. Each chat session
+// leases a context from the smallest tier that fits its predicted length and
+// is promoted to a larger tier, with its KV state, when it outgrows it.
+// Contexts are created on first use and reused after a session releases
+// them. Thread-safe.
+class ContextPool {
+ public:
+  ContextPool();
+  ~ContextPool();
+
+  ContextPool(const ContextPool&) = delete;
+  ContextPool& operator=(const ContextPool&) = delete;
+
+  bool Initialize(
+      const std::string& modelPath,
+      const ModelParams& modelParams,
+      const ContextPoolParams& params
+  );
+
+  [[nodiscard]] std::vector<ContextTierStats> GetStats() const;
+
+ private:
+  friend class LlamaChat;
+
+  std::shared_ptr<ContextTiers> tiers;
+};
@@ -0,0 +1,436 @@
+#include "llama-corpus.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "llama-tokenizer.h"
+#include "logger.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// File layout, little endian:
+//   header       magic, vocabulary fingerprint, records, tokens, ID bytes
+//   tokens       int32 per token, padded to 8 bytes
+//   token index  uint64 per record + 1: offset of its first token
+//   ID index     uint64 per record + 1: offset of its ID
+//   IDs          concatenated bytes
+// The magic is written last, so an unfinished file never opens.
+
+namespace {
+
+constexpr char kMagic[8] = {'L', 'C', 'T', 'O', 'K', 'C', '0', '1'};
+constexpr size_t kHeaderSize = 64;
+
+struct Header {
+  char magic[8];
+  uint64_t fingerprint;
+  uint64_t records;
+  uint64_t tokens;
+  uint64_t idBytes;
+  uint64_t reserved[3];
+};
+static_assert(sizeof(Header) == kHeaderSize);
+
+size_t Pad8(size_t size) { return (size + 7) & ~size_t(7); }
+
+size_t FileSize(const Header& header) {
+  return kHeaderSize + Pad8(header.tokens * sizeof(llama_token)) +
+         2 * (header.records + 1) * sizeof(uint64_t) + header.idBytes;
+}
+
+}  // namespace
+
+class TokenCorpus::Impl {
+ public:
+  ~Impl() { Close(); }
+
+  bool Open(const std::string& path) {
+    Close();
+    if (!Map(path)) {
+      return false;
+    }
+
+    if (size < kHeaderSize) {
+      LogError("Not a token corpus", {{"path", path}});
+      Close();
+      return false;
+    }
+    std::memcpy(&header, base, kHeaderSize);
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.records > size || header.tokens > size ||
+        header.idBytes > size || FileSize(header) != size) {
+      LogError("Not a token corpus", {{"path", path}});
+      Close();
+      return false;
+    }
+
+    tokens = reinterpret_cast<const llama_token*>(base + kHeaderSize);
+    tokenIndex = reinterpret_cast<const uint64_t*>(
+        base + kHeaderSize + Pad8(header.tokens * sizeof(llama_token))
+    );
+    idIndex = tokenIndex + header.records + 1;
+    ids = reinterpret_cast<const char*>(idIndex + header.records + 1);
+
+    // Checked once here, so lookups need no bounds checks.
+    for (uint64_t i = 0; i < header.records; ++i) {
+      if (tokenIndex[i] > tokenIndex[i + 1] || idIndex[i] > idIndex[i + 1]) {
+        LogError("Corrupt token corpus index", {{"path", path}});
+        Close();
+        return false;
+      }
+    }
+    if (tokenIndex[header.records] != header.tokens ||
+        idIndex[header.records] != header.idBytes) {
+      LogError("Corrupt token corpus index", {{"path", path}});
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  void Close() {
+#ifndef _WIN32
+    if (base) {
+      munmap(const_cast<uint8_t*>(base), size);
+    }
+#endif
+    buffer.clear();
+    buffer.shrink_to_fit();
+    base = nullptr;
+    size = 0;
+    header = Header();
+  }
+
+  [[nodiscard]] size_t Size() const { return header.records; }
+  [[nodiscard]] size_t TotalTokens() const { return header.tokens; }
+  [[nodiscard]] uint64_t GetVocabularyFingerprint() const {
+    return header.fingerprint;
+  }
+
+  [[nodiscard]] std::string_view Id(size_t index) const {
+    return {ids + idIndex[index], idIndex[index + 1] - idIndex[index]};
+  }
+
+  [[nodiscard]] TokenSpan Tokens(size_t index) const {
+    return {
+        tokens + tokenIndex[index], tokenIndex[index + 1] - tokenIndex[index]
+    };
+  }
+
+ private:
+  const uint8_t* base = nullptr;
+  size_t size = 0;
+  std::vector<uint8_t> buffer;  // Holds the file where it is not mapped
+  Header header{};
+
+  const llama_token* tokens = nullptr;
+  const uint64_t* tokenIndex = nullptr;
+  const uint64_t* idIndex = nullptr;
+  const char* ids = nullptr;
+
+#ifdef _WIN32
+  bool Map(const std::string& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+      LogError("Failed to open token corpus", {{"path", path}});
+      return false;
+    }
+    buffer.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char*>(buffer.data()), buffer.size())) {
+      LogError("Failed to read token corpus", {{"path", path}});
+      return false;
+    }
+    size = buffer.size();
+    base = buffer.data();
+    return true;
+  }
+#else
+  bool Map(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      LogError("Failed to open token corpus", {{"path", path}});
+      return false;
+    }
+
+    struct stat status {};
+    if (fstat(fd, &status) != 0 || status.st_size == 0) {
+      LogError("Failed to open token corpus", {{"path", path}});
+      close(fd);
+      return false;
+    }
+
+    const auto bytes = static_cast<size_t>(status.st_size);
+    void* mapping = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      LogError("Failed to map token corpus", {{"path", path}});
+      return false;
+    }
+
+    base = static_cast<const uint8_t*>(mapping);
+    size = bytes;
+    return true;
+  }
+#endif
+};
+
+TokenCorpus::TokenCorpus() : pimpl(std::make_unique<Impl>()) {}
+TokenCorpus::~TokenCorpus() = default;
+
+bool TokenCorpus::Open(const std::string& path) {
+  try {
+    return pimpl->Open(path);
+  } catch (const std::exception& e) {
+    LogError("Open exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+void TokenCorpus::Close() { pimpl->Close(); }
+
+size_t TokenCorpus::Size() const { return pimpl->Size(); }
+
+size_t TokenCorpus::TotalTokens() const { return pimpl->TotalTokens(); }
+
+uint64_t TokenCorpus::GetVocabularyFingerprint() const {
+  return pimpl->GetVocabularyFingerprint();
+}
+
+std::string_view TokenCorpus::Id(size_t index) const {
+  return pimpl->Id(index);
+}
+
+TokenSpan TokenCorpus::Tokens(size_t index) const {
+  return pimpl->Tokens(index);
+}
+
+class TokenCorpusWriter::Impl {
+ public:
+  explicit Impl(const LlamaTokenizer& tokenizer) : tokenizer(tokenizer) {}
+
+  ~Impl() {
+    if (file.is_open()) {
+      file.close();
+      std::error_code error;
+      std::filesystem::remove(temporary, error);
+    }
+  }
+
+  bool Open(const std::string& corpusPath, const CorpusParams& corpusParams) {
+    params = corpusParams;
+    params.nThreads = std::max(params.nThreads, 1);
+    path = corpusPath;
+    temporary = path + ".tmp";
+    stats = CorpusStats();
+    tokenIndex.assign(1, 0);
+    idIndex.assign(1, 0);
+    ids.clear();
+
+    file.open(temporary, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      LogError("Failed to create token corpus", {{"path", temporary}});
+      return false;
+    }
+
+    // Zeroed until Close(), so the file is not a corpus before then.
+    const char header[kHeaderSize] = {};
+    file.write(header, kHeaderSize);
+    stats.bytesWritten = kHeaderSize;
+    return Check();
+  }
+
+  bool Add(const std::vector<CorpusRecord>& records) {
+    if (!file.is_open()) {
+      throw std::runtime_error("TokenCorpusWriter is not open");
+    }
+
+    if (records.empty()) {
+      return true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // Records are handed out one at a time, so long texts do not leave
+    // threads idle behind a fixed split.
+    std::vector<std::vector<LlamaToken>> encoded(records.size());
+    std::atomic<size_t> next{0};
+    std::exception_ptr failure;
+    std::mutex failureMutex;
+    auto work = [&] {
+      try {
+        for (size_t i = next++; i < records.size(); i = next++) {
+          encoded[i] = tokenizer.Encode(records[i].text, false, false);
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(failureMutex);
+        failure = std::current_exception();
+        next = records.size();
+      }
+    };
+    const size_t nWorkers =
+        std::min<size_t>(params.nThreads, records.size()) - 1;
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < nWorkers; ++i) {
+      workers.emplace_back(work);
+    }
+    work();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    if (failure) {
+      std::rethrow_exception(failure);
+    }
+
+    auto tokenized = std::chrono::steady_clock::now();
+    stats.tokenizeSeconds +=
+        std::chrono::duration<double>(tokenized - start).count();
+
+    const size_t previousTokens = stats.tokens;
+    std::vector<llama_token> flat;
+    for (size_t i = 0; i < records.size(); ++i) {
+      flat.clear();
+      for (const auto& token : encoded[i]) {
+        flat.push_back(token.tokenId);
+      }
+      file.write(
+          reinterpret_cast<const char*>(flat.data()),
+          static_cast<std::streamsize>(flat.size() * sizeof(llama_token))
+      );
+
+      stats.tokens += flat.size();
+      ++stats.records;
+      tokenIndex.push_back(stats.tokens);
+      ids += records[i].id;
+      idIndex.push_back(ids.size());
+    }
+    stats.bytesWritten += (stats.tokens - previousTokens) * sizeof(llama_token);
+
+    auto end = std::chrono::steady_clock::now();
+    stats.seconds += std::chrono::duration<double>(end - start).count();
+    return Check();
+  }
+
+  bool Close() {
+    if (!file.is_open()) {
+      return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    const size_t tokenBytes = stats.tokens * sizeof(llama_token);
+    const char padding[8] = {};
+    file.write(
+        padding, static_cast<std::streamsize>(Pad8(tokenBytes) - tokenBytes)
+    );
+    WriteIndex(tokenIndex);
+    WriteIndex(idIndex);
+    file.write(ids.data(), static_cast<std::streamsize>(ids.size()));
+
+    Header header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.fingerprint = tokenizer.GetVocabularyFingerprint();
+    header.records = stats.records;
+    header.tokens = stats.tokens;
+    header.idBytes = ids.size();
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(&header), kHeaderSize);
+    stats.bytesWritten = FileSize(header);
+
+    file.close();
+    if (file.fail()) {
+      LogError("Failed to write token corpus", {{"path", temporary}});
+      return false;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+      LogError(
+          "Failed to move token corpus into place",
+          {{"path", path}, {"error", error.message()}}
+      );
+      return false;
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    stats.seconds += std::chrono::duration<double>(end - start).count();
+    return true;
+  }
+
+  [[nodiscard]] CorpusStats GetStats() const { return stats; }
+
+ private:
+  const LlamaTokenizer& tokenizer;
+  CorpusParams params;
+  CorpusStats stats;
+  std::string path;
+  std::string temporary;
+  std::ofstream file;
+
+  std::vector<uint64_t> tokenIndex;
+  std::vector<uint64_t> idIndex;
+  std::string ids;
+
+  void WriteIndex(const std::vector<uint64_t>& index) {
+    file.write(
+        reinterpret_cast<const char*>(index.data()),
+        static_cast<std::streamsize>(index.size() * sizeof(uint64_t))
+    );
+  }
+
+  bool Check() {
+    if (!file) {
+      LogError("Failed to write token corpus", {{"path", temporary}});
+      return false;
+    }
+    return true;
+  }
+};
+
+TokenCorpusWriter::TokenCorpusWriter(const LlamaTokenizer& tokenizer)
+    : pimpl(std::make_unique<Impl>(tokenizer)) {}
+TokenCorpusWriter::~TokenCorpusWriter() = default;
+
+bool TokenCorpusWriter::Open(
+    const std::string& path, const CorpusParams& params
+) {
+  try {
+    return pimpl->Open(path, params);
+  } catch (const std::exception& e) {
+    LogError("Open exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+bool TokenCorpusWriter::Add(const std::vector<CorpusRecord>& records) {
+  try {
+    return pimpl->Add(records);
+  } catch (const std::exception& e) {
+    LogError("Add exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+bool TokenCorpusWriter::Close() {
+  try {
+    return pimpl->Close();
+  } catch (const std::exception& e) {
+    LogError("Close exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+CorpusStats TokenCorpusWriter::GetStats() const { return pimpl->GetStats(); }
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "llama-chat.h"
+
+class LlamaTokenizer;
+
+struct CorpusRecord {
+  std::string id;
+  std::string text;
+};
+
+struct CorpusParams {
+  int nThreads = 4;  // Records tokenized in parallel
+};
+
+struct CorpusStats {
+  size_t records = 0;
+  size_t tokens = 0;
+  size_t bytesWritten = 0;
+  double tokenizeSeconds = 0.0;  // Wall time of the parallel tokenization
+  double seconds = 0.0;
+
+  [[nodiscard]] double TokensPerSecond() const {
+    return seconds > 0.0 ? static_cast<double>(tokens) / seconds : 0.0;
+  }
+};
+
+// Pre-tokenized records of a text corpus in one file: a flat token array,
+// the token offset of every record and the record IDs. Opening maps the
+// file, so records are read in place without tokenizing or copying them;
+// on Windows the file is read into memory instead.
+//
+// Tokens belong to the vocabulary the corpus was written with; compare
+// GetVocabularyFingerprint() with the model's before using them.
+class TokenCorpus {
+ public:
+  TokenCorpus();
+  ~TokenCorpus();
+
+  TokenCorpus(const TokenCorpus&) = delete;
+  TokenCorpus& operator=(const TokenCorpus&) = delete;
+
+  bool Open(const std::string& path);
+  void Close();
+
+  [[nodiscard]] size_t Size() const;
+  [[nodiscard]] size_t TotalTokens() const;
+  [[nodiscard]] uint64_t GetVocabularyFingerprint() const;
+
+  // `index` must be below Size(). The views stay valid until Close().
+  [[nodiscard]] std::string_view Id(size_t index) const;
+  [[nodiscard]] TokenSpan Tokens(size_t index) const;
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> pimpl;
+};
+
+// Builds a TokenCorpus file. Each Add() tokenizes its records on
+// CorpusParams::nThreads threads and appends them in order; Close() writes
+// the index and moves the file into place, so an interrupted run never
+// leaves a partial corpus at `path`. Texts are tokenized without BOS and
+// without parsing special tokens, so control tokens in the data stay text.
+class TokenCorpusWriter {
+ public:
+  explicit TokenCorpusWriter(const LlamaTokenizer& tokenizer);
+  ~TokenCorpusWriter();
+
+  TokenCorpusWriter(const TokenCorpusWriter&) = delete;
+  TokenCorpusWriter& operator=(const TokenCorpusWriter&) = delete;
+
+  bool Open(const std::string& path, const CorpusParams& params = {});
+  bool Add(const std::vector<CorpusRecord>& records);
+  bool Close();
+
+  [[nodiscard]] CorpusStats GetStats() const;
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> pimpl;
+};
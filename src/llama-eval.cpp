@@ -0,0 +1,437 @@
+#include "llama-eval.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include "common.h"
+#include "eval-context.h"
+#include "generation-control.h"
+#include "llama.h"
+#include "logger.h"
+#include "vocabulary.h"
+
+class ChoiceScorer::Impl {
+ public:
+  bool Initialize(
+      const std::string& modelPath,
+      const ModelParams& modelParams,
+      const ScorerParams& scorerParams
+  ) {
+    params = scorerParams;
+    params.maxChoices = std::max(params.maxChoices, 1);
+    return eval.Initialize(
+        modelPath,
+        modelParams,
+        params.nContext,
+        params.nBatch,
+        params.nThreads,
+        params.maxChoices + 1
+    );
+  }
+
+  bool Score(
+      const std::string& prefix,
+      const std::vector<std::string>& choices,
+      std::vector<ChoiceScore>& scores
+  ) {
+    if (!eval.ctx) {
+      throw std::runtime_error("ChoiceScorer is not initialized");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    scores.assign(choices.size(), ChoiceScore());
+
+    // Tokens at the boundary can merge with the choice, so the shared prefix
+    // is what all tokenizations of prefix + choice have in common.
+    std::vector<llama_token> prefixTokens;
+    const bool addBos = !params.parseSpecial;
+    eval.vocabulary.Tokenize(
+        prefix, addBos, params.parseSpecial, prefixTokens
+    );
+    std::vector<std::vector<llama_token>> tokens(choices.size());
+    size_t shared = prefixTokens.size();
+    for (size_t i = 0; i < choices.size(); ++i) {
+      eval.vocabulary.Tokenize(
+          prefix + choices[i], addBos, params.parseSpecial, tokens[i]
+      );
+      const auto mismatch = std::mismatch(
+          prefixTokens.begin(),
+          prefixTokens.begin() + std::min(shared, tokens[i].size()),
+          tokens[i].begin()
+      );
+      shared = mismatch.first - prefixTokens.begin();
+    }
+    if (shared == 0) {
+      LogError("Choices share no prefix to score them against");
+      return false;
+    }
+
+    // The cache holds the prefix once plus the tails of one group of choices.
+    const auto group = static_cast<size_t>(params.maxChoices);
+    size_t cells = 0;
+    for (size_t first = 0; first < choices.size(); first += group) {
+      size_t groupCells = shared;
+      for (size_t i = first; i < std::min(choices.size(), first + group); ++i) {
+        groupCells += std::max(tokens[i].size(), shared + 1) - shared - 1;
+      }
+      cells = std::max(cells, groupCells);
+    }
+    if (cells > llama_n_ctx(eval.ctx)) {
+      LogError(
+          "Question does not fit the context",
+          {{"cells", std::to_string(cells)}}
+      );
+      return false;
+    }
+
+    llama_kv_cache_clear(eval.ctx);
+    const float* lastLogits = DecodePrefix(prefixTokens, shared);
+    const int nVocabulary = llama_n_vocab(eval.model);
+    for (size_t i = 0; i < choices.size(); ++i) {
+      if (tokens[i].size() > shared) {
+        scores[i].logprob =
+            LogProbability(lastLogits, nVocabulary, tokens[i][shared]);
+        scores[i].nTokens = 1;
+      } else {
+        // Nothing of the choice is left to score, which must not make it
+        // the most likely one.
+        LogWarning(
+            "Choice adds no tokens to the prefix",
+            {{"choice", std::to_string(i)}}
+        );
+        scores[i].logprob = -std::numeric_limits<float>::infinity();
+      }
+    }
+
+    for (size_t first = 0; first < choices.size(); first += group) {
+      const size_t last = std::min(choices.size(), first + group);
+      ScoreGroup(tokens, shared, first, last, scores);
+    }
+
+    ++stats.questions;
+    stats.choices += choices.size();
+    stats.sharedTokens += shared * (choices.size() - 1);
+    auto end = std::chrono::steady_clock::now();
+    stats.seconds += std::chrono::duration<double>(end - start).count();
+    return true;
+  }
+
+  [[nodiscard]] ScorerStats GetStats() const { return stats; }
+
+ private:
+  EvalContext eval;
+  ScorerParams params;
+  ScorerStats stats;
+
+  void Decode() {
+    eval.Decode();
+    stats.evaluatedTokens += eval.batch.n_tokens;
+    ++stats.decodes;
+  }
+
+  // Evaluates the shared prefix into sequence 0 and returns the logits that
+  // predict the first token after it.
+  const float* DecodePrefix(
+      const std::vector<llama_token>& tokens, size_t shared
+  ) {
+    for (size_t chunk = 0; chunk < shared; chunk += params.nBatch) {
+      const size_t chunkEnd = std::min(shared, chunk + params.nBatch);
+      llama_batch_clear(eval.batch);
+      for (size_t i = chunk; i < chunkEnd; ++i) {
+        llama_batch_add(
+            eval.batch,
+            tokens[i],
+            static_cast<llama_pos>(i),
+            {0},
+            i + 1 == shared
+        );
+      }
+      Decode();
+    }
+    return llama_get_logits_ith(eval.ctx, eval.batch.n_tokens - 1);
+  }
+
+  // Decodes the choices [first, last) in sequences 1.. on top of the shared
+  // prefix. The logits of each token score the token after it; the last
+  // token of a choice predicts nothing and is not decoded.
+  void ScoreGroup(
+      const std::vector<std::vector<llama_token>>& tokens,
+      size_t shared,
+      size_t first,
+      size_t last,
+      std::vector<ChoiceScore>& scores
+  ) {
+    const int nVocabulary = llama_n_vocab(eval.model);
+    for (size_t i = first; i < last; ++i) {
+      llama_kv_cache_seq_cp(eval.ctx, 0, SequenceOf(i, first), -1, -1);
+    }
+
+    struct Pending {
+      size_t choice;
+      size_t next;  // Index of the token the logits score
+    };
+    std::vector<Pending> pending;
+
+    auto flush = [&] {
+      if (eval.batch.n_tokens == 0) {
+        return;
+      }
+      Decode();
+      for (int32_t b = 0; b < eval.batch.n_tokens; ++b) {
+        const Pending& item = pending[b];
+        scores[item.choice].logprob += LogProbability(
+            llama_get_logits_ith(eval.ctx, b),
+            nVocabulary,
+            tokens[item.choice][item.next]
+        );
+        ++scores[item.choice].nTokens;
+      }
+      llama_batch_clear(eval.batch);
+      pending.clear();
+    };
+
+    llama_batch_clear(eval.batch);
+    for (size_t i = first; i < last; ++i) {
+      const llama_seq_id sequence = SequenceOf(i, first);
+      for (size_t t = shared; t + 1 < tokens[i].size(); ++t) {
+        llama_batch_add(
+            eval.batch,
+            tokens[i][t],
+            static_cast<llama_pos>(t),
+            {sequence},
+            true
+        );
+        pending.push_back({i, t + 1});
+        if (eval.batch.n_tokens == params.nBatch) {
+          flush();
+        }
+      }
+    }
+    flush();
+
+    for (size_t i = first; i < last; ++i) {
+      llama_kv_cache_seq_rm(eval.ctx, SequenceOf(i, first), -1, -1);
+    }
+  }
+
+  static llama_seq_id SequenceOf(size_t choice, size_t first) {
+    return static_cast<llama_seq_id>(choice - first + 1);
+  }
+};
+
+ChoiceScorer::ChoiceScorer() : pimpl(std::make_unique<Impl>()) {}
+ChoiceScorer::~ChoiceScorer() = default;
+
+bool ChoiceScorer::Initialize(
+    const std::string& modelPath,
+    const ModelParams& modelParams,
+    const ScorerParams& params
+) {
+  try {
+    return pimpl->Initialize(modelPath, modelParams, params);
+  } catch (const std::exception& e) {
+    LogError("Initialize exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+bool ChoiceScorer::Score(
+    const std::string& prefix,
+    const std::vector<std::string>& choices,
+    std::vector<ChoiceScore>& scores
+) {
+  try {
+    return pimpl->Score(prefix, choices, scores);
+  } catch (const std::exception& e) {
+    LogError("Score exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+ScorerStats ChoiceScorer::GetStats() const { return pimpl->GetStats(); }
+
+class PerplexityEvaluator::Impl {
+ public:
+  bool Initialize(
+      const std::string& modelPath,
+      const ModelParams& modelParams,
+      const PerplexityParams& perplexityParams
+  ) {
+    params = perplexityParams;
+    params.parallelWindows = std::max(params.parallelWindows, 1);
+    if (params.window < 2 || params.stride == 0 ||
+        params.stride > params.window) {
+      LogError(
+          "Invalid perplexity window",
+          {{"window", std::to_string(params.window)},
+           {"stride", std::to_string(params.stride)}}
+      );
+      return false;
+    }
+
+    const size_t nContext = params.window * params.parallelWindows;
+    params.nBatch = static_cast<int>(
+        std::min<size_t>(std::max(params.nBatch, 1), nContext)
+    );
+    if (!eval.Initialize(
+            modelPath,
+            modelParams,
+            nContext,
+            params.nBatch,
+            params.nThreads,
+            params.parallelWindows
+        )) {
+      return false;
+    }
+    addBos = llama_add_bos_token(eval.model) > 0;
+    return true;
+  }
+
+  bool Evaluate(
+      const std::string& text,
+      PerplexityResult& result,
+      const std::function<void(const PerplexityResult&)>& progress
+  ) {
+    if (!eval.ctx) {
+      throw std::runtime_error("PerplexityEvaluator is not initialized");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    result = PerplexityResult();
+
+    std::vector<llama_token> tokens;
+    eval.vocabulary.Tokenize(text, false, false, tokens);
+    if (tokens.size() < params.window) {
+      LogError(
+          "Text is shorter than one window",
+          {{"tokens", std::to_string(tokens.size())},
+           {"window", std::to_string(params.window)}}
+      );
+      return false;
+    }
+
+    // Only whole windows are evaluated; tokens past the last one are not
+    // scored.
+    std::vector<size_t> starts;
+    for (size_t s = 0; s + params.window <= tokens.size(); s += params.stride) {
+      starts.push_back(s);
+    }
+
+    const auto group = static_cast<size_t>(params.parallelWindows);
+    for (size_t first = 0; first < starts.size(); first += group) {
+      const size_t last = std::min(starts.size(), first + group);
+      EvaluateGroup(tokens, starts, first, last, result);
+
+      result.windows = last;
+      result.perplexity = std::exp(
+          result.negativeLogLikelihood /
+          static_cast<double>(std::max<size_t>(result.scoredTokens, 1))
+      );
+      auto now = std::chrono::steady_clock::now();
+      result.seconds = std::chrono::duration<double>(now - start).count();
+      if (progress) {
+        progress(result);
+      }
+    }
+    return true;
+  }
+
+ private:
+  EvalContext eval;
+  PerplexityParams params;
+  bool addBos = false;
+
+  // Decodes the windows [first, last) together, window i - first in sequence
+  // i - first. Position p of a window only computes logits when they score
+  // the token at p + 1.
+  void EvaluateGroup(
+      const std::vector<llama_token>& tokens,
+      const std::vector<size_t>& starts,
+      size_t first,
+      size_t last,
+      PerplexityResult& result
+  ) {
+    const int nVocabulary = llama_n_vocab(eval.model);
+    llama_kv_cache_clear(eval.ctx);
+
+    std::vector<llama_token> scored;  // Token scored by each output
+    auto flush = [&] {
+      if (eval.batch.n_tokens == 0) {
+        return;
+      }
+      eval.Decode();
+      result.evaluatedTokens += eval.batch.n_tokens;
+      int32_t output = 0;
+      for (int32_t b = 0; b < eval.batch.n_tokens; ++b) {
+        if (!eval.batch.logits[b]) {
+          continue;
+        }
+        result.negativeLogLikelihood -= LogProbability(
+            llama_get_logits_ith(eval.ctx, b), nVocabulary, scored[output++]
+        );
+      }
+      result.scoredTokens += scored.size();
+      llama_batch_clear(eval.batch);
+      scored.clear();
+    };
+
+    llama_batch_clear(eval.batch);
+    for (size_t w = first; w < last; ++w) {
+      const auto sequence = static_cast<llama_seq_id>(w - first);
+      const llama_token* window = tokens.data() + starts[w];
+      // Tokens before `scoreFrom` were scored by the previous window and
+      // only serve as context here.
+      const size_t scoreFrom =
+          w == 0 ? 1 : std::max<size_t>(params.window - params.stride, 1);
+
+      for (size_t p = 0; p < params.window; ++p) {
+        const bool output = p + 1 >= scoreFrom && p + 1 < params.window;
+        const llama_token token = p == 0 && addBos
+                                      ? llama_token_bos(eval.model)
+                                      : window[p];
+        llama_batch_add(
+            eval.batch, token, static_cast<llama_pos>(p), {sequence}, output
+        );
+        if (output) {
+          scored.push_back(window[p + 1]);
+        }
+        if (eval.batch.n_tokens == params.nBatch) {
+          flush();
+        }
+      }
+    }
+    flush();
+  }
+};
+
+PerplexityEvaluator::PerplexityEvaluator() : pimpl(std::make_unique<Impl>()) {}
+PerplexityEvaluator::~PerplexityEvaluator() = default;
+
+bool PerplexityEvaluator::Initialize(
+    const std::string& modelPath,
+    const ModelParams& modelParams,
+    const PerplexityParams& params
+) {
+  try {
+    return pimpl->Initialize(modelPath, modelParams, params);
+  } catch (const std::exception& e) {
+    LogError("Initialize exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+bool PerplexityEvaluator::Evaluate(
+    const std::string& text,
+    PerplexityResult& result,
+    const std::function<void(const PerplexityResult&)>& progress
+) {
+  try {
+    return pimpl->Evaluate(text, result, progress);
+  } catch (const std::exception& e) {
+    LogError("Evaluate exception", {{"what", e.what()}});
+    return false;
+  }
+}
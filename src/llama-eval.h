@@ -0,0 +1,131 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llama-chat.h"
+
+struct ScorerParams {
+  size_t nContext = 4096;
+  int nBatch = 512;
+  int nThreads = 6;
+  // Choices decoded in parallel, each in its own sequence.
+  int maxChoices = 8;
+  // Parse special tokens such as <|begin_of_text|> in the prefix instead of
+  // adding BOS, to score text inside a chat template.
+  bool parseSpecial = false;
+};
+
+struct ChoiceScore {
+  float logprob = 0.0f;  // Sum over the choice's tokens
+  size_t nTokens = 0;
+
+  [[nodiscard]] float Normalized() const {
+    return nTokens > 0 ? logprob / static_cast<float>(nTokens) : logprob;
+  }
+};
+
+struct ScorerStats {
+  size_t questions = 0;
+  size_t choices = 0;
+  size_t evaluatedTokens = 0;
+  size_t sharedTokens = 0;  // Prefix tokens not evaluated again per choice
+  size_t decodes = 0;
+  double seconds = 0.0;
+
+  [[nodiscard]] double TokensPerSecond() const {
+    return seconds > 0.0 ? static_cast<double>(evaluatedTokens) / seconds
+                         : 0.0;
+  }
+};
+
+struct PerplexityParams {
+  size_t window = 512;  // Tokens per evaluated window
+  size_t stride = 256;  // Tokens between window starts
+  // Windows evaluated together, each in its own sequence.
+  int parallelWindows = 4;
+  int nBatch = 2048;
+  int nThreads = 6;
+};
+
+struct PerplexityResult {
+  double perplexity = 0.0;
+  double negativeLogLikelihood = 0.0;  // Sum over the scored tokens
+  size_t windows = 0;
+  size_t scoredTokens = 0;
+  size_t evaluatedTokens = 0;
+  double seconds = 0.0;
+
+  [[nodiscard]] double TokensPerSecond() const {
+    return seconds > 0.0 ? static_cast<double>(evaluatedTokens) / seconds
+                         : 0.0;
+  }
+};
+
+// Scores the options of multiple-choice questions by their log-likelihood
+// as continuations of the question. The question is evaluated once into
+// sequence 0 and shared with every option through the KV cache; the
+// options are then decoded together, one sequence each.
+class ChoiceScorer {
+ public:
+  ChoiceScorer();
+  ~ChoiceScorer();
+
+  ChoiceScorer(const ChoiceScorer&) = delete;
+  ChoiceScorer& operator=(const ChoiceScorer&) = delete;
+
+  bool Initialize(
+      const std::string& modelPath,
+      const ModelParams& modelParams,
+      const ScorerParams& params
+  );
+
+  // Fills one score per choice. `prefix + choice` is tokenized as a whole,
+  // so a choice usually starts with a space. A choice that adds no tokens,
+  // e.g. an empty one, scores -infinity.
+  bool Score(
+      const std::string& prefix,
+      const std::vector<std::string>& choices,
+      std::vector<ChoiceScore>& scores
+  );
+
+  [[nodiscard]] ScorerStats GetStats() const;
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> pimpl;
+};
+
+// Strided perplexity of a text. The text is cut into windows that start
+// `stride` tokens apart; each window scores only its last `stride` tokens,
+// so every scored token sees at least window - stride tokens of context.
+// Windows are decoded in parallel sequences and logits are only computed
+// for scored positions.
+class PerplexityEvaluator {
+ public:
+  PerplexityEvaluator();
+  ~PerplexityEvaluator();
+
+  PerplexityEvaluator(const PerplexityEvaluator&) = delete;
+  PerplexityEvaluator& operator=(const PerplexityEvaluator&) = delete;
+
+  bool Initialize(
+      const std::string& modelPath,
+      const ModelParams& modelParams,
+      const PerplexityParams& params
+  );
+
+  // `progress`, if set, receives the running result after each group of
+  // parallel windows.
+  bool Evaluate(
+      const std::string& text,
+      PerplexityResult& result,
+      const std::function<void(const PerplexityResult&)>& progress = nullptr
+  );
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> pimpl;
+};
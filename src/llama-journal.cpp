@@ -0,0 +1,429 @@
+#include "llama-journal.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "checksum.h"
+#include "journal-file.h"
+#include "logger.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+constexpr char kMagic[8] = {'L', 'C', 'J', 'R', 'N', 'L', '0', '1'};
+constexpr size_t kRecordHeader = 8;  // Body length and checksum
+constexpr size_t kBodyHeader = 7;    // Type, session length, first length
+
+template <typename T>
+void Store(uint8_t* destination, T value) {
+  std::memcpy(destination, &value, sizeof(T));
+}
+
+template <typename T>
+T Load(const uint8_t* source) {
+  T value;
+  std::memcpy(&value, source, sizeof(T));
+  return value;
+}
+
+}  // namespace
+
+#ifdef _WIN32
+
+JournalFile::~JournalFile() = default;
+
+bool JournalFile::Open(const std::string&, const JournalParams&) {
+  LogError("ConversationJournal is not supported on Windows");
+  return false;
+}
+
+bool JournalFile::Reserve(size_t) { return false; }
+bool JournalFile::Map(size_t) { return false; }
+void JournalFile::Recover() {}
+bool JournalFile::Sync(size_t, size_t) { return false; }
+void JournalFile::RunCommitter() {}
+bool JournalFile::Flush() { return false; }
+
+#else
+
+JournalFile::~JournalFile() {
+  if (committer.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(commitMutex);
+      stopping = true;
+    }
+    commitWakeup.notify_one();
+    committer.join();
+  }
+
+  if (base) {
+    munmap(base, mappedBytes);
+  }
+  for (const auto& [mapping, bytes] : replacedMappings) {
+    munmap(mapping, bytes);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+bool JournalFile::Open(
+    const std::string& path, const JournalParams& journalParams
+) {
+  params = journalParams;
+  params.growthBytes = std::max<size_t>(params.growthBytes, 1 << 16);
+
+  fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    LogError("Failed to open journal", {{"path", path}});
+    return false;
+  }
+
+  struct stat info {};
+  if (fstat(fd, &info) != 0) {
+    LogError("Failed to stat journal", {{"path", path}});
+    return false;
+  }
+
+  const auto size = static_cast<size_t>(info.st_size);
+  if (size < sizeof(kMagic)) {
+    if (!Map(params.growthBytes)) {
+      return false;
+    }
+    std::memcpy(base, kMagic, sizeof(kMagic));
+    tail = sizeof(kMagic);
+  } else {
+    if (!Map(size)) {
+      return false;
+    }
+    if (std::memcmp(base, kMagic, sizeof(kMagic)) != 0) {
+      LogError("Not a conversation journal", {{"path", path}});
+      return false;
+    }
+    Recover();
+  }
+
+  durable = tail;
+  committer = std::thread([this] { RunCommitter(); });
+  return true;
+}
+
+bool JournalFile::Map(size_t bytes) {
+  if (base) {
+    replacedMappings.emplace_back(base, mappedBytes);
+    base = nullptr;
+  }
+
+  if (ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+    LogError("Failed to extend journal", {{"bytes", std::to_string(bytes)}});
+    return false;
+  }
+
+  void* mapping =
+      mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    LogError("Failed to map journal", {{"bytes", std::to_string(bytes)}});
+    return false;
+  }
+
+  base = static_cast<uint8_t*>(mapping);
+  mappedBytes = bytes;
+  return true;
+}
+
+bool JournalFile::Reserve(size_t bytes) {
+  if (!base) {
+    return false;
+  }
+  if (tail + bytes <= mappedBytes) {
+    return true;
+  }
+
+  size_t size = mappedBytes + params.growthBytes;
+  while (size < tail + bytes) {
+    size += params.growthBytes;
+  }
+  return Map(size);
+}
+
+void JournalFile::Recover() {
+  size_t offset = sizeof(kMagic);
+  while (offset + kRecordHeader + kBodyHeader <= mappedBytes) {
+    const auto length = Load<uint32_t>(base + offset);
+    const uint8_t* body = base + offset + kRecordHeader;
+    if (length < kBodyHeader || offset + kRecordHeader + length > mappedBytes ||
+        Load<uint32_t>(base + offset + 4) != Crc32(body, length)) {
+      break;
+    }
+
+    const auto type = static_cast<RecordType>(body[0]);
+    const auto sessionLength = Load<uint16_t>(body + 1);
+    const auto firstLength = Load<uint32_t>(body + 3);
+    if (kBodyHeader + sessionLength + firstLength > length) {
+      break;
+    }
+
+    const char* text = reinterpret_cast<const char*>(body + kBodyHeader);
+    std::string session(text, sessionLength);
+    std::string_view first(text + sessionLength, firstLength);
+    std::string_view second(
+        text + sessionLength + firstLength,
+        length - kBodyHeader - sessionLength - firstLength
+    );
+
+    RecoveredConversation& conversation = recovered[session];
+    switch (type) {
+      case RecordType::Reset:
+        conversation = RecoveredConversation();
+        break;
+      case RecordType::Message:
+        // A response cut short by a crash still counts as the reply.
+        if (first != "assistant" && !conversation.partialResponse.empty()) {
+          conversation.messages.push_back(
+              {"assistant", conversation.partialResponse}
+          );
+        }
+        conversation.partialResponse.clear();
+        conversation.messages.push_back(
+            {std::string(first), std::string(second)}
+        );
+        break;
+      case RecordType::Piece:
+        conversation.partialResponse.append(first);
+        break;
+    }
+
+    ++stats.recoveredRecords;
+    offset += kRecordHeader + length;
+  }
+
+  for (auto it = recovered.begin(); it != recovered.end();) {
+    if (it->second.messages.empty() && it->second.partialResponse.empty()) {
+      it = recovered.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  stats.recoveredSessions = recovered.size();
+
+  // Clear whatever follows the last intact record, so a record torn by the
+  // crash can never be mistaken for a valid one after new appends.
+  tail = offset;
+  size_t end = mappedBytes;
+  while (end > tail && base[end - 1] == 0) {
+    --end;
+  }
+  stats.truncatedBytes = end - tail;
+  std::memset(base + tail, 0, end - tail);
+}
+
+// Writes the dirty pages of [from, to) back to the file, then the file to
+// disk; a data sync alone does not cover a shared mapping everywhere. Runs
+// unlocked: only the committer unmaps, so appends go on meanwhile.
+bool JournalFile::Sync(size_t from, size_t to) {
+  uint8_t* current;
+  size_t currentBytes;
+  std::vector<std::pair<uint8_t*, size_t>> replaced;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    current = base;
+    currentBytes = mappedBytes;
+    replaced.swap(replacedMappings);
+  }
+
+  const auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  const size_t start = from / page * page;
+  auto write = [start, to](uint8_t* mapping, size_t bytes) {
+    const size_t end = std::min(to, bytes);
+    return end <= start || msync(mapping + start, end - start, MS_SYNC) == 0;
+  };
+
+  // Records written before a remap may only be dirty in the old mapping.
+  bool synced = current != nullptr;
+  for (const auto& [mapping, bytes] : replaced) {
+    synced = write(mapping, bytes) && synced;
+    munmap(mapping, bytes);
+  }
+  synced = synced && write(current, currentBytes);
+
+#ifdef __APPLE__
+  return fcntl(fd, F_FULLFSYNC) == 0 && synced;
+#else
+  return fdatasync(fd) == 0 && synced;
+#endif
+}
+
+void JournalFile::RunCommitter() {
+  std::unique_lock<std::mutex> commitLock(commitMutex);
+  while (true) {
+    if (!stopping) {
+      commitWakeup.wait_for(commitLock, params.commitInterval);
+    }
+    // The pass after stopping syncs the tail, so a clean shutdown leaves
+    // every record durable.
+    const bool last = stopping;
+
+    size_t target;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      target = tail;
+    }
+
+    if (target > durable) {
+      const size_t from = durable;
+      commitLock.unlock();
+      const bool synced = Sync(from, target);
+      commitLock.lock();
+
+      if (synced) {
+        durable = target;
+        std::lock_guard<std::mutex> lock(mutex);
+        ++stats.commits;
+      } else {
+        LogError("Failed to sync journal");
+        syncFailed = true;
+        std::lock_guard<std::mutex> lock(mutex);
+        ++stats.failedCommits;
+      }
+      committed.notify_all();
+    }
+
+    if (last) {
+      break;
+    }
+  }
+}
+
+bool JournalFile::Flush() {
+  size_t target;
+  bool dropped;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    target = tail;
+    dropped = stats.droppedRecords > 0;
+  }
+
+  std::unique_lock<std::mutex> commitLock(commitMutex);
+  if (!committer.joinable()) {
+    return false;
+  }
+  commitWakeup.notify_one();
+  committed.wait(commitLock, [this, target] {
+    return durable >= target || syncFailed || stopping;
+  });
+  return durable >= target && !syncFailed && !dropped;
+}
+
+#endif
+
+void JournalFile::Append(
+    RecordType type,
+    std::string_view session,
+    std::string_view first,
+    std::string_view second
+) {
+  const size_t length =
+      kBodyHeader + session.size() + first.size() + second.size();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!Reserve(kRecordHeader + length)) {
+    ++stats.droppedRecords;
+    LogError(
+        "Journal record dropped",
+        {{"session", std::string(session)},
+         {"dropped", std::to_string(stats.droppedRecords)}}
+    );
+    return;
+  }
+
+  uint8_t* record = base + tail;
+  uint8_t* body = record + kRecordHeader;
+  body[0] = static_cast<uint8_t>(type);
+  Store(body + 1, static_cast<uint16_t>(session.size()));
+  Store(body + 3, static_cast<uint32_t>(first.size()));
+  uint8_t* text = body + kBodyHeader;
+  text = std::copy(session.begin(), session.end(), text);
+  text = std::copy(first.begin(), first.end(), text);
+  std::copy(second.begin(), second.end(), text);
+
+  // The length goes in last: a zero length marks the end of the journal.
+  Store(record + 4, Crc32(body, length));
+  Store(record, static_cast<uint32_t>(length));
+
+  tail += kRecordHeader + length;
+  ++stats.records;
+  stats.bytes = tail;
+}
+
+void JournalFile::AppendReset(std::string_view session) {
+  Append(RecordType::Reset, session, {}, {});
+}
+
+void JournalFile::AppendMessage(
+    std::string_view session, std::string_view role, std::string_view content
+) {
+  Append(RecordType::Message, session, role, content);
+}
+
+void JournalFile::AppendPiece(
+    std::string_view session, std::string_view piece
+) {
+  Append(RecordType::Piece, session, piece, {});
+}
+
+bool JournalFile::TakeRecovered(
+    const std::string& session, RecoveredConversation& out
+) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = recovered.find(session);
+  if (it == recovered.end()) {
+    return false;
+  }
+  out = std::move(it->second);
+  recovered.erase(it);
+  return true;
+}
+
+std::vector<std::string> JournalFile::GetSessionIds() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<std::string> ids;
+  for (const auto& [id, conversation] : recovered) {
+    ids.push_back(id);
+  }
+  return ids;
+}
+
+JournalStats JournalFile::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
+}
+
+ConversationJournal::ConversationJournal() = default;
+ConversationJournal::~ConversationJournal() = default;
+
+bool ConversationJournal::Open(
+    const std::string& path, const JournalParams& params
+) {
+  auto candidate = std::make_shared<JournalFile>();
+  if (!candidate->Open(path, params)) {
+    return false;
+  }
+  file = std::move(candidate);
+  return true;
+}
+
+std::vector<std::string> ConversationJournal::GetSessionIds() const {
+  return file ? file->GetSessionIds() : std::vector<std::string>();
+}
+
+bool ConversationJournal::Flush() { return file && file->Flush(); }
+
+JournalStats ConversationJournal::GetStats() const {
+  return file ? file->GetStats() : JournalStats();
+}
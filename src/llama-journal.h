@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+class JournalFile;
+
+struct JournalParams {
+  // Appends are made durable together at most this long after they happen.
+  std::chrono::milliseconds commitInterval{10};
+  // The file is extended and remapped in steps of this size.
+  size_t growthBytes = 16 << 20;
+};
+
+struct JournalStats {
+  size_t records = 0;
+  size_t bytes = 0;
+  size_t commits = 0;
+  size_t recoveredSessions = 0;
+  size_t recoveredRecords = 0;
+  size_t truncatedBytes = 0;  // Torn tail discarded during recovery
+  size_t droppedRecords = 0;  // Not appended: the file could not grow
+  size_t failedCommits = 0;   // Syncs the disk refused
+};
+
+// Append-only, memory-mapped log of every conversation change, from which
+// LlamaChat sessions are rebuilt after a restart. Appends are a copy into
+// the mapping; a background thread makes them durable with one msync and
+// data sync per commit interval, so Prompt() never waits on the disk, and
+// once more when the journal is destroyed. Records carry a checksum and
+// recovery stops at the first torn one. Images are not journaled. Not
+// available on Windows.
+class ConversationJournal {
+ public:
+  ConversationJournal();
+  ~ConversationJournal();
+
+  ConversationJournal(const ConversationJournal&) = delete;
+  ConversationJournal& operator=(const ConversationJournal&) = delete;
+
+  // Opens or creates the journal and reads back the conversations in it.
+  bool Open(const std::string& path, const JournalParams& params = {});
+
+  // Sessions with a recovered conversation, for LlamaChat::AttachJournal.
+  [[nodiscard]] std::vector<std::string> GetSessionIds() const;
+
+  // Waits until everything appended so far is durable. False if a sync
+  // has failed or a record was dropped since Open; such errors stick.
+  bool Flush();
+
+  [[nodiscard]] JournalStats GetStats() const;
+
+ private:
+  friend class LlamaChat;
+
+  std::shared_ptr<JournalFile> file;
+};
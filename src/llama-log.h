@@ -0,0 +1,49 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+enum class LogLevel { Debug = 0, Info, Warning, Error };
+
+struct LogField {
+  std::string key;
+  std::string value;
+};
+
+struct LogRecord {
+  LogLevel level = LogLevel::Info;
+  std::string source;  // "llama-chat" or "llama.cpp"
+  std::string message;
+  std::vector<LogField> fields;
+  std::chrono::system_clock::time_point time;
+};
+
+using LogSink = std::function<void(const LogRecord&)>;
+
+struct LogParams {
+  LogLevel minLevel = LogLevel::Warning;
+  size_t rateLimitPerSecond = 100;  // Per level; 0 disables rate limiting
+};
+
+struct LogStats {
+  size_t written = 0;
+  size_t droppedQueueFull = 0;
+  size_t droppedRateLimited = 0;
+};
+
+// Library and llama.cpp messages are queued without blocking the calling
+// thread and handed to the sink by a background writer thread. Messages
+// that find the queue full or exceed the rate limit are dropped and counted.
+class LlamaLog {
+ public:
+  // Replaces the sink; an empty sink restores the default stderr writer.
+  static void SetSink(LogSink sink, const LogParams& params = LogParams());
+
+  // Blocks until every message queued before the call has been written.
+  static void Flush();
+
+  [[nodiscard]] static LogStats GetStats();
+};
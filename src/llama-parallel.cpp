@@ -0,0 +1,564 @@
+#include "llama-parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+
+#include "batch-planner.h"
+#include "chat-format.h"
+#include "common.h"
+#include "dry-sampler.h"
+#include "eval-context.h"
+#include "generation-control.h"
+#include "logger.h"
+#include "prefill-workers.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double SecondsBetween(Clock::time_point start, Clock::time_point end) {
+  return std::chrono::duration<double>(end - start).count();
+}
+
+}  // namespace
+
+class ParallelGenerator::Impl {
+ public:
+  bool Initialize(
+      const std::string& modelPath,
+      const ModelParams& modelParams,
+      const ParallelParams& parallelParams
+  ) {
+    params = parallelParams;
+    params.nSlots = std::max(params.nSlots, 1);
+    // Every step has room for a prompt token next to the generating slots.
+    params.stepTokens = std::max(params.stepTokens, params.nSlots);
+    params.nBatch = std::max(params.nBatch, params.stepTokens);
+
+    // Forked before this process loads the model.
+    workers.reset();
+    if (params.prefillWorkers > 0) {
+      PrefillWorkerParams workerParams;
+      workerParams.workers = params.prefillWorkers;
+      workerParams.nContext = params.nContext;
+      workerParams.nBatch = params.nBatch;
+      workerParams.nThreads = params.prefillThreads;
+      workerParams.handoffBytes = params.handoffBytes;
+      workers.emplace();
+      if (!workers->Start(modelPath, modelParams, workerParams)) {
+        workers.reset();
+        return false;
+      }
+      workerSlots.assign(workers->Size(), 0);
+    }
+
+    if (!eval.Initialize(
+            modelPath,
+            modelParams,
+            params.nContext,
+            params.nBatch,
+            params.nThreads,
+            params.nSlots
+        )) {
+      return false;
+    }
+
+    std::vector<llama_token> eot;
+    eval.vocabulary.Tokenize(kEndOfTurn, false, true, eot);
+    if (eot.size() != 1) {
+      LogError("Failed to retrieve <|eot_id|> token ID.");
+      return false;
+    }
+    eotToken = eot[0];
+
+    // A request is the first user turn of a conversation, formatted as
+    // LlamaChat formats it.
+    promptPrefix = kBeginOfText;
+    if (!params.systemPrompt.empty()) {
+      promptPrefix += FormatTurn("system", params.systemPrompt);
+    }
+    promptPrefix += TurnHeader("user");
+    promptSuffix = std::string(kEndOfTurn) + TurnHeader("assistant");
+
+    prefixTokens.clear();
+    suffixTokens.clear();
+    eval.vocabulary.Tokenize(promptPrefix, false, true, prefixTokens);
+    eval.vocabulary.Tokenize(promptSuffix, false, true, suffixTokens);
+
+    slots.clear();
+    slots.resize(params.nSlots);
+    stats = ParallelStats();
+    stats.occupancy.assign(params.nSlots + 1, 0);
+    return true;
+  }
+
+  void SetSamplingParams(const SamplingParams& samplingParams) {
+    sampling = samplingParams;
+  }
+
+  bool Generate(
+      const std::vector<BatchRequest>& requests,
+      std::vector<BatchResult>& results
+  ) {
+    if (!eval.ctx) {
+      throw std::runtime_error("ParallelGenerator is not initialized");
+    }
+    auto start = Clock::now();
+
+    for (auto& slot : slots) {
+      slot.busy = false;
+    }
+    busySlots = 0;
+    prefillQueue.clear();
+    fallbackQueue.clear();
+    if (workers) {
+      workers->Drain();
+    }
+    freeCells = llama_n_ctx(eval.ctx);
+    llama_kv_cache_clear(eval.ctx);
+
+    results.assign(requests.size(), BatchResult());
+    prompts.assign(requests.size(), {});
+    BatchPlanner planner;
+    const size_t failed = stats.failed;
+    for (size_t i = 0; i < requests.size(); ++i) {
+      const BatchRequest& request = requests[i];
+      results[i].id = request.id;
+      ++stats.requests;
+
+      std::vector<llama_token>& prompt = prompts[i];
+      if (request.promptTokens.empty()) {
+        eval.vocabulary.Tokenize(
+            promptPrefix + request.prompt + promptSuffix, false, true, prompt
+        );
+      } else {
+        prompt = prefixTokens;
+        prompt.insert(
+            prompt.end(),
+            request.promptTokens.begin(),
+            request.promptTokens.end()
+        );
+        prompt.insert(prompt.end(), suffixTokens.begin(), suffixTokens.end());
+      }
+
+      const size_t cells = prompt.size() + sampling.maxTokens;
+      if (cells > llama_n_ctx(eval.ctx)) {
+        LogError(
+            "Request does not fit the context",
+            {{"id", request.id}, {"cells", std::to_string(cells)}}
+        );
+        results[i].stats.stopReason = StopReason::ContextFull;
+        ++stats.failed;
+        continue;
+      }
+
+      const size_t expected =
+          request.expectedTokens > 0
+              ? std::min(request.expectedTokens, sampling.maxTokens)
+              : sampling.maxTokens;
+      planner.Add(i, prompt.size(), expected, cells);
+    }
+
+    while (!planner.Empty() || busySlots > 0) {
+      Admit(planner, results);
+      Step(results);
+    }
+    prompts.clear();
+
+    stats.seconds += SecondsBetween(start, Clock::now());
+    return stats.failed == failed;
+  }
+
+  [[nodiscard]] ParallelStats GetStats() const { return stats; }
+
+ private:
+  struct Slot {
+    bool busy = false;
+    bool generating = false;  // The whole prompt is in the KV cache
+    size_t request = 0;
+    size_t cells = 0;         // Reserved in the KV cache
+    llama_pos position = 0;   // Of the next token in the sequence
+    llama_token pending = 0;  // Sampled but not decoded yet
+    std::optional<DrySampler> dry;
+    std::optional<EarlyStopping> stopping;
+    Clock::time_point admitted;
+    Clock::time_point prefilled;
+  };
+
+  EvalContext eval;
+  ParallelParams params;
+  SamplingParams sampling;
+  ParallelStats stats;
+  llama_token eotToken = 0;
+
+  std::string promptPrefix;
+  std::string promptSuffix;
+  std::vector<llama_token> prefixTokens;
+  std::vector<llama_token> suffixTokens;
+
+  std::vector<Slot> slots;
+  size_t busySlots = 0;
+  size_t freeCells = 0;
+  std::deque<size_t> prefillQueue;  // Slots waiting for their prompts
+  std::optional<PrefillWorkerPool> workers;
+  std::vector<size_t> workerSlots;  // Slot whose prompt a worker has
+  // With workers, slots whose prompt state found no room and whose prompts
+  // are evaluated in the steps instead.
+  std::deque<size_t> fallbackQueue;
+  std::vector<std::vector<llama_token>> prompts;  // Of the current run
+  std::vector<llama_token_data> candidates;
+
+  // Fills every free slot whose request fits the free KV cells. Their
+  // prompts are evaluated by the next steps.
+  void Admit(BatchPlanner& planner, std::vector<BatchResult>& results) {
+    for (size_t s = 0; s < slots.size() && !planner.Empty(); ++s) {
+      Slot& slot = slots[s];
+      if (slot.busy) {
+        continue;
+      }
+      auto request = planner.Next(freeCells);
+      if (!request) {
+        break;
+      }
+
+      const size_t promptTokens = prompts[*request].size();
+      slot.busy = true;
+      slot.generating = false;
+      slot.request = *request;
+      slot.cells = promptTokens + sampling.maxTokens;
+      slot.position = 0;
+      slot.dry.emplace(sampling, eval.vocabulary);
+      slot.stopping.emplace(sampling);
+      slot.admitted = Clock::now();
+      freeCells -= slot.cells;
+      ++busySlots;
+      prefillQueue.push_back(s);
+
+      results[*request].stats.promptTokens = promptTokens;
+      stats.promptTokens += promptTokens;
+    }
+  }
+
+  // Decodes the pending token of every generating slot together with the
+  // next chunks of waiting prompts, up to stepTokens in all. Prompts are
+  // evaluated in admission order; a slot samples its first token once its
+  // whole prompt is in the KV cache.
+  void Step(std::vector<BatchResult>& results) {
+    if (workers) {
+      HandOff(results);
+    }
+
+    std::vector<size_t> batchSlots;
+    llama_batch_clear(eval.batch);
+    for (size_t s = 0; s < slots.size(); ++s) {
+      Slot& slot = slots[s];
+      if (!slot.busy || !slot.generating) {
+        continue;
+      }
+      llama_batch_add(
+          eval.batch,
+          slot.pending,
+          slot.position++,
+          {static_cast<llama_seq_id>(s)},
+          true
+      );
+      batchSlots.push_back(s);
+    }
+    const size_t generating = batchSlots.size();
+
+    // With prefill workers, only prompts whose state could not be loaded
+    // share a step.
+    std::deque<size_t>& chunked = workers ? fallbackQueue : prefillQueue;
+    size_t budget = static_cast<size_t>(params.stepTokens) - generating;
+    for (size_t s : chunked) {
+      if (budget == 0) {
+        break;
+      }
+      Slot& slot = slots[s];
+      const auto& prompt = prompts[slot.request];
+      const auto seq = static_cast<llama_seq_id>(s);
+      const auto done = static_cast<size_t>(slot.position);
+      const size_t end = std::min(prompt.size(), done + budget);
+      budget -= end - done;
+      for (size_t i = done; i < end; ++i) {
+        const bool last = i + 1 == prompt.size();
+        llama_batch_add(eval.batch, prompt[i], slot.position++, {seq}, last);
+        batchSlots.push_back(s);
+      }
+    }
+    if (batchSlots.empty()) {
+      return;
+    }
+
+    if (generating > 0) {
+      ++stats.steps;
+      stats.busySlotSteps += generating;
+      ++stats.occupancy[generating];
+      if (batchSlots.size() > generating) {
+        ++stats.mixedSteps;
+      }
+    }
+
+    auto start = Clock::now();
+    DecodeBatch([&](int32_t i, const float* logits) {
+      Slot& slot = slots[batchSlots[i]];
+      if (!slot.generating) {
+        chunked.erase(
+            std::find(chunked.begin(), chunked.end(), batchSlots[i])
+        );
+        slot.generating = true;
+        slot.prefilled = Clock::now();
+        results[slot.request].stats.promptSeconds =
+            SecondsBetween(slot.admitted, slot.prefilled);
+      }
+      Advance(slot, logits, results);
+    });
+    if (generating > 0) {
+      stats.maxStepSeconds =
+          std::max(stats.maxStepSeconds, SecondsBetween(start, Clock::now()));
+    }
+  }
+
+  // Sends waiting prompts to idle prefill workers, then loads the states
+  // that workers finished into their slots' sequences and samples the
+  // first tokens. Waits for a worker when no slot is generating and no
+  // prompt is evaluated in the steps.
+  void HandOff(std::vector<BatchResult>& results) {
+    while (!prefillQueue.empty()) {
+      auto worker = workers->Idle();
+      if (!worker) {
+        break;
+      }
+      const size_t s = prefillQueue.front();
+      prefillQueue.pop_front();
+      if (!workers->Submit(*worker, prompts[slots[s].request])) {
+        Fail(slots[s], results);
+        continue;
+      }
+      workerSlots[*worker] = s;
+    }
+
+    const bool wait = !Generating() && fallbackQueue.empty();
+    for (size_t worker : workers->Completed(wait)) {
+      Load(worker, results);
+    }
+  }
+
+  // Moves the prompt state of a finished worker into its slot. A state
+  // needs contiguous KV cells; when the cells freed by finished slots are
+  // scattered, the prompt is evaluated in the steps instead, whose decodes
+  // split to fit, rather than waiting for more slots to finish.
+  void Load(size_t worker, std::vector<BatchResult>& results) {
+    const size_t s = workerSlots[worker];
+    Slot& slot = slots[s];
+
+    PrefillHandoff handoff;
+    if (!workers->Result(worker, handoff)) {
+      workers->Release(worker);
+      Fail(slot, results);
+      return;
+    }
+
+    auto start = Clock::now();
+    if (llama_state_seq_set_data(
+            eval.ctx, handoff.state, static_cast<llama_seq_id>(s)
+        ) == 0) {
+      workers->Release(worker);
+      llama_kv_cache_seq_rm(eval.ctx, static_cast<llama_seq_id>(s), -1, -1);
+      slot.position = 0;
+      fallbackQueue.push_back(s);
+      ++stats.handoffFallbacks;
+      return;
+    }
+    slot.prefilled = Clock::now();
+    ++stats.handoffs;
+    stats.handoffBytes += handoff.stateBytes;
+    stats.handoffSeconds += SecondsBetween(start, slot.prefilled);
+
+    slot.position = static_cast<llama_pos>(prompts[slot.request].size());
+    slot.generating = true;
+    results[slot.request].stats.promptSeconds =
+        SecondsBetween(slot.admitted, slot.prefilled);
+    // The logits stay in the worker's memory until it is released.
+    Advance(slot, handoff.logits, results);
+    workers->Release(worker);
+  }
+
+  [[nodiscard]] bool Generating() const {
+    return std::any_of(slots.begin(), slots.end(), [](const Slot& slot) {
+      return slot.busy && slot.generating;
+    });
+  }
+
+  // Ends a request whose prompt could not be evaluated.
+  void Fail(Slot& slot, std::vector<BatchResult>& results) {
+    LogError(
+        "Failed to evaluate the prompt", {{"id", results[slot.request].id}}
+    );
+    ++stats.failed;
+    slot.prefilled = Clock::now();
+    Finish(slot, StopReason::ContextFull, results);
+  }
+
+  // Decodes `eval.batch` and calls `output(i, logits)` for every batch index
+  // that requested logits, right after the part of the batch holding it.
+  void DecodeBatch(const std::function<void(int32_t, const float*)>& output) {
+    const auto nUbatch = static_cast<int32_t>(llama_n_ubatch(eval.ctx));
+    for (int32_t first = 0; first < eval.batch.n_tokens; first += nUbatch) {
+      DecodeRange(
+          first, std::min(nUbatch, eval.batch.n_tokens - first), output
+      );
+    }
+    llama_batch_clear(eval.batch);
+  }
+
+  // Decodes at most one micro-batch, so a failed llama_decode() leaves the
+  // KV cache untouched. When the cache has no contiguous room for the
+  // tokens (llama_decode() returns 1) the range is decoded in halves, as
+  // the cells freed by finished slots are scattered.
+  void DecodeRange(
+      int32_t first,
+      int32_t count,
+      const std::function<void(int32_t, const float*)>& output
+  ) {
+    llama_batch view = {
+        count,
+        eval.batch.token + first,
+        nullptr,
+        eval.batch.pos + first,
+        eval.batch.n_seq_id + first,
+        eval.batch.seq_id + first,
+        eval.batch.logits + first,
+        0,
+        0,
+        0,
+    };
+    const int32_t status = llama_decode(eval.ctx, view);
+    if (status == 1 && count > 1) {
+      DecodeRange(first, count / 2, output);
+      DecodeRange(first + count / 2, count - count / 2, output);
+      return;
+    }
+    if (status != 0) {
+      throw std::runtime_error("llama_decode() failed while generating");
+    }
+    ++stats.decodes;
+
+    for (int32_t i = 0; i < count; ++i) {
+      if (view.logits[i]) {
+        output(first + i, llama_get_logits_ith(eval.ctx, i));
+      }
+    }
+  }
+
+  // Samples the slot's next token from `logits`, with the stop conditions
+  // of LlamaChat, and finishes the request when one is met.
+  void Advance(
+      Slot& slot, const float* logits, std::vector<BatchResult>& results
+  ) {
+    BatchResult& result = results[slot.request];
+    if (result.tokens.size() >= sampling.maxTokens) {
+      Finish(slot, StopReason::MaxTokens, results);
+      return;
+    }
+
+    TokenDistribution distribution;
+    const llama_token token = SampleToken(
+        eval.ctx,
+        logits,
+        sampling,
+        *slot.dry,
+        eotToken,
+        candidates,
+        distribution
+    );
+    if (token == eotToken) {
+      Finish(slot, StopReason::EndOfText, results);
+      return;
+    }
+    if (slot.stopping->IsClosed(distribution)) {
+      Finish(slot, StopReason::Closure, results);
+      return;
+    }
+    slot.dry->Accept(token);
+
+    const std::string piece = llama_token_to_piece(eval.ctx, token);
+    result.text += piece;
+    result.tokens.push_back(token);
+    result.logprobs.push_back(
+        LogProbability(logits, llama_n_vocab(eval.model), token)
+    );
+
+    if (slot.stopping->LostConfidence(distribution, piece)) {
+      Finish(slot, StopReason::LowConfidence, results);
+      return;
+    }
+    if (result.tokens.size() >= sampling.maxTokens) {
+      Finish(slot, StopReason::MaxTokens, results);
+      return;
+    }
+    slot.pending = token;
+  }
+
+  // Records the result and frees the slot and its KV cells for the next
+  // request.
+  void Finish(
+      Slot& slot, StopReason reason, std::vector<BatchResult>& results
+  ) {
+    GenerationStats& result = results[slot.request].stats;
+    result.generatedTokens = results[slot.request].tokens.size();
+    result.stopReason = reason;
+    if (reason == StopReason::Closure || reason == StopReason::LowConfidence) {
+      result.tokensSaved = sampling.maxTokens - result.generatedTokens;
+    }
+    result.meanEntropy = slot.stopping->MeanEntropy();
+    result.generationSeconds = SecondsBetween(slot.prefilled, Clock::now());
+    stats.generatedTokens += result.generatedTokens;
+
+    const auto seq = static_cast<llama_seq_id>(&slot - slots.data());
+    llama_kv_cache_seq_rm(eval.ctx, seq, -1, -1);
+    freeCells += slot.cells;
+    slot.busy = false;
+    --busySlots;
+  }
+};
+
+ParallelGenerator::ParallelGenerator() : pimpl(std::make_unique<Impl>()) {}
+ParallelGenerator::~ParallelGenerator() = default;
+
+bool ParallelGenerator::Initialize(
+    const std::string& modelPath,
+    const ModelParams& modelParams,
+    const ParallelParams& params
+) {
+  try {
+    return pimpl->Initialize(modelPath, modelParams, params);
+  } catch (const std::exception& e) {
+    LogError("Initialize exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+void ParallelGenerator::SetSamplingParams(const SamplingParams& params) {
+  pimpl->SetSamplingParams(params);
+}
+
+bool ParallelGenerator::Generate(
+    const std::vector<BatchRequest>& requests,
+    std::vector<BatchResult>& results
+) {
+  try {
+    return pimpl->Generate(requests, results);
+  } catch (const std::exception& e) {
+    LogError("Generate exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+ParallelStats ParallelGenerator::GetStats() const {
+  return pimpl->GetStats();
+}
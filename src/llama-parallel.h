@@ -0,0 +1,103 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llama-batch.h"
+#include "llama-chat.h"
+
+struct ParallelParams {
+  int nSlots = 8;           // Requests generating at the same time
+  size_t nContext = 16384;  // KV cells shared by all slots
+  int nBatch = 512;
+  int nThreads = 6;
+  // Tokens per decode: one per generating slot, the rest are chunks of
+  // prompts being evaluated. Bounds how long a new prompt delays the next
+  // token of the running requests.
+  int stepTokens = 256;
+  // Processes that evaluate prompts with their own copy of the model and
+  // hand the KV state over through shared memory; 0 to evaluate prompts in
+  // the generation steps. Not available on Windows.
+  int prefillWorkers = 0;
+  int prefillThreads = 8;                 // Per prefill worker
+  size_t handoffBytes = size_t(1) << 30;  // Shared memory per worker
+  // Conversation every request starts from; empty for none.
+  std::string systemPrompt;
+};
+
+struct ParallelStats {
+  size_t requests = 0;
+  size_t failed = 0;
+  size_t promptTokens = 0;
+  size_t generatedTokens = 0;
+  size_t decodes = 0;     // llama_decode() calls
+  size_t steps = 0;       // Decodes that generated tokens
+  size_t mixedSteps = 0;  // Steps that also evaluated prompt chunks
+  size_t busySlotSteps = 0;
+  // occupancy[k]: steps with k generating slots.
+  std::vector<size_t> occupancy;
+  double maxStepSeconds = 0.0;  // Longest step, the worst inter-token delay
+  size_t handoffs = 0;  // Prompt states loaded from prefill workers
+  size_t handoffBytes = 0;
+  double handoffSeconds = 0.0;
+  // Prefilled states that found no contiguous KV cells, whose prompts were
+  // evaluated in the steps instead.
+  size_t handoffFallbacks = 0;
+  double seconds = 0.0;
+
+  // Share of slot capacity that generated tokens.
+  [[nodiscard]] double SlotUtilization() const {
+    const size_t capacity =
+        steps * (occupancy.empty() ? 0 : occupancy.size() - 1);
+    return capacity > 0 ? static_cast<double>(busySlotSteps) / capacity : 0.0;
+  }
+
+  [[nodiscard]] double TokensPerSecond() const {
+    return seconds > 0.0 ? static_cast<double>(generatedTokens) / seconds
+                         : 0.0;
+  }
+};
+
+// Generates responses for many independent requests at once, each in its
+// own sequence ("slot") of one context, so every decode produces a token for
+// every generating slot. A slot is refilled as soon as its request finishes.
+// Waiting requests are bucketed by prompt length and expected output
+// length; the longest expected outputs are admitted first and a request is
+// only admitted when the KV cache can hold its prompt plus maxTokens.
+//
+// New prompts are evaluated in chunks that share each decode with the
+// generating slots, so admitting a long prompt does not stall them. With
+// prefill workers, prompts are evaluated in separate processes instead and
+// each step only generates; a finished prompt's KV state is copied into
+// its slot's sequence. Workers are forked by Initialize(), so create the
+// generator before GPU backends are used elsewhere in the process.
+class ParallelGenerator {
+ public:
+  ParallelGenerator();
+  ~ParallelGenerator();
+
+  ParallelGenerator(const ParallelGenerator&) = delete;
+  ParallelGenerator& operator=(const ParallelGenerator&) = delete;
+
+  bool Initialize(
+      const std::string& modelPath,
+      const ModelParams& modelParams,
+      const ParallelParams& params
+  );
+  // Applied to every request. Early stopping and DRY are tracked per slot.
+  void SetSamplingParams(const SamplingParams& params);
+
+  // Fills one result per request, in input order. Returns false if any
+  // request failed.
+  bool Generate(
+      const std::vector<BatchRequest>& requests,
+      std::vector<BatchResult>& results
+  );
+
+  [[nodiscard]] ParallelStats GetStats() const;
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> pimpl;
+};
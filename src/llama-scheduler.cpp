@@ -0,0 +1,177 @@
+#include "llama-scheduler.h"
+
+#include <algorithm>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+class RequestScheduler::Impl {
+ public:
+  explicit Impl(const SchedulerParams& params) : params(params) {}
+
+  uint64_t Submit(
+      const std::string& requestClass,
+      size_t maxTokens,
+      size_t promptTokens,
+      Clock::time_point now
+  ) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    ScheduledRequest request;
+    request.id = nextId++;
+    request.requestClass = requestClass;
+    request.maxTokens = maxTokens;
+    request.promptTokens = promptTokens;
+    request.expectedTokens = Predict(requestClass, maxTokens);
+    request.submitted = now;
+
+    queue.push({Priority(request), std::move(request)});
+    ++stats.submitted;
+    return nextId - 1;
+  }
+
+  std::optional<ScheduledRequest> Next(Clock::time_point now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (queue.empty()) {
+      return std::nullopt;
+    }
+
+    ScheduledRequest request = queue.top().request;
+    queue.pop();
+
+    const double wait = Seconds(now - request.submitted);
+    waitSum += wait;
+    ++stats.dispatched;
+    stats.maxWaitSeconds = std::max(stats.maxWaitSeconds, wait);
+    return request;
+  }
+
+  void Complete(const std::string& requestClass, size_t generatedTokens) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Observe(history[requestClass], generatedTokens);
+    Observe(overall, generatedTokens);
+    ++stats.completed;
+  }
+
+  [[nodiscard]] size_t PredictTokens(
+      const std::string& requestClass, size_t maxTokens
+  ) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return Predict(requestClass, maxTokens);
+  }
+
+  [[nodiscard]] SchedulerStats GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    SchedulerStats result = stats;
+    result.queued = queue.size();
+    result.meanWaitSeconds =
+        stats.dispatched == 0 ? 0.0 : waitSum / stats.dispatched;
+    return result;
+  }
+
+ private:
+  struct History {
+    double meanTokens = 0.0;
+    size_t observations = 0;
+  };
+
+  struct Entry {
+    double priority;
+    ScheduledRequest request;
+
+    // Lowest priority first, then arrival order.
+    bool operator<(const Entry& other) const {
+      if (priority != other.priority) {
+        return priority > other.priority;
+      }
+      return request.id > other.request.id;
+    }
+  };
+
+  SchedulerParams params;
+
+  mutable std::mutex mutex;
+  std::priority_queue<Entry> queue;
+  std::unordered_map<std::string, History> history;
+  History overall;
+  uint64_t nextId = 1;
+
+  SchedulerStats stats;
+  double waitSum = 0.0;
+
+  static double Seconds(Clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+  }
+
+  void Observe(History& entry, size_t tokens) const {
+    // Plain mean until the average has enough samples to be worth smoothing.
+    const double weight =
+        std::max(params.historyWeight, 1.0 / (entry.observations + 1));
+    entry.meanTokens += weight * (static_cast<double>(tokens) - entry.meanTokens);
+    ++entry.observations;
+  }
+
+  [[nodiscard]] size_t Predict(
+      const std::string& requestClass, size_t maxTokens
+  ) const {
+    double expected = static_cast<double>(params.defaultExpectedTokens);
+
+    auto it = history.find(requestClass);
+    if (it != history.end() && it->second.observations > 0) {
+      expected = it->second.meanTokens;
+    } else if (overall.observations > 0) {
+      expected = overall.meanTokens;
+    }
+
+    return std::min(maxTokens, static_cast<size_t>(expected + 0.5));
+  }
+
+  // Every queued request ages at the same rate, so subtracting the aging
+  // credit at dispatch time is equivalent to adding it at submit time; the
+  // priority never changes and a heap keeps the order.
+  [[nodiscard]] double Priority(const ScheduledRequest& request) const {
+    const double submitted = Seconds(request.submitted.time_since_epoch());
+    if (params.policy == SchedulingPolicy::Fifo) {
+      return submitted;
+    }
+
+    const double cost =
+        static_cast<double>(request.expectedTokens) +
+        params.promptTokenCost * static_cast<double>(request.promptTokens);
+    return cost + params.agingTokensPerSecond * submitted;
+  }
+};
+
+RequestScheduler::RequestScheduler(const SchedulerParams& params)
+    : pimpl(std::make_unique<Impl>(params)) {}
+RequestScheduler::~RequestScheduler() = default;
+
+uint64_t RequestScheduler::Submit(
+    const std::string& requestClass,
+    size_t maxTokens,
+    size_t promptTokens,
+    Clock::time_point now
+) {
+  return pimpl->Submit(requestClass, maxTokens, promptTokens, now);
+}
+
+std::optional<ScheduledRequest> RequestScheduler::Next(Clock::time_point now) {
+  return pimpl->Next(now);
+}
+
+void RequestScheduler::Complete(
+    const std::string& requestClass, size_t generatedTokens
+) {
+  pimpl->Complete(requestClass, generatedTokens);
+}
+
+size_t RequestScheduler::PredictTokens(
+    const std::string& requestClass, size_t maxTokens
+) const {
+  return pimpl->PredictTokens(requestClass, maxTokens);
+}
+
+SchedulerStats RequestScheduler::GetStats() const {
+  return pimpl->GetStats();
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+enum class SchedulingPolicy {
+  Fifo,
+  ShortestFirst,
+};
+
+struct SchedulerParams {
+  SchedulingPolicy policy = SchedulingPolicy::ShortestFirst;
+  // Expected tokens a waiting request is credited per second of waiting, so
+  // long requests are eventually served ahead of a stream of short ones.
+  double agingTokensPerSecond = 2.0;
+  // Cost of a prompt token relative to a generated token.
+  double promptTokenCost = 0.05;
+  // Weight of the newest completion in the per-class length average.
+  double historyWeight = 0.2;
+  // Expected output length of a class before anything was observed.
+  size_t defaultExpectedTokens = 256;
+};
+
+struct ScheduledRequest {
+  uint64_t id = 0;
+  std::string requestClass;
+  size_t maxTokens = 0;
+  size_t promptTokens = 0;
+  size_t expectedTokens = 0;
+  std::chrono::steady_clock::time_point submitted;
+};
+
+struct SchedulerStats {
+  size_t submitted = 0;
+  size_t dispatched = 0;
+  size_t completed = 0;
+  size_t queued = 0;
+  double meanWaitSeconds = 0.0;
+  double maxWaitSeconds = 0.0;
+};
+
+// Orders generation requests by expected cost instead of arrival. The
+// expected output length of a request is the running average of completed
+// requests of the same class, capped by its maxTokens. Thread-safe; the
+// caller keeps the request payloads and runs them in the returned order.
+class RequestScheduler {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit RequestScheduler(const SchedulerParams& params = SchedulerParams());
+  ~RequestScheduler();
+
+  RequestScheduler(const RequestScheduler&) = delete;
+  RequestScheduler& operator=(const RequestScheduler&) = delete;
+
+  // Returns the id the request is dispatched under.
+  uint64_t Submit(
+      const std::string& requestClass,
+      size_t maxTokens,
+      size_t promptTokens = 0,
+      Clock::time_point now = Clock::now()
+  );
+
+  // Removes and returns the request to run next, if any is queued.
+  std::optional<ScheduledRequest> Next(Clock::time_point now = Clock::now());
+
+  // Feeds the actual output length back into the class history.
+  void Complete(const std::string& requestClass, size_t generatedTokens);
+
+  [[nodiscard]] size_t PredictTokens(
+      const std::string& requestClass, size_t maxTokens
+  ) const;
+
+  [[nodiscard]] SchedulerStats GetStats() const;
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> pimpl;
+};
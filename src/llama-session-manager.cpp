@@ -0,0 +1,372 @@
+#include "llama-session-manager.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "logger.h"
+
+class SessionRegistry {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  SessionRegistry(SessionManager::Factory factory, SessionManagerParams params)
+      : factory(std::move(factory)), params(params) {}
+
+  LlamaChat* Acquire(const std::string& id) {
+    std::unique_lock<std::mutex> lock(mutex);
+    EvictExpired(Clock::now());
+
+    auto it = Find(id, lock);
+    if (it == sessions.end()) {
+      if (!MakeRoom()) {
+        Reject(id, lock);
+        return nullptr;
+      }
+
+      // Creating a session may load a model; do not block other sessions.
+      Retire(lock);
+      std::unique_ptr<LlamaChat> chat = factory();
+      lock.lock();
+
+      if (!chat) {
+        LogError("Failed to create session", {{"session", id}});
+        return nullptr;
+      }
+
+      it = Find(id, lock);
+      if (it == sessions.end()) {
+        if (!MakeRoom()) {
+          retired.push_back(std::move(chat));
+          Reject(id, lock);
+          return nullptr;
+        }
+        Session session;
+        session.chat = std::move(chat);
+        it = sessions.emplace(id, std::move(session)).first;
+        ++stats.created;
+      } else {
+        retired.push_back(std::move(chat));
+      }
+    }
+
+    Session& session = it->second;
+    ++session.uses;
+    session.value = floor + static_cast<double>(session.uses);
+    ++session.inUse;
+    LlamaChat* chat = session.chat.get();
+    Retire(lock);
+    return chat;
+  }
+
+  void Release(const std::string& id, const LlamaChat& chat) {
+    // The caller still holds the session, so it can be measured unlocked.
+    const MemoryUsage memory = chat.GetMemoryUsage();
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto it = sessions.find(id);
+    if (it == sessions.end()) {
+      return;
+    }
+
+    Session& session = it->second;
+    --session.inUse;
+    session.lastUsed = Clock::now();
+    UpdateMemory(session, memory);
+
+    if (session.inUse == 0 && params.maxSessionBytes > 0 &&
+        session.memory.kvBytes + session.memory.hostBytes >
+            params.maxSessionBytes) {
+      Evict(it, EvictionReason::Quota);
+    }
+
+    EnforceBudgets(lock);
+    Retire(lock);
+  }
+
+  bool Remove(const std::string& id) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto it = sessions.find(id);
+    if (it == sessions.end() || it->second.inUse > 0) {
+      return false;
+    }
+
+    kvBytes -= it->second.memory.kvBytes;
+    hostBytes -= it->second.memory.hostBytes;
+    retired.push_back(std::move(it->second.chat));
+    sessions.erase(it);
+    Retire(lock);
+    return true;
+  }
+
+  void EvictExpired() {
+    std::unique_lock<std::mutex> lock(mutex);
+    EvictExpired(Clock::now());
+    Retire(lock);
+  }
+
+  [[nodiscard]] SessionManagerStats GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    SessionManagerStats result = stats;
+    result.sessions = sessions.size();
+    result.kvBytes = kvBytes;
+    result.hostBytes = hostBytes;
+    for (const auto& [id, session] : sessions) {
+      if (!session.suspending && session.chat->IsSuspended()) {
+        ++result.suspended;
+      } else {
+        ++result.resident;
+      }
+      if (session.inUse > 0) {
+        ++result.inUse;
+      }
+    }
+    return result;
+  }
+
+ private:
+  struct Session {
+    std::unique_ptr<LlamaChat> chat;
+    size_t inUse = 0;
+    size_t uses = 0;
+    double value = 0.0;
+    Clock::time_point lastUsed = Clock::now();
+    MemoryUsage memory;
+    bool suspending = false;  // Being spilled to host memory, unlocked
+  };
+
+  using Iterator = std::unordered_map<std::string, Session>::iterator;
+
+  SessionManager::Factory factory;
+  SessionManagerParams params;
+
+  mutable std::mutex mutex;
+  std::condition_variable suspended;
+  std::unordered_map<std::string, Session> sessions;
+  // Removed sessions, destroyed once the mutex is released.
+  std::vector<std::unique_ptr<LlamaChat>> retired;
+  double floor = 0.0;  // Value of the last evicted session
+  size_t kvBytes = 0;
+  size_t hostBytes = 0;
+  size_t spillingKvBytes = 0;  // Of sessions being suspended
+  SessionManagerStats stats;
+
+  // Unlocks and destroys the retired sessions; tearing down a context can
+  // take a while.
+  void Retire(std::unique_lock<std::mutex>& lock) {
+    std::vector<std::unique_ptr<LlamaChat>> chats;
+    chats.swap(retired);
+    lock.unlock();
+  }
+
+  // Waits until the session, if it exists, is not being suspended.
+  Iterator Find(const std::string& id, std::unique_lock<std::mutex>& lock) {
+    auto it = sessions.find(id);
+    while (it != sessions.end() && it->second.suspending) {
+      suspended.wait(lock);
+      it = sessions.find(id);
+    }
+    return it;
+  }
+
+  // Whether there is room for one more session, evicting one if needed.
+  bool MakeRoom() {
+    return params.maxSessions == 0 || sessions.size() < params.maxSessions ||
+           EvictLeastValuable(EvictionReason::Capacity, false);
+  }
+
+  void Reject(const std::string& id, std::unique_lock<std::mutex>& lock) {
+    ++stats.rejected;
+    Retire(lock);
+    LogError(
+        "Session limit reached with every session in use",
+        {{"session", id}, {"maxSessions", std::to_string(params.maxSessions)}}
+    );
+  }
+
+  void UpdateMemory(Session& session, const MemoryUsage& memory) {
+    kvBytes -= session.memory.kvBytes;
+    hostBytes -= session.memory.hostBytes;
+    session.memory = memory;
+    kvBytes += session.memory.kvBytes;
+    hostBytes += session.memory.hostBytes;
+  }
+
+  void Evict(Iterator it, EvictionReason reason) {
+    switch (reason) {
+      case EvictionReason::Expired:
+        ++stats.evictedExpired;
+        break;
+      case EvictionReason::KvBudget:
+        ++stats.evictedKvBudget;
+        break;
+      case EvictionReason::HostBudget:
+        ++stats.evictedHostBudget;
+        break;
+      case EvictionReason::Quota:
+        ++stats.evictedQuota;
+        break;
+      case EvictionReason::Capacity:
+        ++stats.evictedCapacity;
+        break;
+    }
+
+    floor = std::max(floor, it->second.value);
+    kvBytes -= it->second.memory.kvBytes;
+    hostBytes -= it->second.memory.hostBytes;
+    retired.push_back(std::move(it->second.chat));
+    sessions.erase(it);
+  }
+
+  void EvictExpired(Clock::time_point now) {
+    for (auto it = sessions.begin(); it != sessions.end();) {
+      auto current = it++;
+      if (current->second.inUse == 0 &&
+          now - current->second.lastUsed > params.idleTtl) {
+        Evict(current, EvictionReason::Expired);
+      }
+    }
+  }
+
+  // Least valuable session nobody is using; with `residentOnly`, only
+  // sessions that still hold KV memory.
+  Iterator LeastValuable(bool residentOnly) {
+    auto victim = sessions.end();
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+      const Session& session = it->second;
+      if (session.inUse > 0 ||
+          (residentOnly && session.memory.kvBytes == 0)) {
+        continue;
+      }
+      if (victim == sessions.end() || session.value < victim->second.value ||
+          (session.value == victim->second.value &&
+           session.lastUsed < victim->second.lastUsed)) {
+        victim = it;
+      }
+    }
+    return victim;
+  }
+
+  bool EvictLeastValuable(EvictionReason reason, bool residentOnly) {
+    auto victim = LeastValuable(residentOnly);
+    if (victim == sessions.end()) {
+      return false;
+    }
+    Evict(victim, reason);
+    return true;
+  }
+
+  // Called and returns with `lock` held, but suspends sessions unlocked:
+  // serializing a KV sequence must not block every other session.
+  void EnforceBudgets(std::unique_lock<std::mutex>& lock) {
+    while (kvBytes - spillingKvBytes > params.kvBudgetBytes) {
+      if (!params.spillToHost) {
+        if (!EvictLeastValuable(EvictionReason::KvBudget, true)) {
+          break;
+        }
+        continue;
+      }
+
+      auto victim = LeastValuable(true);
+      if (victim == sessions.end()) {
+        break;
+      }
+
+      // In use, so nothing evicts it, and suspending, so nothing acquires
+      // it; the node stays valid while unlocked.
+      Session& session = victim->second;
+      const std::string id = victim->first;
+      const size_t spilling = session.memory.kvBytes;
+      ++session.inUse;
+      session.suspending = true;
+      spillingKvBytes += spilling;
+
+      lock.unlock();
+      const bool spilled = session.chat->Suspend();
+      const MemoryUsage memory = session.chat->GetMemoryUsage();
+      lock.lock();
+
+      spillingKvBytes -= spilling;
+      session.suspending = false;
+      --session.inUse;
+      suspended.notify_all();
+
+      if (!spilled) {
+        Evict(sessions.find(id), EvictionReason::KvBudget);
+        continue;
+      }
+      floor = std::max(floor, session.value);
+      UpdateMemory(session, memory);
+      ++stats.spills;
+    }
+
+    while (hostBytes > params.hostBudgetBytes) {
+      if (!EvictLeastValuable(EvictionReason::HostBudget, false)) {
+        break;
+      }
+    }
+  }
+};
+
+SessionHandle::~SessionHandle() { Reset(); }
+
+SessionHandle::SessionHandle(SessionHandle&& other) noexcept
+    : registry(std::move(other.registry)),
+      id(std::move(other.id)),
+      chat(other.chat) {
+  other.chat = nullptr;
+}
+
+SessionHandle& SessionHandle::operator=(SessionHandle&& other) noexcept {
+  if (this != &other) {
+    Reset();
+    registry = std::move(other.registry);
+    id = std::move(other.id);
+    chat = other.chat;
+    other.chat = nullptr;
+  }
+  return *this;
+}
+
+void SessionHandle::Reset() {
+  if (registry && chat) {
+    registry->Release(id, *chat);
+  }
+  registry.reset();
+  chat = nullptr;
+}
+
+SessionManager::SessionManager(
+    Factory factory, const SessionManagerParams& params
+)
+    : registry(std::make_shared<SessionRegistry>(std::move(factory), params)) {}
+
+SessionManager::~SessionManager() = default;
+
+SessionHandle SessionManager::Acquire(const std::string& sessionId) {
+  SessionHandle handle;
+  try {
+    handle.chat = registry->Acquire(sessionId);
+  } catch (const std::exception& e) {
+    LogError("Session factory exception", {{"what", e.what()}});
+  }
+  if (handle.chat) {
+    handle.registry = registry;
+    handle.id = sessionId;
+  }
+  return handle;
+}
+
+bool SessionManager::Remove(const std::string& sessionId) {
+  return registry->Remove(sessionId);
+}
+
+void SessionManager::EvictExpired() { registry->EvictExpired(); }
+
+SessionManagerStats SessionManager::GetStats() const {
+  return registry->GetStats();
+}
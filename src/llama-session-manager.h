@@ -0,0 +1,115 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "llama-chat.h"
+
+enum class EvictionReason {
+  Expired,     // Idle longer than idleTtl
+  KvBudget,    // Resident KV over kvBudgetBytes and spilling disabled
+  HostBudget,  // Host memory over hostBudgetBytes
+  Quota,       // Session over maxSessionBytes
+  Capacity,    // More than maxSessions sessions
+};
+
+struct SessionManagerParams {
+  std::chrono::seconds idleTtl{600};
+  size_t kvBudgetBytes = size_t(4) << 30;
+  size_t hostBudgetBytes = size_t(8) << 30;
+  // Per-session limit on KV plus host memory; 0 disables it.
+  size_t maxSessionBytes = 0;
+  // 0 disables the limit.
+  size_t maxSessions = 0;
+  // Over the KV budget, suspend sessions to host memory instead of evicting.
+  bool spillToHost = true;
+};
+
+struct SessionManagerStats {
+  size_t sessions = 0;
+  size_t resident = 0;
+  size_t suspended = 0;
+  size_t inUse = 0;
+  size_t created = 0;
+  size_t spills = 0;
+  size_t kvBytes = 0;
+  size_t hostBytes = 0;
+  size_t evictedExpired = 0;
+  size_t evictedKvBudget = 0;
+  size_t evictedHostBudget = 0;
+  size_t evictedQuota = 0;
+  size_t evictedCapacity = 0;
+  // Acquires refused at maxSessions because every session was in use.
+  size_t rejected = 0;
+};
+
+class SessionRegistry;
+
+// Keeps a session from being evicted while the caller uses it. A session
+// must not be used from two threads at once.
+class SessionHandle {
+ public:
+  SessionHandle() = default;
+  ~SessionHandle();
+
+  SessionHandle(SessionHandle&& other) noexcept;
+  SessionHandle& operator=(SessionHandle&& other) noexcept;
+
+  SessionHandle(const SessionHandle&) = delete;
+  SessionHandle& operator=(const SessionHandle&) = delete;
+
+  explicit operator bool() const { return chat != nullptr; }
+  LlamaChat* operator->() const { return chat; }
+  LlamaChat& operator*() const { return *chat; }
+
+ private:
+  friend class SessionManager;
+
+  std::shared_ptr<SessionRegistry> registry;
+  std::string id;
+  LlamaChat* chat = nullptr;
+
+  void Reset();
+};
+
+// LlamaChat sessions keyed by ID. Sessions idle past the TTL are evicted.
+// When resident KV memory exceeds its budget, the least valuable idle
+// sessions are suspended to host memory, or evicted if spilling is off.
+// Host memory and per-session size limits are enforced by eviction.
+//
+// Value is usage frequency with dynamic aging (LFU-DA): each use raises a
+// session's value, and every eviction lifts the floor that new and
+// returning sessions start from, so sessions that were popular long ago
+// cannot stay forever. Budgets are checked when a handle is released.
+// Thread-safe; sessions are suspended and destroyed outside the lock, so
+// other sessions are not held up meanwhile.
+class SessionManager {
+ public:
+  // Creates and initializes a new session; returns null on failure.
+  using Factory = std::function<std::unique_ptr<LlamaChat>()>;
+
+  explicit SessionManager(
+      Factory factory,
+      const SessionManagerParams& params = SessionManagerParams()
+  );
+  ~SessionManager();
+
+  SessionManager(const SessionManager&) = delete;
+  SessionManager& operator=(const SessionManager&) = delete;
+
+  // Returns the session, creating it if it does not exist. The handle is
+  // empty if the factory failed, or if there are maxSessions sessions and
+  // all of them are in use.
+  SessionHandle Acquire(const std::string& sessionId);
+  bool Remove(const std::string& sessionId);
+
+  // Evicts expired sessions; also runs on every Acquire.
+  void EvictExpired();
+
+  [[nodiscard]] SessionManagerStats GetStats() const;
+
+ private:
+  std::shared_ptr<SessionRegistry> registry;
+};
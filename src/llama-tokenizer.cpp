@@ -0,0 +1,93 @@
+#include "llama-tokenizer.h"
+
+#include <stdexcept>
+
+#include "llama.h"
+#include "logger.h"
+#include "vocabulary.h"
+
+class LlamaTokenizer::Impl {
+ public:
+  Impl() {
+    InstallLlamaLogCallback();
+    llama_backend_init();
+  }
+
+  ~Impl() { llama_backend_free(); }
+
+  bool Initialize(const std::string& model_path, const ModelParams& params) {
+    llama_model_params modelParams = llama_model_default_params();
+    modelParams.n_gpu_layers = 0;
+    modelParams.vocab_only = true;
+    modelParams.use_mmap = params.useMemoryMapping;
+    modelParams.use_mlock = params.useModelLock;
+
+    model.reset(llama_load_model_from_file(model_path.c_str(), modelParams));
+    if (!model) {
+      LogError("Failed to load vocabulary", {{"path", model_path}});
+      return false;
+    }
+
+    vocabulary.Initialize(model.get(), model_path, params);
+
+    return true;
+  }
+
+  [[nodiscard]] const Vocabulary& GetVocabulary() const {
+    if (!model) {
+      throw std::runtime_error("LlamaTokenizer is not initialized");
+    }
+    return vocabulary;
+  }
+
+ private:
+  struct LlamaModelDeleter {
+    void operator()(llama_model* model) const { llama_free_model(model); }
+  };
+
+  std::unique_ptr<llama_model, LlamaModelDeleter> model = nullptr;
+  Vocabulary vocabulary;
+};
+
+LlamaTokenizer::LlamaTokenizer() : pimpl(std::make_unique<Impl>()) {}
+LlamaTokenizer::~LlamaTokenizer() = default;
+
+bool LlamaTokenizer::Initialize(
+    const std::string& modelPath, const ModelParams& params
+) {
+  try {
+    return pimpl->Initialize(modelPath, params);
+  } catch (const std::exception& e) {
+    LogError("Initialize exception", {{"what", e.what()}});
+    return false;
+  }
+}
+
+std::vector<LlamaToken> LlamaTokenizer::Encode(
+    const std::string& text, bool addBos, bool parseSpecial
+) const {
+  return pimpl->GetVocabulary().Encode(text, addBos, parseSpecial);
+}
+
+std::string LlamaTokenizer::Decode(const std::vector<LlamaToken>& tokens
+) const {
+  return pimpl->GetVocabulary().Decode(tokens);
+}
+
+size_t LlamaTokenizer::CountTokens(
+    const std::string& text, bool addBos, bool parseSpecial
+) const {
+  return pimpl->GetVocabulary().CountTokens(text, addBos, parseSpecial);
+}
+
+TokenEstimate LlamaTokenizer::EstimateTokens(const std::string& text) const {
+  return pimpl->GetVocabulary().EstimateTokens(text);
+}
+
+TokenizerCacheStats LlamaTokenizer::GetCacheStats() const {
+  return pimpl->GetVocabulary().GetCacheStats();
+}
+
+uint64_t LlamaTokenizer::GetVocabularyFingerprint() const {
+  return pimpl->GetVocabulary().Fingerprint();
+}
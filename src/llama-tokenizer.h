@@ -0,0 +1,47 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llama-chat.h"
+
+// Tokenizer-only counterpart of LlamaChat for services that just need to
+// encode, decode or count tokens. Loads the vocabulary without weights or a
+// context, and every method may be called from many threads at once.
+class LlamaTokenizer {
+ public:
+  LlamaTokenizer();
+  ~LlamaTokenizer();
+
+  LlamaTokenizer(const LlamaTokenizer&) = delete;
+  LlamaTokenizer& operator=(const LlamaTokenizer&) = delete;
+
+  LlamaTokenizer(LlamaTokenizer&&) noexcept = default;
+  LlamaTokenizer& operator=(LlamaTokenizer&&) noexcept = default;
+
+  // Always loads with ModelParams::vocabularyOnly set.
+  bool Initialize(const std::string& modelPath, const ModelParams& params);
+
+  [[nodiscard]] std::vector<LlamaToken> Encode(
+      const std::string& text, bool addBos = true, bool parseSpecial = false
+  ) const;
+  [[nodiscard]] std::string Decode(const std::vector<LlamaToken>& tokens
+  ) const;
+  [[nodiscard]] size_t CountTokens(
+      const std::string& text, bool addBos = false, bool parseSpecial = false
+  ) const;
+
+  // Approximate count calibrated to this vocabulary, plus a guaranteed upper
+  // bound on CountTokens(text, true, true).
+  [[nodiscard]] TokenEstimate EstimateTokens(const std::string& text) const;
+
+  [[nodiscard]] TokenizerCacheStats GetCacheStats() const;
+
+  // Same as ModelInfo::vocabularyFingerprint of models with this vocabulary.
+  [[nodiscard]] uint64_t GetVocabularyFingerprint() const;
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> pimpl;
+};
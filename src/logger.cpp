@@ -0,0 +1,329 @@
+#include "logger.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "llama.h"
+
+namespace {
+
+const char* LevelName(LogLevel level) {
+  switch (level) {
+    case LogLevel::Debug:
+      return "debug";
+    case LogLevel::Info:
+      return "info";
+    case LogLevel::Warning:
+      return "warning";
+    case LogLevel::Error:
+      return "error";
+  }
+  return "unknown";
+}
+
+void WriteToStderr(const LogRecord& record) {
+  std::string line = record.source + " [" + LevelName(record.level) + "] " +
+                     record.message;
+  for (const auto& field : record.fields) {
+    line += " " + field.key + "=" + field.value;
+  }
+  line += '\n';
+  std::cerr << line << std::flush;
+}
+
+// Bounded multi-producer queue (Vyukov's array queue) drained by the single
+// writer thread. Producers never wait: a full queue rejects the record.
+class LogQueue {
+ public:
+  explicit LogQueue(size_t capacity)
+      : cells(std::make_unique<Cell[]>(capacity)), mask(capacity - 1) {
+    for (size_t i = 0; i < capacity; ++i) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  bool TryPush(LogRecord&& record) {
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    Cell* cell;
+    for (;;) {
+      cell = &cells[pos & mask];
+      const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      const auto diff =
+          static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (enqueuePos.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed
+            )) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->record = std::move(record);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Single consumer only.
+  bool TryPop(LogRecord& record) {
+    Cell& cell = cells[dequeuePos & mask];
+    if (cell.sequence.load(std::memory_order_acquire) != dequeuePos + 1) {
+      return false;
+    }
+
+    record = std::move(cell.record);
+    cell.sequence.store(dequeuePos + mask + 1, std::memory_order_release);
+    ++dequeuePos;
+    return true;
+  }
+
+  [[nodiscard]] size_t Enqueued() const {
+    return enqueuePos.load(std::memory_order_acquire);
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence{0};
+    LogRecord record;
+  };
+
+  std::unique_ptr<Cell[]> cells;
+  size_t mask;
+  std::atomic<size_t> enqueuePos{0};
+  size_t dequeuePos = 0;
+};
+
+// Fixed one-second window per level; the window resets lock-free and a race
+// on the boundary at worst lets a few extra messages through.
+class RateLimiter {
+ public:
+  bool Allow(LogLevel level, size_t limitPerSecond) {
+    if (limitPerSecond == 0) {
+      return true;
+    }
+
+    auto& window = windows[static_cast<size_t>(level)];
+    const int64_t second =
+        std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+        )
+            .count();
+
+    int64_t start = window.start.load(std::memory_order_relaxed);
+    if (start != second &&
+        window.start.compare_exchange_strong(
+            start, second, std::memory_order_relaxed
+        )) {
+      window.count.store(0, std::memory_order_relaxed);
+    }
+
+    return window.count.fetch_add(1, std::memory_order_relaxed) <
+           limitPerSecond;
+  }
+
+ private:
+  struct Window {
+    std::atomic<int64_t> start{0};
+    std::atomic<size_t> count{0};
+  };
+
+  Window windows[4];
+};
+
+class Logger {
+ public:
+  static Logger& Instance() {
+    // Leaked on purpose so messages logged during static destruction still
+    // have somewhere to go; atexit drains whatever is left.
+    static Logger* instance = [] {
+      auto* logger = new Logger();
+      std::atexit([] { Logger::Instance().Flush(); });
+      return logger;
+    }();
+    return *instance;
+  }
+
+  void Log(LogRecord&& record) {
+    if (record.level < minLevel.load(std::memory_order_relaxed)) {
+      return;
+    }
+    if (!rateLimiter.Allow(
+            record.level, rateLimitPerSecond.load(std::memory_order_relaxed)
+        )) {
+      droppedRateLimited.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    if (!queue.TryPush(std::move(record))) {
+      droppedQueueFull.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    wakeup.notify_one();
+  }
+
+  [[nodiscard]] bool Enabled(LogLevel level) const {
+    return level >= minLevel.load(std::memory_order_relaxed);
+  }
+
+  void SetSink(LogSink newSink, const LogParams& params) {
+    {
+      std::lock_guard<std::mutex> lock(sinkMutex);
+      sink = newSink ? std::move(newSink) : LogSink(WriteToStderr);
+    }
+    minLevel.store(params.minLevel, std::memory_order_relaxed);
+    rateLimitPerSecond.store(
+        params.rateLimitPerSecond, std::memory_order_relaxed
+    );
+  }
+
+  void Flush() {
+    const size_t target = queue.Enqueued();
+    wakeup.notify_one();
+
+    std::unique_lock<std::mutex> lock(progressMutex);
+    progress.wait(lock, [this, target] { return consumed >= target; });
+  }
+
+  [[nodiscard]] LogStats GetStats() const {
+    LogStats stats;
+    stats.written = written.load(std::memory_order_relaxed);
+    stats.droppedQueueFull = droppedQueueFull.load(std::memory_order_relaxed);
+    stats.droppedRateLimited =
+        droppedRateLimited.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+ private:
+  static constexpr size_t kQueueCapacity = 8192;
+
+  LogQueue queue{kQueueCapacity};
+  RateLimiter rateLimiter;
+  std::atomic<LogLevel> minLevel{LogLevel::Warning};
+  std::atomic<size_t> rateLimitPerSecond{100};
+
+  std::mutex sinkMutex;
+  LogSink sink = WriteToStderr;
+
+  std::mutex wakeupMutex;
+  std::condition_variable wakeup;
+
+  std::mutex progressMutex;
+  std::condition_variable progress;
+  size_t consumed = 0;
+
+  std::atomic<size_t> written{0};
+  std::atomic<size_t> droppedQueueFull{0};
+  std::atomic<size_t> droppedRateLimited{0};
+
+  std::thread writer;
+
+  Logger() : writer([this] { Run(); }) { writer.detach(); }
+
+  void Run() {
+    LogRecord record;
+    for (;;) {
+      bool wrote = false;
+      while (queue.TryPop(record)) {
+        {
+          std::lock_guard<std::mutex> lock(sinkMutex);
+          sink(record);
+        }
+        written.fetch_add(1, std::memory_order_relaxed);
+        wrote = true;
+
+        std::lock_guard<std::mutex> lock(progressMutex);
+        ++consumed;
+      }
+
+      if (wrote) {
+        progress.notify_all();
+      }
+
+      // Producers notify without taking the mutex, so a wakeup can be missed;
+      // the timeout bounds how long a record may wait in that case.
+      std::unique_lock<std::mutex> lock(wakeupMutex);
+      wakeup.wait_for(lock, std::chrono::milliseconds(20));
+    }
+  }
+};
+
+LogLevel FromGgmlLevel(ggml_log_level level) {
+  switch (level) {
+    case GGML_LOG_LEVEL_ERROR:
+      return LogLevel::Error;
+    case GGML_LOG_LEVEL_WARN:
+      return LogLevel::Warning;
+    case GGML_LOG_LEVEL_INFO:
+      return LogLevel::Info;
+    default:
+      return LogLevel::Debug;
+  }
+}
+
+// llama.cpp emits lines in fragments (progress dots, partial prints), so text
+// is collected per thread and queued one line at a time.
+void LlamaLogCallback(ggml_log_level ggmlLevel, const char* text, void*) {
+  const LogLevel level = FromGgmlLevel(ggmlLevel);
+  Logger& logger = Logger::Instance();
+  if (!logger.Enabled(level)) {
+    return;
+  }
+
+  thread_local std::string line;
+  line += text;
+
+  size_t newline;
+  while ((newline = line.find('\n')) != std::string::npos) {
+    if (newline > 0) {
+      LogRecord record;
+      record.level = level;
+      record.source = "llama.cpp";
+      record.message = line.substr(0, newline);
+      record.time = std::chrono::system_clock::now();
+      logger.Log(std::move(record));
+    }
+    line.erase(0, newline + 1);
+  }
+}
+
+}  // namespace
+
+void InstallLlamaLogCallback() {
+  static std::once_flag installed;
+  std::call_once(installed, [] {
+    llama_log_set(LlamaLogCallback, nullptr);
+  });
+}
+
+void LogMessage(
+    LogLevel level, std::string message, std::vector<LogField> fields
+) {
+  Logger& logger = Logger::Instance();
+  if (!logger.Enabled(level)) {
+    return;
+  }
+
+  LogRecord record;
+  record.level = level;
+  record.source = "llama-chat";
+  record.message = std::move(message);
+  record.fields = std::move(fields);
+  record.time = std::chrono::system_clock::now();
+  logger.Log(std::move(record));
+}
+
+void LlamaLog::SetSink(LogSink sink, const LogParams& params) {
+  Logger::Instance().SetSink(std::move(sink), params);
+}
+
+void LlamaLog::Flush() { Logger::Instance().Flush(); }
+
+LogStats LlamaLog::GetStats() { return Logger::Instance().GetStats(); }
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "llama-log.h"
+
+// Routes llama.cpp and ggml log output through LlamaLog. Safe to call from
+// every constructor; the callback is installed once.
+void InstallLlamaLogCallback();
+
+void LogMessage(
+    LogLevel level, std::string message, std::vector<LogField> fields = {}
+);
+
+inline void LogError(std::string message, std::vector<LogField> fields = {}) {
+  LogMessage(LogLevel::Error, std::move(message), std::move(fields));
+}
+
+inline void LogWarning(
+    std::string message, std::vector<LogField> fields = {}
+) {
+  LogMessage(LogLevel::Warning, std::move(message), std::move(fields));
+}
+
+inline void LogInfo(std::string message, std::vector<LogField> fields = {}) {
+  LogMessage(LogLevel::Info, std::move(message), std::move(fields));
+}
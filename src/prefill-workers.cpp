@@ -0,0 +1,402 @@
+#include "prefill-workers.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "common.h"
+#include "eval-context.h"
+#include "logger.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Commands and replies, one byte each.
+constexpr char kPrefill = 'P';
+constexpr char kReady = 'R';
+constexpr char kDone = 'D';
+constexpr char kFailed = 'F';
+
+// Start of a worker's shared memory. The prompt tokens follow it; the
+// worker writes the logits and the sequence state after them.
+struct alignas(64) Header {
+  uint64_t tokens = 0;
+  uint64_t logitsOffset = 0;
+  uint64_t stateOffset = 0;
+  uint64_t stateBytes = 0;
+  double seconds = 0.0;
+  // Why the worker failed. A forked worker cannot log: the logger's writer
+  // thread was not forked with it.
+  char error[192] = {};
+};
+
+size_t AlignUp(size_t offset) { return (offset + 63) & ~size_t(63); }
+
+#ifndef _WIN32
+bool Fail(Header* header, const std::string& error) {
+  std::snprintf(header->error, sizeof(header->error), "%s", error.c_str());
+  return false;
+}
+
+bool Send(int socket, char message) {
+#ifdef MSG_NOSIGNAL
+  const int flags = MSG_NOSIGNAL;
+#else
+  const int flags = 0;  // SO_NOSIGPIPE is set on the socket
+#endif
+  ssize_t sent;
+  do {
+    sent = send(socket, &message, 1, flags);
+  } while (sent < 0 && errno == EINTR);
+  return sent == 1;
+}
+
+bool Receive(int socket, char& message) {
+  ssize_t received;
+  do {
+    received = recv(socket, &message, 1, 0);
+  } while (received < 0 && errno == EINTR);
+  return received == 1;
+}
+
+// Evaluates the prompt in `memory` as sequence 0 and writes the logits of
+// its last token and the sequence state after it.
+bool Prefill(EvalContext& eval, uint8_t* memory, size_t bytes, int nBatch) {
+  auto start = std::chrono::steady_clock::now();
+  auto* header = reinterpret_cast<Header*>(memory);
+  const auto* tokens =
+      reinterpret_cast<const llama_token*>(memory + sizeof(Header));
+  if (header->tokens == 0) {
+    return Fail(header, "Empty prompt");
+  }
+
+  llama_kv_cache_clear(eval.ctx);
+  llama_batch_clear(eval.batch);
+  for (size_t i = 0; i < header->tokens; ++i) {
+    if (eval.batch.n_tokens == nBatch) {
+      eval.Decode();
+      llama_batch_clear(eval.batch);
+    }
+    const auto position = static_cast<llama_pos>(i);
+    const bool last = i + 1 == header->tokens;
+    llama_batch_add(eval.batch, tokens[i], position, {0}, last);
+  }
+  eval.Decode();
+
+  const size_t nVocab = llama_n_vocab(eval.model);
+  header->logitsOffset =
+      AlignUp(sizeof(Header) + header->tokens * sizeof(llama_token));
+  header->stateOffset = AlignUp(header->logitsOffset + nVocab * sizeof(float));
+  const size_t stateBytes = llama_state_seq_get_size(eval.ctx, 0);
+  if (header->stateOffset + stateBytes > bytes) {
+    return Fail(
+        header,
+        "Prompt state of " + std::to_string(stateBytes) +
+            " bytes does not fit the prefill handoff memory"
+    );
+  }
+
+  std::memcpy(
+      memory + header->logitsOffset,
+      llama_get_logits_ith(eval.ctx, eval.batch.n_tokens - 1),
+      nVocab * sizeof(float)
+  );
+  header->stateBytes =
+      llama_state_seq_get_data(eval.ctx, memory + header->stateOffset, 0);
+  auto end = std::chrono::steady_clock::now();
+  header->seconds = std::chrono::duration<double>(end - start).count();
+  return header->stateBytes > 0 ||
+         Fail(header, "Failed to copy the prompt state");
+}
+
+// Body of a worker process: loads the model, then evaluates one prompt per
+// command until the coordinator's end of the socket closes.
+[[noreturn]] void RunWorker(
+    int socket,
+    uint8_t* memory,
+    size_t bytes,
+    const std::string& modelPath,
+    const ModelParams& modelParams,
+    const PrefillWorkerParams& params
+) {
+  auto* header = reinterpret_cast<Header*>(memory);
+  EvalContext eval;
+  bool loaded = false;
+  try {
+    loaded = eval.Initialize(
+        modelPath,
+        modelParams,
+        params.nContext,
+        params.nBatch,
+        params.nThreads,
+        1
+    );
+    if (!loaded) {
+      Fail(header, "Failed to load the model");
+    }
+  } catch (const std::exception& e) {
+    Fail(header, e.what());
+  }
+
+  char reply = loaded ? kReady : kFailed;
+  char command;
+  while (Send(socket, reply) && Receive(socket, command)) {
+    try {
+      reply = loaded && command == kPrefill &&
+                      Prefill(eval, memory, bytes, params.nBatch)
+                  ? kDone
+                  : kFailed;
+    } catch (const std::exception& e) {
+      Fail(header, e.what());
+      reply = kFailed;
+    }
+  }
+  // Skips the destructors and exit handlers inherited from the
+  // coordinator.
+  _exit(0);
+}
+#endif
+
+}  // namespace
+
+PrefillWorkerPool::~PrefillWorkerPool() { Stop(); }
+
+bool PrefillWorkerPool::Start(
+    const std::string& modelPath,
+    const ModelParams& modelParams,
+    const PrefillWorkerParams& params
+) {
+#ifdef _WIN32
+  LogError("Prefill workers are not supported on Windows");
+  return false;
+#else
+  Stop();
+  handoffBytes = params.handoffBytes;
+
+  for (int i = 0; i < params.workers; ++i) {
+    // Pages are only allocated once a prompt state is written to them.
+    void* memory = mmap(
+        nullptr,
+        handoffBytes,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0
+    );
+    if (memory == MAP_FAILED) {
+      LogError(
+          "Failed to map prefill handoff memory",
+          {{"bytes", std::to_string(handoffBytes)}}
+      );
+      Stop();
+      return false;
+    }
+
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+      LogError("Failed to create a prefill worker socket");
+      munmap(memory, handoffBytes);
+      Stop();
+      return false;
+    }
+#ifdef SO_NOSIGPIPE
+    const int on = 1;
+    setsockopt(sockets[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    setsockopt(sockets[1], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+    const pid_t pid = fork();
+    if (pid < 0) {
+      LogError("Failed to start a prefill worker");
+      close(sockets[0]);
+      close(sockets[1]);
+      munmap(memory, handoffBytes);
+      Stop();
+      return false;
+    }
+    if (pid == 0) {
+      // Only the worker's own end stays open, so it sees the coordinator
+      // exit even while other workers hold their sockets.
+      close(sockets[0]);
+      for (const auto& worker : workers) {
+        close(worker.socket);
+      }
+      RunWorker(
+          sockets[1],
+          static_cast<uint8_t*>(memory),
+          handoffBytes,
+          modelPath,
+          modelParams,
+          params
+      );
+    }
+
+    close(sockets[1]);
+    Worker worker;
+    worker.pid = pid;
+    worker.socket = sockets[0];
+    worker.memory = static_cast<uint8_t*>(memory);
+    workers.push_back(worker);
+  }
+
+  bool ready = true;
+  for (const auto& worker : workers) {
+    char reply;
+    if (!Receive(worker.socket, reply) || reply != kReady) {
+      const auto* header = reinterpret_cast<const Header*>(worker.memory);
+      LogError(
+          "Prefill worker failed to start",
+          {{"path", modelPath}, {"error", header->error}}
+      );
+      ready = false;
+    }
+  }
+  if (!ready) {
+    Stop();
+    return false;
+  }
+  return true;
+#endif
+}
+
+void PrefillWorkerPool::Stop() {
+#ifndef _WIN32
+  for (const auto& worker : workers) {
+    close(worker.socket);
+    if (worker.busy && !worker.done) {
+      kill(worker.pid, SIGTERM);
+    }
+  }
+  for (const auto& worker : workers) {
+    waitpid(worker.pid, nullptr, 0);
+    munmap(worker.memory, handoffBytes);
+  }
+#endif
+  workers.clear();
+}
+
+std::optional<size_t> PrefillWorkerPool::Idle() const {
+  for (size_t i = 0; i < workers.size(); ++i) {
+    if (!workers[i].busy) {
+      return i;
+    }
+  }
+  return std::nullopt;
+}
+
+bool PrefillWorkerPool::Submit(
+    size_t worker, const std::vector<llama_token>& tokens
+) {
+#ifdef _WIN32
+  return false;
+#else
+  Worker& target = workers[worker];
+  if (sizeof(Header) + tokens.size() * sizeof(llama_token) > handoffBytes) {
+    LogError(
+        "Prompt does not fit the prefill handoff memory",
+        {{"tokens", std::to_string(tokens.size())}}
+    );
+    return false;
+  }
+
+  auto* header = reinterpret_cast<Header*>(target.memory);
+  *header = Header();
+  header->tokens = tokens.size();
+  std::copy(
+      tokens.begin(),
+      tokens.end(),
+      reinterpret_cast<llama_token*>(target.memory + sizeof(Header))
+  );
+  if (!Send(target.socket, kPrefill)) {
+    throw std::runtime_error("Prefill worker exited");
+  }
+  target.busy = true;
+  target.done = false;
+  target.failed = false;
+  return true;
+#endif
+}
+
+std::vector<size_t> PrefillWorkerPool::Completed(bool wait) {
+  std::vector<size_t> completed;
+#ifndef _WIN32
+  std::vector<pollfd> sockets;
+  std::vector<size_t> indices;
+  for (size_t i = 0; i < workers.size(); ++i) {
+    if (workers[i].busy && !workers[i].done) {
+      sockets.push_back({workers[i].socket, POLLIN, 0});
+      indices.push_back(i);
+    }
+  }
+  if (sockets.empty()) {
+    return completed;
+  }
+
+  int ready;
+  do {
+    ready = poll(sockets.data(), sockets.size(), wait ? -1 : 0);
+  } while (ready < 0 && errno == EINTR);
+  if (ready < 0) {
+    throw std::runtime_error("poll() failed on prefill workers");
+  }
+
+  for (size_t i = 0; i < sockets.size(); ++i) {
+    if (sockets[i].revents == 0) {
+      continue;
+    }
+    char reply;
+    if (!Receive(sockets[i].fd, reply)) {
+      throw std::runtime_error("Prefill worker exited");
+    }
+    Worker& worker = workers[indices[i]];
+    worker.done = true;
+    worker.failed = reply != kDone;
+    if (worker.failed) {
+      const auto* header = reinterpret_cast<const Header*>(worker.memory);
+      LogError("Prefill worker failed", {{"error", header->error}});
+    }
+    completed.push_back(indices[i]);
+  }
+#endif
+  return completed;
+}
+
+void PrefillWorkerPool::Drain() {
+  while (!Completed(true).empty()) {
+  }
+  for (auto& worker : workers) {
+    worker.busy = false;
+    worker.done = false;
+  }
+}
+
+bool PrefillWorkerPool::Result(size_t worker, PrefillHandoff& handoff) const {
+  const Worker& source = workers[worker];
+  if (!source.done || source.failed) {
+    return false;
+  }
+
+  const auto* header = reinterpret_cast<const Header*>(source.memory);
+  handoff.logits =
+      reinterpret_cast<const float*>(source.memory + header->logitsOffset);
+  handoff.state = source.memory + header->stateOffset;
+  handoff.stateBytes = header->stateBytes;
+  handoff.seconds = header->seconds;
+  return true;
+}
+
+void PrefillWorkerPool::Release(size_t worker) {
+  workers[worker].busy = false;
+  workers[worker].done = false;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "llama-chat.h"
+
+struct PrefillWorkerParams {
+  int workers = 1;
+  size_t nContext = 16384;  // Longest prompt a worker evaluates
+  int nBatch = 512;
+  int nThreads = 8;
+  size_t handoffBytes = size_t(1) << 30;  // Shared memory per worker
+};
+
+// The state a worker left in its shared memory after evaluating a prompt.
+// Valid until the worker is released.
+struct PrefillHandoff {
+  const float* logits = nullptr;  // Of the last prompt token
+  const uint8_t* state = nullptr;  // llama_state_seq_get_data() of the prompt
+  size_t stateBytes = 0;
+  double seconds = 0.0;  // Spent evaluating the prompt
+};
+
+// Child processes that evaluate prompts with their own copy of the model
+// and hand the resulting sequence state back through shared memory, so
+// prompt evaluation runs on other cores than generation. Each worker has a
+// shared mapping for the prompt, the last logits and the KV state, and a
+// socket to the coordinator that carries one byte per command and reply. A
+// worker exits when the coordinator closes its socket or dies.
+//
+// Workers are forked by Start(), before the coordinator loads its model;
+// GPU backends initialized in the process before that may not survive the
+// fork. Not available on Windows.
+class PrefillWorkerPool {
+ public:
+  PrefillWorkerPool() = default;
+  ~PrefillWorkerPool();
+
+  PrefillWorkerPool(const PrefillWorkerPool&) = delete;
+  PrefillWorkerPool& operator=(const PrefillWorkerPool&) = delete;
+
+  // Starts the workers and waits until each has loaded the model.
+  bool Start(
+      const std::string& modelPath,
+      const ModelParams& modelParams,
+      const PrefillWorkerParams& params
+  );
+  void Stop();
+
+  [[nodiscard]] size_t Size() const { return workers.size(); }
+  [[nodiscard]] std::optional<size_t> Idle() const;
+
+  // Starts evaluating `tokens` on an idle worker. Returns false if they do
+  // not fit its shared memory.
+  bool Submit(size_t worker, const std::vector<llama_token>& tokens);
+
+  // Busy workers that finished; waits for one when `wait` is set. Throws
+  // if a worker exited.
+  std::vector<size_t> Completed(bool wait);
+
+  // The result of a completed worker; false if its prompt failed.
+  bool Result(size_t worker, PrefillHandoff& handoff) const;
+  void Release(size_t worker);
+  // Waits for every busy worker and releases all of them.
+  void Drain();
+
+ private:
+  struct Worker {
+    int pid = -1;
+    int socket = -1;
+    uint8_t* memory = nullptr;
+    bool busy = false;
+    bool done = false;
+    bool failed = false;
+  };
+
+  std::vector<Worker> workers;
+  size_t handoffBytes = 0;
+};
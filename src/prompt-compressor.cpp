@@ -0,0 +1,243 @@
+#include "prompt-compressor.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+#include "common.h"
+#include "logger.h"
+
+PromptCompressor::~PromptCompressor() {
+  if (ctx) {
+    llama_free(ctx);
+  }
+  if (model) {
+    llama_free_model(model);
+  }
+}
+
+bool PromptCompressor::Initialize(
+    const std::string& modelPath, const CompressionParams& compressionParams
+) {
+  params = compressionParams;
+
+  llama_model_params modelParams = llama_model_default_params();
+  modelParams.n_gpu_layers = params.nGpuLayers;
+
+  model = llama_load_model_from_file(modelPath.c_str(), modelParams);
+  if (!model) {
+    LogError("Failed to load compression model", {{"path", modelPath}});
+    return false;
+  }
+
+  llama_context_params ctxParams = llama_context_default_params();
+  ctxParams.n_ctx = params.nContext;
+  ctxParams.n_batch = params.nBatch;
+  ctxParams.n_threads = params.nThreads;
+  ctxParams.n_threads_batch = params.nThreads;
+  ctxParams.embeddings = false;
+
+  ctx = llama_new_context_with_model(model, ctxParams);
+  if (!ctx) {
+    LogError(
+        "Failed to create the compression context",
+        {{"nContext", std::to_string(params.nContext)}}
+    );
+    return false;
+  }
+
+  return true;
+}
+
+std::string PromptCompressor::Compress(
+    const std::string& text, CompressionStats& stats
+) {
+  const std::vector<llama_token> tokens = Tokenize(text);
+  const size_t bos =
+      !tokens.empty() && tokens[0] == llama_token_bos(model) ? 1 : 0;
+  const size_t nTokens = tokens.size() - bos;
+
+  stats.originalTokens += nTokens;
+  if (nTokens < params.minBlockTokens || params.targetRatio >= 1.0f) {
+    stats.compressedTokens += nTokens;
+    return text;
+  }
+
+  const std::vector<float> scores = SelfInformation(tokens);
+
+  std::vector<std::string> pieces;
+  pieces.reserve(nTokens);
+  for (size_t i = bos; i < tokens.size(); ++i) {
+    pieces.push_back(llama_token_to_piece(ctx, tokens[i]));
+  }
+  std::vector<Span> spans =
+      SplitWords(pieces, {scores.begin() + bos, scores.end()});
+
+  // Greedy knapsack on information density. Line breaks are always kept so
+  // the layout of the context survives.
+  const auto budget = static_cast<size_t>(
+      std::ceil(params.targetRatio * static_cast<float>(nTokens))
+  );
+  size_t kept = 0;
+  std::vector<size_t> order(spans.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    if (spans[a].required != spans[b].required) {
+      return spans[a].required;
+    }
+    return spans[a].density > spans[b].density;
+  });
+
+  std::vector<bool> keep(spans.size(), false);
+  for (size_t index : order) {
+    const size_t length = spans[index].end - spans[index].begin;
+    if (spans[index].required || kept + length <= budget) {
+      keep[index] = true;
+      kept += length;
+    }
+  }
+
+  std::string compressed;
+  compressed.reserve(text.size());
+  for (size_t i = 0; i < spans.size(); ++i) {
+    if (keep[i]) {
+      for (size_t t = spans[i].begin; t < spans[i].end; ++t) {
+        compressed += pieces[t];
+      }
+    }
+  }
+
+  stats.compressedTokens += kept;
+  return compressed;
+}
+
+std::vector<llama_token> PromptCompressor::Tokenize(const std::string& text
+) const {
+  std::vector<llama_token> tokens(text.size() + 2);
+  int32_t n = llama_tokenize(
+      model,
+      text.data(),
+      static_cast<int32_t>(text.size()),
+      tokens.data(),
+      static_cast<int32_t>(tokens.size()),
+      true,
+      false
+  );
+  if (n < 0) {
+    throw std::runtime_error("Failed to tokenize context block");
+  }
+  tokens.resize(n);
+  return tokens;
+}
+
+// Scores texts longer than the context in overlapping windows; the overlap
+// only provides context and its tokens are scored by the previous window.
+std::vector<float> PromptCompressor::SelfInformation(
+    const std::vector<llama_token>& tokens
+) {
+  std::vector<float> scores(tokens.size(), 0.0f);
+  if (tokens.empty()) {
+    return scores;
+  }
+
+  // The first token has no context to be predicted from.
+  scores[0] = std::numeric_limits<float>::max();
+
+  const size_t window = llama_n_ctx(ctx);
+  const size_t overlap = window / 8;
+  size_t scored = 1;
+  while (scored < tokens.size()) {
+    const size_t begin = scored > overlap ? scored - overlap : 0;
+    const size_t end = std::min(tokens.size(), begin + window);
+    ScoreWindow(tokens, begin, end, scored, scores);
+    scored = end;
+  }
+
+  return scores;
+}
+
+void PromptCompressor::ScoreWindow(
+    const std::vector<llama_token>& tokens,
+    size_t begin,
+    size_t end,
+    size_t firstScored,
+    std::vector<float>& scores
+) {
+  llama_kv_cache_clear(ctx);
+
+  const auto nBatch = static_cast<size_t>(llama_n_batch(ctx));
+  const int nVocabulary = llama_n_vocab(model);
+  llama_batch batch = llama_batch_init(static_cast<int32_t>(nBatch), 0, 1);
+
+  for (size_t chunk = begin; chunk < end; chunk += nBatch) {
+    const size_t chunkEnd = std::min(end, chunk + nBatch);
+
+    llama_batch_clear(batch);
+    for (size_t i = chunk; i < chunkEnd; ++i) {
+      const bool predictsNext = i + 1 >= firstScored && i + 1 < end;
+      llama_batch_add(
+          batch, tokens[i], static_cast<llama_pos>(i - begin), {0}, predictsNext
+      );
+    }
+    if (llama_decode(ctx, batch) != 0) {
+      llama_batch_free(batch);
+      throw std::runtime_error("llama_decode() failed while compressing");
+    }
+
+    for (size_t i = chunk; i < chunkEnd; ++i) {
+      if (i + 1 < firstScored || i + 1 >= end) {
+        continue;
+      }
+
+      const float* logits =
+          llama_get_logits_ith(ctx, static_cast<int32_t>(i - chunk));
+      const float maxLogit = *std::max_element(logits, logits + nVocabulary);
+      double sum = 0.0;
+      for (int v = 0; v < nVocabulary; ++v) {
+        sum += std::exp(logits[v] - maxLogit);
+      }
+      scores[i + 1] = static_cast<float>(
+          maxLogit + std::log(sum) - logits[tokens[i + 1]]
+      );
+    }
+  }
+
+  llama_batch_free(batch);
+}
+
+// A word starts at a token that begins with whitespace or punctuation, or
+// follows a line break.
+std::vector<PromptCompressor::Span> PromptCompressor::SplitWords(
+    const std::vector<std::string>& pieces, const std::vector<float>& scores
+) {
+  auto startsWord = [&](size_t i) {
+    if (i == 0 || pieces[i].empty()) {
+      return true;
+    }
+    const auto first = static_cast<unsigned char>(pieces[i][0]);
+    const std::string& previous = pieces[i - 1];
+    return std::isspace(first) || std::ispunct(first) ||
+           (!previous.empty() && previous.back() == '\n');
+  };
+
+  std::vector<Span> spans;
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    if (startsWord(i)) {
+      spans.push_back({i, i, 0.0f, false});
+    }
+
+    Span& span = spans.back();
+    span.end = i + 1;
+    span.density += std::min(scores[i], 1e4f);
+    span.required =
+        span.required || pieces[i].find('\n') != std::string::npos;
+  }
+
+  for (auto& span : spans) {
+    span.density /= static_cast<float>(span.end - span.begin);
+  }
+  return spans;
+}
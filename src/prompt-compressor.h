@@ -0,0 +1,53 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llama-chat.h"
+#include "llama.h"
+
+// Shortens retrieved context by dropping its least informative words. Each
+// token is scored by its self-information -log p(token | preceding text)
+// under a small language model, tokens are grouped into words, and the words
+// with the highest information per token are kept, in their original order,
+// up to the target share of the tokens.
+class PromptCompressor {
+ public:
+  PromptCompressor() = default;
+  ~PromptCompressor();
+
+  PromptCompressor(const PromptCompressor&) = delete;
+  PromptCompressor& operator=(const PromptCompressor&) = delete;
+
+  bool Initialize(const std::string& modelPath, const CompressionParams& params);
+
+  // Returns the compressed text and adds its token counts to `stats`.
+  std::string Compress(const std::string& text, CompressionStats& stats);
+
+ private:
+  struct Span {
+    size_t begin;
+    size_t end;
+    float density;  // Mean self-information of its tokens
+    bool required;
+  };
+
+  CompressionParams params;
+  llama_model* model = nullptr;
+  llama_context* ctx = nullptr;
+
+  [[nodiscard]] std::vector<llama_token> Tokenize(const std::string& text
+  ) const;
+  std::vector<float> SelfInformation(const std::vector<llama_token>& tokens);
+  void ScoreWindow(
+      const std::vector<llama_token>& tokens,
+      size_t begin,
+      size_t end,
+      size_t firstScored,
+      std::vector<float>& scores
+  );
+  static std::vector<Span> SplitWords(
+      const std::vector<std::string>& pieces, const std::vector<float>& scores
+  );
+};
@@ -0,0 +1,134 @@
+#include "token-estimator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "vocabulary.h"
+
+namespace {
+
+// Mixed samples so that the fit sees each byte class in several proportions.
+const char* const kCalibrationSamples[] = {
+    "The quick brown fox jumps over the lazy dog. Language models read text "
+    "as tokens, and most common English words map to a single token, while "
+    "rarer words such as photosynthesis or extraordinarily are split up.",
+
+    "int main(int argc, char** argv) {\n"
+    "  for (size_t i = 0; i < items.size(); ++i) {\n"
+    "    if (items[i]->value != nullptr && !flags[i]) {\n"
+    "      total += items[i]->value->Count() * 2;\n"
+    "    }\n"
+    "  }\n"
+    "  return total > 0 ? EXIT_SUCCESS : EXIT_FAILURE;\n"
+    "}\n",
+
+    "2024-06-01 13:45:07, 1234567.89, 42, 3.14159265358979, 0x7fffffff, "
+    "+1 (555) 010-9999, 192.168.0.1, 1e-9, 65536, 100%, 17/04/1999",
+
+    "{\"id\": 1842, \"name\": \"widget\", \"tags\": [\"a\", \"b\"], "
+    "\"price\": 19.99, \"stock\": {\"warehouse\": 12, \"store\": 0}}",
+
+    "Title\n\n    Indented paragraph line one\n    line two\n\n\n"
+    "\t- item\n\t- item\n\n        deeply indented\n",
+
+    "Gr\xc3\xbc\xc3\x9f" "e aus M\xc3\xbcnchen! Caf\xc3\xa9 cr\xc3\xa8me "
+    "br\xc3\xbbl\xc3\xa9" "e. \xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1"
+    "\x82 \xd0\xbc\xd0\xb8\xd1\x80. \xe4\xbd\xa0\xe5\xa5\xbd\xe4\xb8\x96"
+    "\xe7\x95\x8c\xe3\x80\x82 \xf0\x9f\x99\x82",
+};
+
+// Solves the normal equations of a ridge-regularized least-squares fit.
+template <size_t N>
+std::array<double, N> SolveLeastSquares(
+    const std::vector<std::array<double, N>>& rows,
+    const std::vector<double>& targets
+) {
+  double a[N][N + 1] = {};
+  for (size_t r = 0; r < rows.size(); ++r) {
+    for (size_t i = 0; i < N; ++i) {
+      for (size_t j = 0; j < N; ++j) a[i][j] += rows[r][i] * rows[r][j];
+      a[i][N] += rows[r][i] * targets[r];
+    }
+  }
+  for (size_t i = 0; i < N; ++i) a[i][i] += 1e-3;
+
+  for (size_t col = 0; col < N; ++col) {
+    size_t pivot = col;
+    for (size_t row = col + 1; row < N; ++row) {
+      if (std::abs(a[row][col]) > std::abs(a[pivot][col])) pivot = row;
+    }
+    std::swap(a[col], a[pivot]);
+    for (size_t row = 0; row < N; ++row) {
+      if (row == col) continue;
+      const double factor = a[row][col] / a[col][col];
+      for (size_t k = col; k <= N; ++k) a[row][k] -= factor * a[col][k];
+    }
+  }
+
+  std::array<double, N> solution = {};
+  for (size_t i = 0; i < N; ++i) solution[i] = a[i][N] / a[i][i];
+  return solution;
+}
+
+}  // namespace
+
+TokenEstimator::ClassCounts TokenEstimator::CountClasses(std::string_view text
+) {
+  size_t counts[kClasses] = {};
+  for (char c : text) {
+    const auto byte = static_cast<unsigned char>(c);
+    if (byte >= 0x80) {
+      ++counts[kNonAscii];
+    } else if ((byte | 0x20) >= 'a' && (byte | 0x20) <= 'z') {
+      ++counts[kLetter];
+    } else if (byte >= '0' && byte <= '9') {
+      ++counts[kDigit];
+    } else if (byte == ' ' || (byte >= '\t' && byte <= '\r')) {
+      ++counts[kWhitespace];
+    } else {
+      ++counts[kPunctuation];
+    }
+  }
+
+  ClassCounts result = {};
+  for (size_t i = 0; i < kClasses; ++i) {
+    result[i] = static_cast<double>(counts[i]);
+  }
+  return result;
+}
+
+void TokenEstimator::Calibrate(const Vocabulary& vocabulary) {
+  std::vector<ClassCounts> rows;
+  std::vector<double> targets;
+  for (const char* sample : kCalibrationSamples) {
+    rows.push_back(CountClasses(sample));
+    targets.push_back(
+        static_cast<double>(vocabulary.CountTokens(sample, false, false))
+    );
+  }
+
+  auto fitted = SolveLeastSquares(rows, targets);
+  for (size_t i = 0; i < kClasses; ++i) {
+    // A byte never yields more than one token, and every class costs something.
+    rates[i] = std::clamp(fitted[i], 0.05, 1.0);
+  }
+}
+
+TokenEstimate TokenEstimator::Estimate(std::string_view text) const {
+  const ClassCounts counts = CountClasses(text);
+
+  double estimate = 0.0;
+  for (size_t i = 0; i < kClasses; ++i) {
+    estimate += counts[i] * rates[i];
+  }
+
+  TokenEstimate result;
+  // Every token covers at least one byte; the extra two leave room for BOS
+  // and the prefix space or separators some vocabularies add.
+  result.upperBound = text.size() + 2;
+  result.estimate = std::min(
+      result.upperBound, static_cast<size_t>(std::ceil(estimate))
+  );
+  return result;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <array>
+#include <string_view>
+
+#include "llama-chat.h"
+
+class Vocabulary;
+
+// Approximate token counter. Text is reduced to per-class byte counts, and
+// the tokens-per-byte rate of every class is fitted to the vocabulary at load
+// time from a built-in calibration set.
+class TokenEstimator {
+ public:
+  // Fits the per-class rates by tokenizing the calibration set exactly.
+  void Calibrate(const Vocabulary& vocabulary);
+
+  [[nodiscard]] TokenEstimate Estimate(std::string_view text) const;
+
+ private:
+  enum ByteClass { kLetter, kDigit, kWhitespace, kPunctuation, kNonAscii };
+  static constexpr size_t kClasses = 5;
+
+  using ClassCounts = std::array<double, kClasses>;
+
+  // Conservative defaults (about 4 bytes per word token) until calibrated.
+  ClassCounts rates = {0.25, 0.34, 0.25, 0.5, 0.5};
+
+  static ClassCounts CountClasses(std::string_view text);
+};
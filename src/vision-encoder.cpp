@@ -0,0 +1,108 @@
+#include "vision-encoder.h"
+
+#include "llama.h"
+#include "logger.h"
+
+#ifdef LLAMA_CHAT_VISION
+#include "clip.h"
+#include "llava.h"
+#endif
+
+VisionEncoder::~VisionEncoder() {
+#ifdef LLAMA_CHAT_VISION
+  if (clip) {
+    clip_free(clip);
+  }
+#endif
+}
+
+#ifdef LLAMA_CHAT_VISION
+
+bool VisionEncoder::Initialize(
+    const std::string& projectorPath, const llama_model* model
+) {
+  if (clip) {
+    clip_free(clip);
+  }
+
+  clip = clip_model_load(projectorPath.c_str(), 0);
+  if (!clip) {
+    LogError("Failed to load multimodal projector", {{"path", projectorPath}});
+    return false;
+  }
+
+  if (clip_n_mmproj_embd(clip) != llama_n_embd(model)) {
+    LogError(
+        "Multimodal projector does not match the model",
+        {{"projectorEmbd", std::to_string(clip_n_mmproj_embd(clip))},
+         {"modelEmbd", std::to_string(llama_n_embd(model))}}
+    );
+    clip_free(clip);
+    clip = nullptr;
+    return false;
+  }
+
+  return true;
+}
+
+int VisionEncoder::PositionsPerImage() const {
+  return clip ? clip_n_patches(clip) : 0;
+}
+
+std::shared_ptr<const ImageEmbedding> VisionEncoder::Encode(
+    const std::vector<uint8_t>& image, int nThreads
+) const {
+  if (!clip) {
+    return nullptr;
+  }
+
+  llava_image_embed* embed = llava_image_embed_make_with_bytes(
+      clip, nThreads, image.data(), static_cast<int>(image.size())
+  );
+  if (!embed) {
+    LogError("Failed to encode image", {{"bytes", std::to_string(image.size())}});
+    return nullptr;
+  }
+
+  auto embedding = std::make_shared<ImageEmbedding>();
+  embedding->nPositions = embed->n_image_pos;
+  embedding->data.assign(
+      embed->embed,
+      embed->embed + static_cast<size_t>(embed->n_image_pos) *
+                         clip_n_mmproj_embd(clip)
+  );
+  llava_image_embed_free(embed);
+
+  return embedding;
+}
+
+bool VisionEncoder::Evaluate(
+    llama_context* ctx, const ImageEmbedding& embedding, int nBatch, int& nPast
+) {
+  llava_image_embed embed = {
+      const_cast<float*>(embedding.data.data()),
+      embedding.nPositions
+  };
+  return llava_eval_image_embed(ctx, &embed, nBatch, &nPast);
+}
+
+#else
+
+bool VisionEncoder::Initialize(const std::string&, const llama_model*) {
+  LogError("LlamaChat was built without LLAMA_CHAT_VISION");
+  return false;
+}
+
+int VisionEncoder::PositionsPerImage() const { return 0; }
+
+std::shared_ptr<const ImageEmbedding> VisionEncoder::Encode(
+    const std::vector<uint8_t>&, int
+) const {
+  return nullptr;
+}
+
+bool VisionEncoder::Evaluate(llama_context*, const ImageEmbedding&, int, int&) {
+  return false;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image-cache.h"
+
+struct clip_ctx;
+struct llama_context;
+struct llama_model;
+
+// CLIP image encoder from a llava multimodal projector (mmproj) file. Runs on
+// the CPU and produces embeddings that are fed to the language model in place
+// of tokens. Only functional when built with LLAMA_CHAT_VISION.
+class VisionEncoder {
+ public:
+  VisionEncoder() = default;
+  ~VisionEncoder();
+
+  VisionEncoder(const VisionEncoder&) = delete;
+  VisionEncoder& operator=(const VisionEncoder&) = delete;
+
+  bool Initialize(const std::string& projectorPath, const llama_model* model);
+
+  // Embedding positions a typical image occupies, for prompt budgeting.
+  [[nodiscard]] int PositionsPerImage() const;
+
+  [[nodiscard]] std::shared_ptr<const ImageEmbedding> Encode(
+      const std::vector<uint8_t>& image, int nThreads
+  ) const;
+
+  // Decodes the embedding into sequence 0 starting at `nPast`.
+  static bool Evaluate(
+      llama_context* ctx, const ImageEmbedding& embedding, int nBatch,
+      int& nPast
+  );
+
+ private:
+  clip_ctx* clip = nullptr;
+};
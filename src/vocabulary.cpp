@@ -0,0 +1,134 @@
+#include "vocabulary.h"
+
+#include <algorithm>
+
+#include "llama.h"
+#include "logger.h"
+
+void Vocabulary::Initialize(
+    const llama_model* llamaModel,
+    const std::string& modelPath,
+    const ModelParams& params
+) {
+  model = llamaModel;
+
+  // FNV-1a over the token texts, each terminated by a zero byte.
+  fingerprint = 0xcbf29ce484222325ull;
+  const int nVocabulary = llama_n_vocab(model);
+  for (llama_token token = 0; token < nVocabulary; ++token) {
+    const char* text = llama_token_get_text(model, token);
+    for (; *text; ++text) {
+      fingerprint = (fingerprint ^ static_cast<uint8_t>(*text)) *
+                    0x100000001b3ull;
+    }
+    fingerprint *= 0x100000001b3ull;
+  }
+
+  tokenizer.reset();
+  if (params.useNativeTokenizer) {
+    auto nativeTokenizer = std::make_unique<BpeTokenizer>();
+    if (nativeTokenizer->Initialize(
+            model, modelPath, params.tokenizerCacheSize
+        )) {
+      tokenizer = std::move(nativeTokenizer);
+    }
+  }
+
+  estimator.Calibrate(*this);
+}
+
+bool Vocabulary::Tokenize(
+    std::string_view text,
+    bool addBos,
+    bool parseSpecial,
+    std::vector<llama_token>& tokens
+) const {
+  if (tokenizer) {
+    tokenizer->Encode(text, addBos, parseSpecial, tokens);
+    return true;
+  }
+
+  const size_t offset = tokens.size();
+  const int maxTokens = static_cast<int>(text.length()) + (addBos ? 1 : 0);
+  tokens.resize(offset + maxTokens);
+
+  const int nTokens = llama_tokenize(
+      model,
+      text.data(),
+      static_cast<int>(text.length()),
+      tokens.data() + offset,
+      maxTokens,
+      addBos,
+      parseSpecial
+  );
+
+  if (nTokens < 0) {
+    LogError(
+        "Tokenization failed", {{"errorCode", std::to_string(nTokens)}}
+    );
+    tokens.resize(offset);
+    return false;
+  }
+
+  tokens.resize(offset + nTokens);
+  return true;
+}
+
+std::vector<LlamaToken> Vocabulary::Encode(
+    std::string_view text, bool addBos, bool parseSpecial
+) const {
+  std::vector<llama_token> llamaTokens;
+  llamaTokens.reserve(text.length() / 3 + 2);
+  if (!Tokenize(text, addBos, parseSpecial, llamaTokens)) {
+    return {};
+  }
+
+  std::vector<LlamaToken> tokens;
+  tokens.reserve(llamaTokens.size());
+  for (auto token : llamaTokens) {
+    tokens.emplace_back(token);
+  }
+
+  return tokens;
+}
+
+size_t Vocabulary::CountTokens(
+    std::string_view text, bool addBos, bool parseSpecial
+) const {
+  thread_local std::vector<llama_token> llamaTokens;
+  llamaTokens.clear();
+  Tokenize(text, addBos, parseSpecial, llamaTokens);
+  return llamaTokens.size();
+}
+
+std::string Vocabulary::Decode(const std::vector<LlamaToken>& tokens) const {
+  std::string text;
+  std::vector<char> piece(64);
+  for (const auto& token : tokens) {
+    int nChars = llama_token_to_piece(
+        model,
+        token.tokenId,
+        piece.data(),
+        static_cast<int>(piece.size()),
+        0,
+        true
+    );
+    if (nChars < 0) {
+      piece.resize(-nChars);
+      nChars = llama_token_to_piece(
+          model,
+          token.tokenId,
+          piece.data(),
+          static_cast<int>(piece.size()),
+          0,
+          true
+      );
+    }
+    text.append(piece.data(), std::max(nChars, 0));
+  }
+  return text;
+}
+
+TokenizerCacheStats Vocabulary::GetCacheStats() const {
+  return tokenizer ? tokenizer->GetCacheStats() : TokenizerCacheStats{};
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bpe-tokenizer.h"
+#include "llama-chat.h"
+#include "token-estimator.h"
+
+struct llama_model;
+
+// Text <-> token conversion for a loaded model. Uses the native BPE tokenizer
+// when the vocabulary supports it and llama_tokenize otherwise. All const
+// methods are safe to call from several threads at once.
+class Vocabulary {
+ public:
+  void Initialize(
+      const llama_model* model,
+      const std::string& modelPath,
+      const ModelParams& params
+  );
+
+  // Appends the tokens of `text`; returns false if tokenization failed.
+  bool Tokenize(
+      std::string_view text,
+      bool addBos,
+      bool parseSpecial,
+      std::vector<llama_token>& tokens
+  ) const;
+
+  [[nodiscard]] std::vector<LlamaToken> Encode(
+      std::string_view text, bool addBos, bool parseSpecial
+  ) const;
+  [[nodiscard]] size_t CountTokens(
+      std::string_view text, bool addBos, bool parseSpecial
+  ) const;
+  [[nodiscard]] std::string Decode(const std::vector<LlamaToken>& tokens) const;
+
+  [[nodiscard]] TokenEstimate EstimateTokens(std::string_view text) const {
+    return estimator.Estimate(text);
+  }
+
+  [[nodiscard]] TokenizerCacheStats GetCacheStats() const;
+
+  // Hash of every token's text, equal for models sharing a vocabulary.
+  [[nodiscard]] uint64_t Fingerprint() const { return fingerprint; }
+
+ private:
+  const llama_model* model = nullptr;
+  uint64_t fingerprint = 0;
+  std::unique_ptr<BpeTokenizer> tokenizer;
+  TokenEstimator estimator;
+};
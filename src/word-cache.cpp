@@ -0,0 +1,67 @@
+#include "word-cache.h"
+
+#include <algorithm>
+#include <functional>
+
+WordCache::WordCache(size_t capacity)
+    : shardCapacity(std::max<size_t>(1, capacity / kShards)) {}
+
+WordCache::Shard& WordCache::ShardFor(std::string_view word) {
+  const size_t hash = std::hash<std::string_view>{}(word);
+  return shards[(hash >> 7) % kShards];
+}
+
+bool WordCache::Lookup(
+    std::string_view word, std::vector<llama_token>& tokens
+) {
+  Shard& shard = ShardFor(word);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  auto it = shard.index.find(word);
+  if (it == shard.index.end()) {
+    misses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+  const auto& cached = it->second->tokens;
+  tokens.insert(tokens.end(), cached.begin(), cached.end());
+  hits.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void WordCache::Insert(
+    std::string_view word, const llama_token* tokens, size_t count
+) {
+  if (word.size() > kMaxWordLength) {
+    return;
+  }
+
+  Shard& shard = ShardFor(word);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  if (shard.index.count(word) != 0) {
+    return;
+  }
+
+  shard.entries.push_front({std::string(word), {tokens, tokens + count}});
+  shard.index.emplace(shard.entries.front().word, shard.entries.begin());
+
+  if (shard.entries.size() > shardCapacity) {
+    shard.index.erase(shard.entries.back().word);
+    shard.entries.pop_back();
+    evictions.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+TokenizerCacheStats WordCache::GetStats() const {
+  TokenizerCacheStats stats;
+  stats.hits = hits.load(std::memory_order_relaxed);
+  stats.misses = misses.load(std::memory_order_relaxed);
+  stats.evictions = evictions.load(std::memory_order_relaxed);
+  for (const auto& shard : shards) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    stats.entries += shard.entries.size();
+  }
+  return stats;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "llama-chat.h"
+
+// Bounded, thread-safe word -> tokens memo for the BPE tokenizer. Entries are
+// spread over independently locked shards, each evicting its least recently
+// used word, so concurrent Encode calls rarely contend on the same lock.
+class WordCache {
+ public:
+  // Words longer than this rarely repeat and are not cached.
+  static constexpr size_t kMaxWordLength = 64;
+
+  explicit WordCache(size_t capacity);
+
+  WordCache(const WordCache&) = delete;
+  WordCache& operator=(const WordCache&) = delete;
+
+  // Appends the cached tokens of `word` and returns true on a hit.
+  bool Lookup(std::string_view word, std::vector<llama_token>& tokens);
+  void Insert(std::string_view word, const llama_token* tokens, size_t count);
+
+  [[nodiscard]] TokenizerCacheStats GetStats() const;
+
+ private:
+  static constexpr size_t kShards = 32;
+
+  struct Entry {
+    std::string word;
+    std::vector<llama_token> tokens;
+  };
+
+  struct Shard {
+    mutable std::mutex mutex;
+    std::list<Entry> entries;  // Most recently used first
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+  };
+
+  size_t shardCapacity;
+  Shard shards[kShards];
+
+  std::atomic<size_t> hits{0};
+  std::atomic<size_t> misses{0};
+  std::atomic<size_t> evictions{0};
+
+  Shard& ShardFor(std::string_view word);
+};
@@ -0,0 +1,121 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "llama-batch.h"
+#include "llama-corpus.h"
+#include "request-file.h"
+
+// Generates a response for every request in a file and writes the results
+// as an Arrow IPC stream in input order. Requests run sorted by prompt, so
+// prompts sharing a prefix reuse its KV cache.
+//
+// usage: batch-generate <model.gguf> <requests.tsv> <results.arrow>
+//                       [max-tokens] [rows-per-batch]
+//
+// Each line of requests.tsv is "<id>\t<prompt>"; \n, \t and \\ in the
+// prompt are unescaped. A file ending in .corpus is read as a TokenCorpus
+// written by tokenize-corpus, and its prompts are not tokenized again.
+
+namespace {
+
+bool ReadRequests(
+    const std::string& path, std::vector<BatchRequest>& requests
+) {
+  RequestFile file;
+  if (!file.Open(path)) {
+    return false;
+  }
+
+  RequestLine request;
+  while (file.Next(request)) {
+    requests.push_back({request.id, request.prompt});
+  }
+  return true;
+}
+
+bool ReadCorpus(
+    const TokenCorpus& corpus,
+    const LlamaChat& chat,
+    std::vector<BatchRequest>& requests
+) {
+  if (corpus.GetVocabularyFingerprint() !=
+      chat.GetModelInfo().vocabularyFingerprint) {
+    std::cerr << "The corpus was tokenized for a different vocabulary"
+              << std::endl;
+    return false;
+  }
+
+  requests.reserve(corpus.Size());
+  for (size_t i = 0; i < corpus.Size(); ++i) {
+    requests.push_back({std::string(corpus.Id(i)), "", corpus.Tokens(i)});
+  }
+  return true;
+}
+
+bool EndsWith(const std::string& text, const std::string& suffix) {
+  return text.size() >= suffix.size() &&
+         text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 4) {
+    std::cerr << "usage: " << argv[0]
+              << " <model.gguf> <requests.tsv> <results.arrow> [max-tokens]"
+                 " [rows-per-batch]"
+              << std::endl;
+    return 1;
+  }
+
+  LlamaChat chat;
+  if (!chat.InitializeModel(argv[1], ModelParams()) ||
+      !chat.InitializeContext(ContextParams())) {
+    return 1;
+  }
+
+  const std::string input = argv[2];
+  TokenCorpus corpus;
+  std::vector<BatchRequest> requests;
+  if (EndsWith(input, ".corpus")
+          ? !corpus.Open(input) || !ReadCorpus(corpus, chat, requests)
+          : !ReadRequests(input, requests)) {
+    return 1;
+  }
+
+  SamplingParams samplingParams;
+  if (argc > 4) {
+    samplingParams.maxTokens = std::stoul(argv[4]);
+  }
+  chat.SetSamplingParams(samplingParams);
+
+  BatchParams params;
+  params.arrowPath = argv[3];
+  if (argc > 5) {
+    params.rowsPerRecordBatch = std::stoul(argv[5]);
+  }
+
+  BatchGenerator generator(chat);
+  if (!generator.Open(params)) {
+    return 1;
+  }
+
+  // Sorted by prompt internally, so shared prefixes are evaluated once. Rows
+  // are written as requests finish, so results are not kept here.
+  generator.GenerateAll(requests, BatchGenerator::ResultCallback());
+  const bool closed = generator.Close();
+
+  const BatchStats stats = generator.GetStats();
+  std::cout << "requests:       " << stats.requests << "\n"
+            << "failed:         " << stats.failed << "\n"
+            << "tokens:         " << stats.generatedTokens << "\n"
+            << "prompt tokens:  " << stats.promptTokens << " ("
+            << 100.0 * stats.PromptReuse() << "% reused)\n"
+            << "tokens/s:       " << stats.generatedTokens / stats.seconds
+            << "\n"
+            << "record batches: " << stats.recordBatches << "\n"
+            << "bytes written:  " << stats.bytesWritten << std::endl;
+
+  return closed && stats.failed == 0 ? 0 : 1;
+}
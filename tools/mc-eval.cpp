@@ -0,0 +1,144 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "llama-eval.h"
+#include "request-file.h"
+
+// Evaluates a model on a multiple-choice dataset and reports accuracy,
+// throughput and wall time.
+//
+// usage: mc-eval <model.gguf> <dataset.tsv> [max-choices] [gpu-layers]
+//
+// Each line of dataset.tsv is "<answer>\t<question>\t<choice>\t<choice>...",
+// where <answer> is the 0-based index of the correct choice. Choices are
+// scored as continuations of the question after a space; \n, \t and \\ are
+// unescaped.
+
+namespace {
+
+struct Question {
+  size_t answer;
+  std::string text;
+  std::vector<std::string> choices;
+};
+
+bool ReadDataset(const std::string& path, std::vector<Question>& questions) {
+  std::ifstream file(path);
+  if (!file) {
+    std::cerr << "Failed to open " << path << std::endl;
+    return false;
+  }
+
+  std::string line;
+  size_t number = 0;
+  while (std::getline(file, line)) {
+    ++number;
+    std::vector<std::string> columns;
+    std::stringstream stream(line);
+    std::string column;
+    while (std::getline(stream, column, '\t')) {
+      columns.push_back(Unescape(column));
+    }
+    if (columns.size() < 4) {
+      continue;
+    }
+
+    Question question;
+    question.answer = std::stoul(columns[0]);
+    question.text = columns[1];
+    for (size_t i = 2; i < columns.size(); ++i) {
+      question.choices.push_back(" " + columns[i]);
+    }
+    if (question.answer >= question.choices.size()) {
+      std::cerr << "Answer out of range on line " << number << std::endl;
+      return false;
+    }
+    questions.push_back(std::move(question));
+  }
+  return true;
+}
+
+size_t Best(const std::vector<ChoiceScore>& scores, bool normalized) {
+  size_t best = 0;
+  for (size_t i = 1; i < scores.size(); ++i) {
+    const float score =
+        normalized ? scores[i].Normalized() : scores[i].logprob;
+    const float bestScore =
+        normalized ? scores[best].Normalized() : scores[best].logprob;
+    if (score > bestScore) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0]
+              << " <model.gguf> <dataset.tsv> [max-choices] [gpu-layers]"
+              << std::endl;
+    return 1;
+  }
+
+  std::vector<Question> questions;
+  if (!ReadDataset(argv[2], questions) || questions.empty()) {
+    return 1;
+  }
+
+  ModelParams modelParams;
+  if (argc > 4) {
+    modelParams.nGpuLayers = std::stoi(argv[4]);
+  }
+  ScorerParams params;
+  if (argc > 3) {
+    params.maxChoices = std::stoi(argv[3]);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  ChoiceScorer scorer;
+  if (!scorer.Initialize(argv[1], modelParams, params)) {
+    return 1;
+  }
+  auto loaded = std::chrono::steady_clock::now();
+
+  size_t correct = 0;
+  size_t correctNormalized = 0;
+  size_t skipped = 0;
+  std::vector<ChoiceScore> scores;
+  for (const auto& question : questions) {
+    if (!scorer.Score(question.text, question.choices, scores)) {
+      ++skipped;
+      continue;
+    }
+    correct += Best(scores, false) == question.answer;
+    correctNormalized += Best(scores, true) == question.answer;
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  const ScorerStats stats = scorer.GetStats();
+  const double scored = static_cast<double>(stats.questions);
+  const double wallSeconds = std::chrono::duration<double>(end - start).count();
+  const double loadSeconds =
+      std::chrono::duration<double>(loaded - start).count();
+
+  std::cout << "questions:     " << stats.questions << " (" << skipped
+            << " skipped)\n"
+            << "accuracy:      " << 100.0 * correct / scored << "%\n"
+            << "accuracy/norm: " << 100.0 * correctNormalized / scored
+            << "%\n"
+            << "tokens:        " << stats.evaluatedTokens << " evaluated, "
+            << stats.sharedTokens << " shared\n"
+            << "throughput:    " << stats.TokensPerSecond() << " tokens/s, "
+            << scored / stats.seconds << " questions/s\n"
+            << "wall time:     " << wallSeconds << " s (" << loadSeconds
+            << " s loading)" << std::endl;
+
+  return skipped == 0 ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "llama-parallel.h"
+#include "request-file.h"
+
+// Generates a response for every request in a file with several requests
+// decoding at once, and reports throughput, how full the slots were and the
+// longest step, which bounds the delay between two tokens of a request.
+//
+// usage: parallel-generate <model.gguf> <requests.tsv> [slots] [max-tokens]
+//                          [context] [step-tokens] [prefill-workers]
+//                          [results.tsv]
+//
+// Each line of requests.tsv is "<id>\t<prompt>" with an optional third
+// field giving the expected response length in tokens; \n, \t and \\ in the
+// prompt are unescaped. Results are written as "<id>\t<response>" lines,
+// escaped the same way.
+
+namespace {
+
+bool ReadRequests(
+    const std::string& path, std::vector<BatchRequest>& requests
+) {
+  RequestFile file;
+  if (!file.Open(path)) {
+    return false;
+  }
+
+  RequestLine line;
+  while (file.Next(line)) {
+    BatchRequest request;
+    request.id = line.id;
+    request.prompt = line.prompt;
+    if (!line.rest.empty()) {
+      request.expectedTokens = std::stoul(line.rest);
+    }
+    requests.push_back(std::move(request));
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0]
+              << " <model.gguf> <requests.tsv> [slots] [max-tokens] [context]"
+                 " [step-tokens] [prefill-workers] [results.tsv]"
+              << std::endl;
+    return 1;
+  }
+
+  std::vector<BatchRequest> requests;
+  if (!ReadRequests(argv[2], requests)) {
+    return 1;
+  }
+
+  ParallelParams params;
+  if (argc > 3) {
+    params.nSlots = std::stoi(argv[3]);
+  }
+  SamplingParams samplingParams;
+  if (argc > 4) {
+    samplingParams.maxTokens = std::stoul(argv[4]);
+  }
+  if (argc > 5) {
+    params.nContext = std::stoul(argv[5]);
+  }
+  if (argc > 6) {
+    params.stepTokens = std::stoi(argv[6]);
+  }
+  if (argc > 7) {
+    params.prefillWorkers = std::stoi(argv[7]);
+  }
+
+  ParallelGenerator generator;
+  if (!generator.Initialize(argv[1], ModelParams(), params)) {
+    return 1;
+  }
+  generator.SetSamplingParams(samplingParams);
+
+  std::vector<BatchResult> results;
+  const bool generated = generator.Generate(requests, results);
+
+  if (argc > 8) {
+    std::ofstream output(argv[8]);
+    for (const auto& result : results) {
+      output << result.id << '\t' << Escape(result.text) << '\n';
+    }
+    if (!output) {
+      std::cerr << "Failed to write " << argv[8] << std::endl;
+      return 1;
+    }
+  }
+
+  const ParallelStats stats = generator.GetStats();
+  std::cout << "requests:         " << stats.requests << "\n"
+            << "failed:           " << stats.failed << "\n"
+            << "prompt tokens:    " << stats.promptTokens << "\n"
+            << "tokens:           " << stats.generatedTokens << "\n"
+            << "tokens/s:         " << stats.TokensPerSecond() << "\n"
+            << "decodes:          " << stats.decodes << "\n"
+            << "slot utilization: " << 100.0 * stats.SlotUtilization()
+            << "%\n"
+            << "mixed steps:      " << stats.mixedSteps << " of "
+            << stats.steps << "\n"
+            << "max step ms:      " << 1000.0 * stats.maxStepSeconds << "\n"
+            << "handoffs:         " << stats.handoffs << " ("
+            << stats.handoffBytes << " bytes, " << stats.handoffSeconds
+            << " s)\n"
+            << "fallbacks:        " << stats.handoffFallbacks << "\n"
+            << "busy slots per step:\n";
+  for (size_t busy = 1; busy < stats.occupancy.size(); ++busy) {
+    std::cout << "  " << busy << ": " << stats.occupancy[busy] << "\n";
+  }
+  std::cout << std::flush;
+
+  return generated ? 0 : 1;
+}
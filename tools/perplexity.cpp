@@ -0,0 +1,86 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "llama-eval.h"
+
+// Measures the strided perplexity of a model on a text file and reports
+// throughput and wall time.
+//
+// usage: perplexity <model.gguf> <text.txt> [window] [stride] [parallel]
+//                   [threads] [gpu-layers]
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0]
+              << " <model.gguf> <text.txt> [window] [stride] [parallel]"
+                 " [threads] [gpu-layers]"
+              << std::endl;
+    return 1;
+  }
+
+  std::ifstream file(argv[2], std::ios::binary);
+  if (!file) {
+    std::cerr << "Failed to open " << argv[2] << std::endl;
+    return 1;
+  }
+  std::stringstream text;
+  text << file.rdbuf();
+
+  PerplexityParams params;
+  if (argc > 3) {
+    params.window = std::stoul(argv[3]);
+    params.stride = params.window / 2;
+  }
+  if (argc > 4) {
+    params.stride = std::stoul(argv[4]);
+  }
+  if (argc > 5) {
+    params.parallelWindows = std::stoi(argv[5]);
+  }
+  if (argc > 6) {
+    params.nThreads = std::stoi(argv[6]);
+  }
+  ModelParams modelParams;
+  if (argc > 7) {
+    modelParams.nGpuLayers = std::stoi(argv[7]);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  PerplexityEvaluator evaluator;
+  if (!evaluator.Initialize(argv[1], modelParams, params)) {
+    return 1;
+  }
+  auto loaded = std::chrono::steady_clock::now();
+
+  PerplexityResult result;
+  const bool evaluated = evaluator.Evaluate(
+      text.str(), result, [](const PerplexityResult& running) {
+        std::cerr << "\r" << running.windows << " windows, ppl "
+                  << running.perplexity << std::flush;
+      }
+  );
+  std::cerr << std::endl;
+  if (!evaluated) {
+    return 1;
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  const double wallSeconds = std::chrono::duration<double>(end - start).count();
+  const double loadSeconds =
+      std::chrono::duration<double>(loaded - start).count();
+
+  std::cout << "windows:    " << result.windows << " of " << params.window
+            << " tokens, stride " << params.stride << "\n"
+            << "tokens:     " << result.evaluatedTokens << " evaluated, "
+            << result.scoredTokens << " scored\n"
+            << "perplexity: " << result.perplexity << "\n"
+            << "throughput: " << result.TokensPerSecond() << " tokens/s\n"
+            << "wall time:  " << wallSeconds << " s (" << loadSeconds
+            << " s loading)" << std::endl;
+
+  return 0;
+}
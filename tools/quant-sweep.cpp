@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "chat-format.h"
+#include "llama-chat.h"
+#include "llama-eval.h"
+#include "request-file.h"
+
+// Compares quantized variants of a model against a reference (usually the
+// highest-precision variant) on a fixed prompt suite, on the CPU: load time,
+// memory, prefill and decode throughput, agreement of the greedy outputs
+// with the reference, and perplexity of the reference outputs.
+//
+// usage: quant-sweep <prompts.txt> <max-tokens> <threads> <reference.gguf>
+//                    [variant.gguf ...]
+//
+// prompts.txt holds one prompt per line; \n, \t and \\ are unescaped.
+
+namespace {
+
+struct Run {
+  std::string path;
+  ModelInfo info;
+  double loadSeconds = 0.0;
+  size_t kvBytes = 0;
+  size_t promptTokens = 0;
+  double promptSeconds = 0.0;
+  size_t generatedTokens = 0;
+  double generationSeconds = 0.0;
+  std::vector<std::vector<llama_token>> outputs;
+  std::vector<std::string> texts;
+  double logprob = 0.0;
+  size_t scoredTokens = 0;
+};
+
+bool Generate(
+    Run& run,
+    const std::vector<std::string>& prompts,
+    size_t maxTokens,
+    int threads
+) {
+  auto start = std::chrono::steady_clock::now();
+
+  LlamaChat chat;
+  ContextParams contextParams;
+  contextParams.nThreads = threads;
+  if (!chat.InitializeModel(run.path, ModelParams()) ||
+      !chat.InitializeContext(contextParams)) {
+    return false;
+  }
+
+  auto loaded = std::chrono::steady_clock::now();
+  run.loadSeconds = std::chrono::duration<double>(loaded - start).count();
+  run.info = chat.GetModelInfo();
+
+  // Greedy decoding, so differences come from the weights alone.
+  SamplingParams samplingParams;
+  samplingParams.maxTokens = maxTokens;
+  samplingParams.topK = 1;
+  chat.SetSamplingParams(samplingParams);
+
+  for (const auto& prompt : prompts) {
+    chat.ResetConversation();
+
+    std::vector<llama_token> tokens;
+    std::string text;
+    chat.PromptTokens(prompt, [&](const GeneratedToken& token) {
+      tokens.push_back(token.token.tokenId);
+      text += token.piece;
+    });
+
+    const GenerationStats stats = chat.GetLastGenerationStats();
+    run.promptTokens += stats.promptTokens;
+    run.promptSeconds += stats.promptSeconds;
+    run.generatedTokens += stats.generatedTokens;
+    run.generationSeconds += stats.generationSeconds;
+    run.kvBytes = std::max(run.kvBytes, chat.GetMemoryUsage().kvBytes);
+    run.outputs.push_back(std::move(tokens));
+    run.texts.push_back(std::move(text));
+  }
+  return true;
+}
+
+// Scores the reference outputs where they were generated: after the
+// prompt's user turn and the assistant header, as LlamaChat formats them.
+bool Perplexity(
+    Run& run,
+    const std::vector<std::string>& prompts,
+    const std::vector<std::string>& references,
+    int threads
+) {
+  ScorerParams params;
+  params.nThreads = threads;
+  params.maxChoices = 1;
+  params.parseSpecial = true;
+
+  ChoiceScorer scorer;
+  if (!scorer.Initialize(run.path, ModelParams(), params)) {
+    return false;
+  }
+
+  std::vector<ChoiceScore> scores;
+  for (size_t i = 0; i < prompts.size(); ++i) {
+    const std::string prefix = kBeginOfText + FormatTurn("user", prompts[i]) +
+                               TurnHeader("assistant");
+    if (references[i].empty() ||
+        !scorer.Score(prefix, {references[i]}, scores) ||
+        scores[0].nTokens == 0) {
+      continue;
+    }
+    run.logprob += scores[0].logprob;
+    run.scoredTokens += scores[0].nTokens;
+  }
+  return true;
+}
+
+// Share of the reference tokens reproduced before the outputs diverge.
+double Agreement(
+    const std::vector<llama_token>& output,
+    const std::vector<llama_token>& reference
+) {
+  if (reference.empty()) {
+    return output.empty() ? 1.0 : 0.0;
+  }
+  size_t same = 0;
+  while (same < output.size() && same < reference.size() &&
+         output[same] == reference[same]) {
+    ++same;
+  }
+  return static_cast<double>(same) / static_cast<double>(reference.size());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 5) {
+    std::cerr << "usage: " << argv[0]
+              << " <prompts.txt> <max-tokens> <threads> <reference.gguf>"
+                 " [variant.gguf ...]"
+              << std::endl;
+    return 1;
+  }
+
+  RequestFile file;
+  if (!file.Open(argv[1])) {
+    return 1;
+  }
+  std::vector<std::string> prompts;
+  std::string prompt;
+  while (file.NextPrompt(prompt)) {
+    prompts.push_back(prompt);
+  }
+
+  const size_t maxTokens = std::stoul(argv[2]);
+  const int threads = std::stoi(argv[3]);
+
+  std::vector<Run> runs;
+  for (int i = 4; i < argc; ++i) {
+    Run run;
+    run.path = argv[i];
+    std::cerr << "Running " << run.path << std::endl;
+    if (!Generate(run, prompts, maxTokens, threads)) {
+      std::cerr << "Failed to run " << run.path << std::endl;
+      return 1;
+    }
+    runs.push_back(std::move(run));
+  }
+
+  const Run& reference = runs.front();
+  for (auto& run : runs) {
+    if (!Perplexity(run, prompts, reference.texts, threads)) {
+      std::cerr << "Failed to score " << run.path << std::endl;
+      return 1;
+    }
+  }
+
+  const double referencePerplexity = std::exp(
+      -reference.logprob / std::max<size_t>(reference.scoredTokens, 1)
+  );
+  constexpr double kMiB = 1 << 20;
+
+  std::cout << std::fixed << std::setprecision(2) << std::left
+            << std::setw(40) << "model" << std::right << std::setw(10)
+            << "weights" << std::setw(9) << "kv" << std::setw(8) << "load"
+            << std::setw(10) << "prefill" << std::setw(9) << "decode"
+            << std::setw(8) << "exact" << std::setw(8) << "agree"
+            << std::setw(9) << "ppl" << std::setw(9) << "dppl" << "\n"
+            << std::left << std::setw(40) << "" << std::right
+            << std::setw(10) << "MiB" << std::setw(9) << "MiB"
+            << std::setw(8) << "s" << std::setw(10) << "tok/s"
+            << std::setw(9) << "tok/s" << std::setw(8) << "%"
+            << std::setw(8) << "%" << std::setw(9) << "" << std::setw(9)
+            << "%" << "\n";
+
+  for (const auto& run : runs) {
+    size_t exact = 0;
+    double agreement = 0.0;
+    for (size_t i = 0; i < prompts.size(); ++i) {
+      exact += run.outputs[i] == reference.outputs[i];
+      agreement += Agreement(run.outputs[i], reference.outputs[i]);
+    }
+
+    const double perplexity =
+        std::exp(-run.logprob / std::max<size_t>(run.scoredTokens, 1));
+    const std::string name =
+        run.info.description.empty() ? run.path : run.info.description;
+
+    std::cout << std::left << std::setw(40) << name.substr(0, 39)
+              << std::right << std::setw(10) << run.info.sizeBytes / kMiB
+              << std::setw(9) << run.kvBytes / kMiB << std::setw(8)
+              << run.loadSeconds << std::setw(10)
+              << run.promptTokens / run.promptSeconds << std::setw(9)
+              << run.generatedTokens / run.generationSeconds << std::setw(8)
+              << 100.0 * exact / prompts.size() << std::setw(8)
+              << 100.0 * agreement / prompts.size() << std::setw(9)
+              << perplexity << std::setw(9)
+              << 100.0 * (perplexity / referencePerplexity - 1.0) << "\n";
+  }
+  std::cout << std::flush;
+
+  return 0;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// Request files of the tools: one request per line, "<id>\t<prompt>" with
+// optional further tab-separated fields. \n, \t and \\ in the prompt are
+// escaped, so a request is always one line.
+
+inline std::string Unescape(const std::string& text) {
+  std::string result;
+  result.reserve(text.size());
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] != '\\' || i + 1 == text.size()) {
+      result += text[i];
+      continue;
+    }
+    switch (text[++i]) {
+      case 'n':
+        result += '\n';
+        break;
+      case 't':
+        result += '\t';
+        break;
+      default:
+        result += text[i];
+    }
+  }
+  return result;
+}
+
+inline std::string Escape(const std::string& text) {
+  std::string result;
+  result.reserve(text.size());
+  for (char c : text) {
+    switch (c) {
+      case '\n':
+        result += "\\n";
+        break;
+      case '\t':
+        result += "\\t";
+        break;
+      case '\\':
+        result += "\\\\";
+        break;
+      default:
+        result += c;
+    }
+  }
+  return result;
+}
+
+struct RequestLine {
+  std::string id;
+  std::string prompt;  // Unescaped
+  std::string rest;    // Fields after the prompt, as written; empty if none
+};
+
+// Reads a request file line by line, so it never has to fit in memory.
+class RequestFile {
+ public:
+  bool Open(const std::string& path) {
+    file.open(path);
+    if (!file) {
+      std::cerr << "Failed to open " << path << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // The next "<id>\t<prompt>" line; lines without a tab are skipped.
+  bool Next(RequestLine& request) {
+    std::string line;
+    while (std::getline(file, line)) {
+      const size_t tab = line.find('\t');
+      if (tab == std::string::npos) {
+        continue;
+      }
+      const size_t rest = line.find('\t', tab + 1);
+      request.id = line.substr(0, tab);
+      request.prompt = Unescape(line.substr(tab + 1, rest - tab - 1));
+      request.rest = rest == std::string::npos ? "" : line.substr(rest + 1);
+      return true;
+    }
+    return false;
+  }
+
+  // The next non-empty line as a prompt, for files without IDs.
+  bool NextPrompt(std::string& prompt) {
+    std::string line;
+    while (std::getline(file, line)) {
+      if (!line.empty()) {
+        prompt = Unescape(line);
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  std::ifstream file;
+};
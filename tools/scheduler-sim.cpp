@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llama-scheduler.h"
+
+// Replays a request trace through a single generation server under FIFO and
+// shortest-expected-first scheduling and compares request latencies.
+//
+// usage: scheduler-sim <trace.csv | synthetic> [decode-tok/s] [prefill-tok/s]
+//
+// Trace lines: arrival_seconds,class,max_tokens,prompt_tokens,output_tokens
+
+namespace {
+
+struct TraceRequest {
+  double arrival;
+  std::string requestClass;
+  size_t maxTokens;
+  size_t promptTokens;
+  size_t outputTokens;
+};
+
+struct Result {
+  double mean = 0.0;
+  double p50 = 0.0;
+  double p99 = 0.0;
+  double max = 0.0;
+  double maxWait = 0.0;
+};
+
+bool LoadTrace(const std::string& path, std::vector<TraceRequest>& trace) {
+  std::ifstream file(path);
+  if (!file) {
+    std::cerr << "Failed to open " << path << std::endl;
+    return false;
+  }
+
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#' || line.rfind("arrival", 0) == 0) {
+      continue;
+    }
+
+    std::istringstream fields(line);
+    std::string arrival, requestClass, maxTokens, promptTokens, outputTokens;
+    if (!std::getline(fields, arrival, ',') ||
+        !std::getline(fields, requestClass, ',') ||
+        !std::getline(fields, maxTokens, ',') ||
+        !std::getline(fields, promptTokens, ',') ||
+        !std::getline(fields, outputTokens, ',')) {
+      std::cerr << "Malformed trace line: " << line << std::endl;
+      return false;
+    }
+    trace.push_back(
+        {std::stod(arrival),
+         requestClass,
+         std::stoul(maxTokens),
+         std::stoul(promptTokens),
+         std::stoul(outputTokens)}
+    );
+  }
+
+  std::stable_sort(trace.begin(), trace.end(), [](const auto& a, const auto& b) {
+    return a.arrival < b.arrival;
+  });
+  return true;
+}
+
+// Chat-like mix: mostly short answers, some summaries, a few long essays,
+// arriving fast enough to keep the server's decoding about 75% busy.
+std::vector<TraceRequest> SyntheticTrace(double decodeRate) {
+  struct Class {
+    const char* name;
+    double share;
+    double meanTokens;
+    size_t maxTokens;
+  };
+  const Class classes[] = {
+      {"chat", 0.70, 40.0, 512},
+      {"summary", 0.22, 180.0, 512},
+      {"essay", 0.08, 900.0, 2048},
+  };
+
+  double meanTokens = 0.0;
+  for (const auto& c : classes) {
+    meanTokens += c.share * c.meanTokens;
+  }
+  const double arrivalRate = 0.75 * decodeRate / meanTokens;
+
+  std::mt19937_64 rng(42);
+  std::exponential_distribution<double> gap(arrivalRate);
+  std::uniform_real_distribution<double> pick(0.0, 1.0);
+  std::uniform_int_distribution<size_t> prompt(20, 400);
+
+  std::vector<TraceRequest> trace;
+  double time = 0.0;
+  for (int i = 0; i < 5000; ++i) {
+    time += gap(rng);
+
+    double u = pick(rng);
+    const Class* c = &classes[0];
+    for (const auto& candidate : classes) {
+      c = &candidate;
+      if ((u -= candidate.share) < 0.0) {
+        break;
+      }
+    }
+
+    std::lognormal_distribution<double> length(std::log(c->meanTokens), 0.5);
+    const auto output = std::min(
+        c->maxTokens, std::max<size_t>(1, static_cast<size_t>(length(rng)))
+    );
+    trace.push_back({time, c->name, c->maxTokens, prompt(rng), output});
+  }
+  return trace;
+}
+
+double Percentile(std::vector<double> values, double fraction) {
+  const size_t index = std::min(
+      values.size() - 1, static_cast<size_t>(fraction * values.size())
+  );
+  std::nth_element(values.begin(), values.begin() + index, values.end());
+  return values[index];
+}
+
+Result Simulate(
+    const std::vector<TraceRequest>& trace,
+    SchedulingPolicy policy,
+    double decodeRate,
+    double prefillRate
+) {
+  using Clock = RequestScheduler::Clock;
+  auto at = [](double seconds) {
+    return Clock::time_point(std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(seconds)
+    ));
+  };
+
+  SchedulerParams params;
+  params.policy = policy;
+  params.promptTokenCost = decodeRate / prefillRate;
+  RequestScheduler scheduler(params);
+
+  std::unordered_map<uint64_t, const TraceRequest*> pending;
+  std::vector<double> latencies;
+  latencies.reserve(trace.size());
+
+  double time = 0.0;
+  size_t next = 0;
+  while (latencies.size() < trace.size()) {
+    while (next < trace.size() && trace[next].arrival <= time) {
+      const auto& request = trace[next++];
+      const uint64_t id = scheduler.Submit(
+          request.requestClass,
+          request.maxTokens,
+          request.promptTokens,
+          at(request.arrival)
+      );
+      pending[id] = &request;
+    }
+
+    auto scheduled = scheduler.Next(at(time));
+    if (!scheduled) {
+      time = trace[next].arrival;
+      continue;
+    }
+
+    const TraceRequest& request = *pending[scheduled->id];
+    pending.erase(scheduled->id);
+
+    time += static_cast<double>(request.promptTokens) / prefillRate +
+            static_cast<double>(request.outputTokens) / decodeRate;
+    latencies.push_back(time - request.arrival);
+    scheduler.Complete(request.requestClass, request.outputTokens);
+  }
+
+  Result result;
+  for (double latency : latencies) {
+    result.mean += latency;
+    result.max = std::max(result.max, latency);
+  }
+  result.mean /= static_cast<double>(latencies.size());
+  result.p50 = Percentile(latencies, 0.50);
+  result.p99 = Percentile(latencies, 0.99);
+  result.maxWait = scheduler.GetStats().maxWaitSeconds;
+  return result;
+}
+
+void Print(const char* name, const Result& result) {
+  std::cout << name << "  mean " << result.mean << " s  p50 " << result.p50
+            << " s  p99 " << result.p99 << " s  max " << result.max
+            << " s  max wait " << result.maxWait << " s\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0]
+              << " <trace.csv | synthetic> [decode-tok/s] [prefill-tok/s]"
+              << std::endl;
+    return 1;
+  }
+
+  const double decodeRate = argc > 2 ? std::stod(argv[2]) : 30.0;
+  const double prefillRate = argc > 3 ? std::stod(argv[3]) : 600.0;
+
+  std::vector<TraceRequest> trace;
+  if (std::string(argv[1]) == "synthetic") {
+    trace = SyntheticTrace(decodeRate);
+  } else if (!LoadTrace(argv[1], trace)) {
+    return 1;
+  }
+  if (trace.empty()) {
+    std::cerr << "Empty trace" << std::endl;
+    return 1;
+  }
+
+  const Result fifo =
+      Simulate(trace, SchedulingPolicy::Fifo, decodeRate, prefillRate);
+  const Result sjf =
+      Simulate(trace, SchedulingPolicy::ShortestFirst, decodeRate, prefillRate);
+
+  std::cout << "requests: " << trace.size() << "\n";
+  Print("fifo:", fifo);
+  Print("sjf: ", sjf);
+  std::cout << "fifo/sjf mean: " << fifo.mean / sjf.mean << "x\n"
+            << "fifo/sjf p99:  " << fifo.p99 / sjf.p99 << "x" << std::endl;
+
+  return 0;
+}
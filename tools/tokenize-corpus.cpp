@@ -0,0 +1,75 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "llama-corpus.h"
+#include "llama-tokenizer.h"
+#include "request-file.h"
+
+// Tokenizes a request file once into a TokenCorpus that batch-generate
+// reads without tokenizing again.
+//
+// usage: tokenize-corpus <model.gguf> <requests.tsv> <output.corpus>
+//                        [threads]
+//
+// Each line of requests.tsv is "<id>\t<prompt>"; \n, \t and \\ in the
+// prompt are unescaped.
+
+namespace {
+
+constexpr size_t kRecordsPerAdd = 4096;
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 4) {
+    std::cerr << "usage: " << argv[0]
+              << " <model.gguf> <requests.tsv> <output.corpus> [threads]"
+              << std::endl;
+    return 1;
+  }
+
+  RequestFile file;
+  if (!file.Open(argv[2])) {
+    return 1;
+  }
+
+  LlamaTokenizer tokenizer;
+  if (!tokenizer.Initialize(argv[1], ModelParams())) {
+    return 1;
+  }
+
+  CorpusParams params;
+  if (argc > 4) {
+    params.nThreads = std::stoi(argv[4]);
+  }
+
+  TokenCorpusWriter writer(tokenizer);
+  if (!writer.Open(argv[3], params)) {
+    return 1;
+  }
+
+  // Read in chunks, so the input never has to fit in memory at once.
+  std::vector<CorpusRecord> records;
+  RequestLine request;
+  bool written = true;
+  while (written && file.Next(request)) {
+    records.push_back({request.id, request.prompt});
+    if (records.size() == kRecordsPerAdd) {
+      written = writer.Add(records);
+      records.clear();
+    }
+  }
+  if (!written || !writer.Add(records) || !writer.Close()) {
+    return 1;
+  }
+
+  const CorpusStats stats = writer.GetStats();
+  std::cout << "records:       " << stats.records << "\n"
+            << "tokens:        " << stats.tokens << "\n"
+            << "tokens/s:      " << stats.TokensPerSecond() << " ("
+            << stats.tokenizeSeconds << " s tokenizing)\n"
+            << "bytes written: " << stats.bytesWritten << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "llama-tokenizer.h"
+
+// Checks the native tokenizer token-for-token against llama_tokenize on a
+// text corpus and reports the throughput of both.
+//
+// usage: tokenizer-bench <model.gguf> <corpus.txt> [chunk-bytes]
+
+namespace {
+
+std::vector<std::string> SplitCorpus(const std::string& corpus, size_t size) {
+  std::vector<std::string> chunks;
+  size_t start = 0;
+  while (start < corpus.size()) {
+    size_t end = corpus.find('\n', std::min(start + size, corpus.size()));
+    end = end == std::string::npos ? corpus.size() : end + 1;
+    chunks.push_back(corpus.substr(start, end - start));
+    start = end;
+  }
+  return chunks;
+}
+
+double EncodeAll(
+    const LlamaTokenizer& tokenizer,
+    const std::vector<std::string>& chunks,
+    std::vector<std::vector<LlamaToken>>& results
+) {
+  results.clear();
+  results.reserve(chunks.size());
+
+  auto start = std::chrono::steady_clock::now();
+  for (const auto& chunk : chunks) {
+    results.push_back(tokenizer.Encode(chunk, false));
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double>(end - start).count();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0]
+              << " <model.gguf> <corpus.txt> [chunk-bytes]" << std::endl;
+    return 1;
+  }
+
+  std::ifstream file(argv[2], std::ios::binary);
+  if (!file) {
+    std::cerr << "Failed to open " << argv[2] << std::endl;
+    return 1;
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  const std::string corpus = buffer.str();
+  const size_t chunkBytes = argc > 3 ? std::stoul(argv[3]) : 4096;
+  const auto chunks = SplitCorpus(corpus, chunkBytes);
+
+  ModelParams modelParams;
+
+  LlamaTokenizer native;
+  if (!native.Initialize(argv[1], modelParams)) {
+    return 1;
+  }
+
+  modelParams.useNativeTokenizer = false;
+  LlamaTokenizer reference;
+  if (!reference.Initialize(argv[1], modelParams)) {
+    return 1;
+  }
+
+  std::vector<std::vector<LlamaToken>> nativeTokens;
+  std::vector<std::vector<LlamaToken>> referenceTokens;
+  const double nativeSeconds = EncodeAll(native, chunks, nativeTokens);
+  const double referenceSeconds = EncodeAll(reference, chunks, referenceTokens);
+
+  size_t mismatches = 0;
+  size_t totalTokens = 0;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    totalTokens += referenceTokens[i].size();
+
+    bool same = nativeTokens[i].size() == referenceTokens[i].size();
+    for (size_t j = 0; same && j < nativeTokens[i].size(); ++j) {
+      same = nativeTokens[i][j].tokenId == referenceTokens[i][j].tokenId;
+    }
+    if (!same && mismatches++ == 0) {
+      std::cerr << "First mismatch in chunk " << i << ":\n"
+                << chunks[i] << std::endl;
+    }
+  }
+
+  const double megabytes = static_cast<double>(corpus.size()) / (1 << 20);
+  std::cout << "chunks:     " << chunks.size() << "\n"
+            << "bytes:      " << corpus.size() << "\n"
+            << "tokens:     " << totalTokens << "\n"
+            << "mismatches: " << mismatches << "\n"
+            << "native:     " << megabytes / nativeSeconds << " MB/s\n"
+            << "llama:      " << megabytes / referenceSeconds << " MB/s\n"
+            << "speedup:    " << referenceSeconds / nativeSeconds << "x\n"
+            << "cache hits: "
+            << native.GetCacheStats().HitRate() * 100.0 << "%"
+            << std::endl;
+
+  return mismatches == 0 ? 0 : 1;
+}